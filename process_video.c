@@ -1,9 +1,13 @@
+#ifndef _WIN32
+    #define _POSIX_C_SOURCE 200809L  // clock_gettime, popen
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #ifdef _WIN32
+    #include <windows.h>  // QueryPerformanceCounter
     #include <direct.h>   // _mkdir
     #define MKDIR(path) _mkdir(path)
     #define COPY_CMD "copy /Y \"%s\" \"%s\""   // Windows copy
@@ -16,6 +20,21 @@
     #define PATH_SEP '/'
 #endif
 
+// Wall-clock seconds from a monotonic clock. clock() counts this process's
+// CPU time only, which misses the time spent waiting on ffmpeg.
+double wallSeconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
 // Get video height using ffprobe
 int getVideoHeight(const char *videoPath) {
     char cmd[1024];
@@ -43,19 +62,21 @@ typedef struct {
     int height;
 } Quality;
 
+// The default ladder, matching the "default" profile of process_video.cpp.
+// A static table, so it is not rebuilt on every call.
+static const Quality allQualities[] = {
+    {"2160", 2160}, // 4K
+    {"1440", 1440}, // 2K
+    {"1080", 1080}, // Full HD
+    {"720", 720},   // HD
+    {"480", 480},   // SD
+    {"360", 360},   // Low
+    {"240", 240},   // Very Low
+    {"144", 144}    // Lowest
+};
+
 // Get subordinate qualities based on input resolution
 int getSubordinateQualities(int inputHeight, Quality *outQualities, int maxCount) {
-    Quality allQualities[] = {
-        {"2160", 2160}, // 4K
-        {"1440", 1440}, // 2K
-        {"1080", 1080}, // Full HD
-        {"720", 720},   // HD
-        {"480", 480},   // SD
-        {"360", 360},   // Low
-        {"240", 240},   // Very Low
-        {"144", 144}    // Lowest
-    };
-
     int total = sizeof(allQualities) / sizeof(allQualities[0]);
     int count = 0;
 
@@ -83,7 +104,7 @@ void getStem(const char *videoPath, char *stem, size_t size) {
 
 // Process video
 void processVideo(const char *videoPath) {
-    clock_t start_time = clock();
+    double start_time = wallSeconds();
     
     char stem[256];
     getStem(videoPath, stem, sizeof(stem));
@@ -143,8 +164,7 @@ void processVideo(const char *videoPath) {
         }
     }
 
-    clock_t end_time = clock();
-    double total_time = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
+    double total_time = wallSeconds() - start_time;
     
     printf("\nProcessing complete. Files saved in folder: %s\n", stem);
     printf("Total processing time: %.2f seconds\n", total_time);
@@ -8,195 +8,6749 @@
 #include <chrono>
 #include <iomanip>
 #include <fstream>
+#include <cstdint>
+#include <cctype>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <set>
+#include <tuple>
+#include <numeric>
+#include <cmath>
 
 // Windows/POSIX compatibility
 #ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
     #include <direct.h>
     #include <io.h>
+    #include <fcntl.h>
     #define mkdir(path, mode) _mkdir(path)
+    #define rmdir(path) _rmdir(path)
     #define access(path, mode) _access(path, mode)
     #define F_OK 0
+    #define popen _popen
+    #define pclose _pclose
+    #define NULL_DEVICE "NUL"
+    #define fdopen _fdopen
 #else
     #include <unistd.h>
     #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <cerrno>
+    #include <cstring>
+    #include <csignal>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <netdb.h>
+    #include <dirent.h>
+    #include <glob.h>
+    #include <sys/resource.h>
+    #include <sys/mman.h>
+    #define NULL_DEVICE "/dev/null"
 #endif
 
-// Get video height using ffprobe
-int getVideoHeight(const std::string& videoPath) {
-    std::string tempFile = "temp_height.txt";
-    std::string cmd = "ffprobe -v error -select_streams v:0 -show_entries stream=height "
-                      "-of default=noprint_wrappers=1:nokey=1 \"" + videoPath + "\" > " + tempFile;
+#ifdef __linux__
+    #include <sys/ioctl.h>
+    #include <linux/fs.h>
+    #include <sched.h>
+    #include <sys/syscall.h>
+#endif
+
+class ProgressReporter;
+struct MediaInfo;
+
+// One rung of a ladder profile
+struct LadderRung {
+    int height;
+    int width;        // Output width (0 = from the source aspect ratio)
+    int maxFps;       // Frame rate cap (0 = keep the source rate)
+    int bitrateKbps;  // H.264 target bitrate, scaled for other codecs (0 = constant quality)
+};
+
+// A ladder profile: its rungs, highest first, and optional codec and
+// packaging defaults applied when the profile is selected
+struct LadderProfile {
+    const char* name;
+    const LadderRung* rungs;
+    size_t rungCount;
+    const char* codecs;      // --codecs syntax ("" = keep the options)
+    const char* package;     // hls, dash, both or none ("" = keep the options)
+    int segmentSeconds;      // 0 = keep the options
+};
+
+// Built-in profiles are static tables, so the default ladder needs no
+// parsing or allocation
+constexpr LadderRung defaultRungs[] = {
+    {2160, 0, 0, 0}, // 4K
+    {1440, 0, 0, 0}, // 2K
+    {1080, 0, 0, 0}, // Full HD
+    {720, 0, 0, 0},  // HD
+    {480, 0, 0, 0},  // SD
+    {360, 0, 0, 0},  // Low
+    {240, 0, 0, 0},  // Very Low
+    {144, 0, 0, 0}   // Lowest
+};
+
+// Predictable bitrates for cellular networks, capped at 30 fps
+constexpr LadderRung mobileRungs[] = {
+    {720, 0, 30, 2500},
+    {480, 0, 30, 1200},
+    {360, 0, 30, 700},
+    {240, 0, 30, 400},
+    {144, 0, 30, 200}
+};
+
+// The full ladder with AV1 from 720p up, packaged for HLS and DASH players
+constexpr LadderRung premiumRungs[] = {
+    {2160, 0, 0, 0},
+    {1440, 0, 0, 0},
+    {1080, 0, 0, 0},
+    {720, 0, 0, 0},
+    {480, 0, 0, 0},
+    {360, 0, 0, 0}
+};
+
+constexpr LadderProfile ladderProfiles[] = {
+    {"default", defaultRungs, sizeof(defaultRungs) / sizeof(defaultRungs[0]), "", "", 0},
+    {"mobile", mobileRungs, sizeof(mobileRungs) / sizeof(mobileRungs[0]), "h264", "hls", 6},
+    {"premium", premiumRungs, sizeof(premiumRungs) / sizeof(premiumRungs[0]), "h264,av1@720", "both", 4},
+};
+
+// A profile read from a JSON file, owning the storage its view points into
+struct LoadedProfile {
+    LadderProfile profile{};
+    std::string name;
+    std::string codecs;
+    std::string package;
+    std::vector<LadderRung> rungs;
+};
+
+// Pipeline options selected on the command line
+struct ProcessOptions {
+    bool singleDecode = false;   // Decode the source once and fan out to every rung
+    bool parallel = false;       // Run rungs concurrently through the rung scheduler
+    int threadBudget = 0;        // Total encoder threads across running rungs (0 = all cores)
+    bool cascade = false;        // Derive lower rungs from the nearest higher rung in one graph
+    double ssimTolerance = 0.01; // Max SSIM loss (1 - SSIM) a cascaded rung may accumulate
+    bool consumeInput = false;   // The upload may be moved into place as the original rung
+    std::string hwaccel = "none"; // Encode backend: none, auto, nvenc, qsv, vaapi, videotoolbox
+    int hwSessions = 0;          // Override for concurrent hardware encoder sessions (0 = backend default)
+    bool packageHls = false;     // Emit CMAF segments with HLS playlists for the ladder
+    bool packageDash = false;    // Emit CMAF segments with a DASH manifest for the ladder
+    int segmentSeconds = 4;      // Target segment duration; also the forced keyframe interval
+    bool follow = false;         // Input is still being written; encode as bytes arrive
+    int followIdleSeconds = 30;  // A growing input that stops growing this long is complete
+    std::string name;            // Output stem when reading from stdin
+    int chunks = 1;              // Split the source on keyframes into this many chunks per rung
+    int chunkMinHeight = 720;    // Only rungs at or above this height are chunked
+    int progressFd = -1;         // Write NDJSON progress events to this fd (-1 = off)
+    ProgressReporter* progress = nullptr; // Event sink for this job (nullptr = --progress-fd stream)
+    std::string daemonSocket;    // Serve jobs from a queue on this Unix socket
+    int maxJobs = 2;             // Daemon: jobs encoding at once
+    int queueSize = 64;          // Daemon: queued jobs before submissions are rejected
+    std::string cacheDir;        // Content-addressed output cache (empty = off)
+    bool perTitle = false;       // Pick rungs and bitrate caps from CRF trial encodes
+    std::string metricsOut;      // Write OpenMetrics text here at exit
+    bool resume = false;         // Skip pieces an earlier run recorded in the job manifest
+    std::string audio = "copy"; // Shared audio stage: copy (transcode only if needed), aac or opus
+    bool loudnorm = false;       // Loudness-normalize the shared audio (EBU R128)
+    bool previews = false;       // Cut a poster, sprite sheet and WebVTT track from the ladder decode
+    double spriteInterval = 10.0; // Seconds between sprite sheet tiles
+    std::string benchOut;        // Benchmark the corpus and write JSON results here
+    int benchRuns = 3;           // Bench: runs per corpus input
+    std::string outputDir;       // Scratch root the output folders are written under (empty = current directory)
+    std::string offloadCommand;  // Upload command template run for every finished output (empty = off)
+    int offloadJobs = 2;         // Uploads running at once
+    long long diskQuota = 0;     // Bytes of finished output folders kept locally (0 = unlimited)
+    int maxRungHeight = 0;       // Only encode rungs up to this height (0 = all)
+    bool partial = false;        // Stop after encoding; a later resumed run of the job finishes it
+    std::atomic<bool>* preempt = nullptr; // When set, stop at the next rung or chunk boundary
+    double deadline = 0.0;       // Daemon: seconds after submission the job should be done by (0 = none)
+    int playableHeight = 360;    // Daemon: rungs up to this height are encoded for every job first (0 = off)
+    std::string coordinate;      // Listen here for remote workers and send them every encode task (empty = encode locally)
+    std::string worker;          // Run as a worker pulling tasks from the coordinator at this address
+    int workerSlots = 1;         // Worker: tasks encoded at once, one coordinator connection each
+    std::string pathMap;         // Worker: FROM=TO rewrite of coordinator paths to where shared storage is mounted here
+    std::vector<std::pair<std::string, int>> codecs = {{"h264", 0}}; // Ladder codecs and the lowest rung each is encoded at
+    std::map<std::string, int> codecThreads; // Encoder threads reserved per codec pool (missing = even share)
+    bool twoPass = false;        // Bitrate targets and zones for every rung from one shared low-resolution first pass
+    const LadderProfile* profile = &ladderProfiles[0]; // Rung ladder to encode
+    std::shared_ptr<const LoadedProfile> loadedProfile; // Storage behind a profile read from a file
+    int fpsCapHeight = 480;      // Rungs at or below this height keep at most fpsCap frames per second
+    int fpsCap = 30;             // 0 = keep the source rate on every rung
+    std::string batch;           // List file, directory or glob of inputs processed in one run
+    int batchJobs = 0;           // Batch: inputs in flight at once (0 = a quarter of the thread budget)
+    const MediaInfo* probe = nullptr; // Probe result gathered up front, e.g. by --batch
+    std::vector<std::string> qualityMetrics; // Score rungs on sampled windows: ssim, psnr, vmaf (empty = off)
+    std::string qualityFloorMetric; // Metric the floor applies to (empty = no floor)
+    double qualityFloor = 0.0;   // Rungs scoring below this are re-encoded once with more bits
+    std::string cpus;            // CPUs the runner and its encoders may use, e.g. 0-7 (empty = all)
+    int nice = 0;                // Niceness of the runner, inherited by every ffmpeg it starts
+    std::string ioprio;          // I/O priority class inherited by ffmpeg: idle or best-effort[:0-7] (empty = unchanged)
+    long long memoryMax = 0;     // Memory ceiling per job's encoders via cgroup v2 (0 = none)
+    double psiLimit = 25.0;      // Hold new rungs while memory PSI (some avg10, %) exceeds this (0 = off)
+};
+
+// Serializes console output from concurrently running rungs
+std::mutex logMutex;
+
+// Escape a string for embedding in JSON
+std::string jsonEscape(const std::string& value) {
+    std::string out;
+    for (char c : value) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buffer[8];
+                    snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                    out += buffer;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+// Builds a single JSON object, one field at a time
+class JsonObject {
+public:
+    JsonObject() = default;
+    explicit JsonObject(const std::string& event) { add("event", event); }
+
+    JsonObject& add(const std::string& key, const std::string& value) {
+        return addRaw(key, "\"" + jsonEscape(value) + "\"");
+    }
+    JsonObject& add(const std::string& key, const char* value) { return add(key, std::string(value)); }
+    JsonObject& add(const std::string& key, bool value) { return addRaw(key, value ? "true" : "false"); }
+    JsonObject& add(const std::string& key, int value) { return addRaw(key, std::to_string(value)); }
+    JsonObject& add(const std::string& key, long long value) { return addRaw(key, std::to_string(value)); }
+    JsonObject& add(const std::string& key, double value) {
+        std::ostringstream number;
+        number << std::fixed << std::setprecision(3) << value;
+        return addRaw(key, number.str());
+    }
+    // Insert pre-serialized JSON, e.g. a nested object or array
+    JsonObject& addRaw(const std::string& key, const std::string& json) {
+        body_ += (body_.empty() ? "" : ",") + std::string("\"") + jsonEscape(key) + "\":" + json;
+        return *this;
+    }
+
+    std::string str() const { return "{" + body_ + "}"; }
+
+private:
+    std::string body_;
+};
+
+// Emits newline-delimited JSON progress events on a dedicated file
+// descriptor and tracks cost-weighted completion across all tasks of a job
+class ProgressReporter {
+public:
+    bool open(int fd) {
+        out_ = fdopen(fd, "w");
+        return out_ != nullptr;
+    }
+
+    // Deliver events to a callback instead of a file descriptor
+    void setSink(std::function<void(const std::string&)> sink) { sink_ = std::move(sink); }
+
+    bool enabled() const { return out_ != nullptr || sink_ != nullptr; }
+
+    void emit(const JsonObject& event) {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (sink_) {
+            sink_(event.str());
+            return;
+        }
+        fputs(event.str().c_str(), out_);
+        fputc('\n', out_);
+        fflush(out_);
+    }
+
+    // Register a task and the share of the job's work it represents
+    void plan(const std::string& task, double cost) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_[task] = {cost, 0.0};
+    }
+
+    // Record a task's completed fraction and return the job's overall percent
+    double update(const std::string& task, double fraction) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_[task].second = std::min(1.0, std::max(0.0, fraction));
+        double total = 0.0;
+        double done = 0.0;
+        for (const auto& entry : tasks_) {
+            total += entry.second.first;
+            done += entry.second.first * entry.second.second;
+        }
+        percent_ = total > 0.0 ? 100.0 * done / total : 0.0;
+        return percent_;
+    }
+
+    // Last overall percent, readable without taking the event lock
+    double percent() const { return percent_.load(); }
+
+private:
+    FILE* out_ = nullptr;
+    std::function<void(const std::string&)> sink_;
+    std::mutex mutex_;
+    std::atomic<double> percent_{0.0};
+    std::map<std::string, std::pair<double, double>> tasks_;  // cost, fraction
+};
+
+// Stream opened by --progress-fd; daemon jobs each get their own reporter
+ProgressReporter progressStream;
+
+// Seconds elapsed since construction, for stage timings
+class Stopwatch {
+public:
+    double seconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+};
+
+// A metric family: its OpenMetrics type, help text and histogram buckets
+struct MetricFamily {
+    const char* name;
+    const char* type;    // counter, gauge or histogram
+    const char* help;
+    std::vector<double> buckets;
+};
+
+const std::vector<MetricFamily>& metricFamilies() {
+    static const std::vector<double> latency = {0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 900, 3600};
+    static const std::vector<MetricFamily> families = {
+        {"process_video_stage_seconds", "histogram", "Wall time per pipeline stage", latency},
+        {"process_video_rung_encode_seconds", "histogram", "Wall time per rung or chunk encode", latency},
+        {"process_video_rung_wait_seconds", "histogram", "Time a rung waited for its turn after encoding began", latency},
+        {"process_video_rung_fps", "histogram", "Frames per second achieved by a rung encode",
+         {1, 5, 10, 25, 50, 100, 200, 400, 800, 1600}},
+        {"process_video_queue_wait_seconds", "histogram", "Time a daemon job waited in the queue", latency},
+        {"process_video_jobs", "counter", "Finished jobs by result", {}},
+        {"process_video_failures", "counter", "Failures by stage", {}},
+        {"process_video_input_bytes", "counter", "Bytes of input processed", {}},
+        {"process_video_output_bytes", "counter", "Bytes of rung output written", {}},
+        {"process_video_materialize", "counter", "Original rungs materialized by method", {}},
+        {"process_video_cache", "counter", "Output cache lookups by result", {}},
+        {"process_video_offload", "counter", "Output uploads by result", {}},
+        {"process_video_offload_bytes", "counter", "Bytes uploaded to object storage", {}},
+        {"process_video_evicted_bytes", "counter", "Bytes of local outputs evicted under the disk quota", {}},
+        {"process_video_resumed", "counter", "Pieces skipped because an earlier run finished them", {}},
+        {"process_video_preemptions", "counter", "Daemon jobs stopped at a chunk boundary for higher-ranked work", {}},
+        {"process_video_quality_actions", "counter", "Rungs re-encoded under the quality floor or dropped by per-title", {}},
+        {"process_video_pressure_holds", "counter", "Rung or daemon job starts held back by memory pressure", {}},
+        {"process_video_moov_relocations", "counter", "Output MP4s rewritten to put moov before mdat for the index", {}},
+        {"process_video_remote_tasks", "counter", "Rung and chunk encodes run by remote workers, by result", {}},
+        {"process_video_worker_steals", "counter", "Tasks a remote worker slot took from another slot's queue", {}},
+        {"process_video_workers_connected", "gauge", "Remote worker slots connected to the coordinator", {}},
+        {"process_video_daemon_submissions", "counter", "Daemon submissions by result", {}},
+        {"process_video_queue_depth", "gauge", "Daemon jobs waiting in the queue", {}},
+        {"process_video_jobs_running", "gauge", "Daemon jobs encoding now", {}},
+    };
+    return families;
+}
+
+// Process-wide counters, gauges and histograms, rendered in the OpenMetrics
+// text format. Updates happen per stage and per rung, not per frame, so one
+// mutex keeps them cheap enough.
+class Metrics {
+public:
+    void count(const std::string& family, const std::string& labels = "", double amount = 1.0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        series_[family][labels].value += amount;
+    }
+
+    void gauge(const std::string& family, double value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        series_[family][""].value = value;
+    }
+
+    void observe(const std::string& family, const std::string& labels, double value) {
+        const MetricFamily* meta = find(family);
+        if (!meta) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        Series& series = series_[family][labels];
+        series.buckets.resize(meta->buckets.size());
+        for (size_t i = 0; i < meta->buckets.size(); i++) {
+            series.buckets[i] += value <= meta->buckets[i] ? 1 : 0;
+        }
+        series.count++;
+        series.value += value;
+    }
+
+    std::string render() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+        for (const auto& meta : metricFamilies()) {
+            auto family = series_.find(meta.name);
+            if (family == series_.end()) {
+                continue;
+            }
+            std::string type = meta.type;
+            out << "# TYPE " << meta.name << " " << type << "\n# HELP " << meta.name << " " << meta.help << "\n";
+            for (const auto& entry : family->second) {
+                const std::string& labels = entry.first;
+                const Series& series = entry.second;
+                if (type != "histogram") {
+                    out << meta.name << (type == "counter" ? "_total" : "") << braces(labels) << " " << series.value << "\n";
+                    continue;
+                }
+                std::string prefix = labels.empty() ? "" : labels + ",";
+                for (size_t i = 0; i < meta.buckets.size(); i++) {
+                    out << meta.name << "_bucket{" << prefix << "le=\"" << meta.buckets[i] << "\"} " << series.buckets[i] << "\n";
+                }
+                out << meta.name << "_bucket{" << prefix << "le=\"+Inf\"} " << series.count << "\n"
+                    << meta.name << "_count" << braces(labels) << " " << series.count << "\n"
+                    << meta.name << "_sum" << braces(labels) << " " << series.value << "\n";
+            }
+        }
+        out << "# EOF\n";
+        return out.str();
+    }
+
+private:
+    struct Series {
+        std::vector<long long> buckets;  // Cumulative counts per bucket bound
+        long long count = 0;
+        double value = 0.0;              // Counter/gauge value, or histogram sum
+    };
+
+    static const MetricFamily* find(const std::string& name) {
+        for (const auto& meta : metricFamilies()) {
+            if (name == meta.name) {
+                return &meta;
+            }
+        }
+        return nullptr;
+    }
+
+    static std::string braces(const std::string& labels) { return labels.empty() ? "" : "{" + labels + "}"; }
+
+    std::mutex mutex_;
+    std::map<std::string, std::map<std::string, Series>> series_;
+};
+
+Metrics metrics;
+
+// Format one label pair, e.g. stage="probe"
+std::string metricLabel(const std::string& name, const std::string& value) {
+    return name + "=\"" + jsonEscape(value) + "\"";
+}
+
+// Media properties gathered by the probe
+struct MediaInfo {
+    int width = 0;                 // Coded width of the first video track
+    int height = 0;                // Coded height of the first video track
+    double fps = 0.0;
+    double duration = 0.0;         // Seconds
+    std::string videoCodec;        // ffmpeg codec name, e.g. "h264"
+    std::string audioCodec;        // Empty when there is no audio track
+    long long bitrate = 0;         // Overall bits per second
+    int rotation = 0;              // Display rotation in degrees (0, 90, 180, 270)
+    int bitDepth = 8;              // Luma bit depth
+    int colorTransfer = 0;         // ISO/IEC 23091-2 transfer characteristics, 0 if unknown
+    std::string codecTag;          // RFC 6381 codec string for manifests, e.g. "avc1.64001f"
+    bool hdr = false;              // PQ (SMPTE ST 2084) or HLG transfer
+    bool faststart = false;        // moov box precedes mdat
+    long long moovOffset = -1;     // File offset of the moov box, -1 if not found
+    long long fileSize = 0;
+
+    int displayWidth() const { return rotation % 180 == 0 ? width : height; }
+    int displayHeight() const { return rotation % 180 == 0 ? height : width; }
+};
+
+// Big-endian readers for ISO BMFF box parsing
+uint16_t readBe16(const unsigned char* p) {
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+uint32_t readBe32(const unsigned char* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+uint64_t readBe64(const unsigned char* p) {
+    return (static_cast<uint64_t>(readBe32(p)) << 32) | readBe32(p + 4);
+}
+
+// Step to the next box in [pos, end). On success type holds the fourcc and
+// [bodyStart, bodyEnd) the payload; pos is advanced past the box.
+bool nextBox(const std::vector<unsigned char>& buf, size_t& pos, size_t end,
+             std::string& type, size_t& bodyStart, size_t& bodyEnd) {
+    if (pos + 8 > end) {
+        return false;
+    }
+    uint64_t size = readBe32(&buf[pos]);
+    type.assign(reinterpret_cast<const char*>(&buf[pos + 4]), 4);
+    size_t header = 8;
+    if (size == 1) {
+        if (pos + 16 > end) {
+            return false;
+        }
+        size = readBe64(&buf[pos + 8]);
+        header = 16;
+    } else if (size == 0) {
+        size = end - pos;
+    }
+    if (size < header || size > end - pos) {
+        return false;
+    }
+    bodyStart = pos + header;
+    bodyEnd = pos + static_cast<size_t>(size);
+    pos = bodyEnd;
+    return true;
+}
+
+// Map an MP4 sample entry fourcc to the ffmpeg codec name
+std::string codecFromFourcc(const std::string& fourcc) {
+    static const std::map<std::string, std::string> codecs = {
+        {"avc1", "h264"}, {"avc3", "h264"}, {"hvc1", "hevc"}, {"hev1", "hevc"},
+        {"av01", "av1"},  {"vp09", "vp9"},  {"mp4v", "mpeg4"}, {"mp4a", "aac"},
+        {"Opus", "opus"}, {"ac-3", "ac3"},  {"ec-3", "eac3"}, {"fLaC", "flac"},
+        {".mp3", "mp3"},  {"alac", "alac"}
+    };
+    auto it = codecs.find(fourcc);
+    return it != codecs.end() ? it->second : fourcc;
+}
+
+// Properties collected from a single trak box
+struct TrackInfo {
+    std::string handler;           // "vide" or "soun"
+    std::string codec;
+    int width = 0;
+    int height = 0;
+    int rotation = 0;
+    uint32_t timescale = 0;
+    uint64_t mediaDuration = 0;
+    uint64_t sampleCount = 0;
+    uint64_t sampleDuration = 0;   // Sum of stts deltas
+    int bitDepth = 8;
+    int colorTransfer = 0;
+    std::string codecTag;
+};
+
+// Read bit depth and colour info from the configuration boxes of a visual sample entry
+void parseVisualConfig(const std::vector<unsigned char>& buf, size_t pos, size_t end, TrackInfo& track) {
+    std::string type;
+    size_t bodyStart, bodyEnd;
+    while (nextBox(buf, pos, end, type, bodyStart, bodyEnd)) {
+        size_t len = bodyEnd - bodyStart;
+        const unsigned char* body = &buf[bodyStart];
+        char tag[64];
+        if (type == "hvcC" && len > 17) {
+            track.bitDepth = (body[17] & 0x07) + 8;
+            // hvc1.<space><profile>.<reversed compatibility flags>.<tier><level>[.<constraint bytes>]
+            uint32_t compatibility = readBe32(body + 2);
+            uint32_t reversed = 0;
+            for (int bit = 0; bit < 32; bit++) {
+                reversed |= ((compatibility >> bit) & 1u) << (31 - bit);
+            }
+            int space = body[1] >> 6;
+            char spaceTag[2] = {space ? static_cast<char>('A' + space - 1) : '\0', '\0'};
+            snprintf(tag, sizeof(tag), "hvc1.%s%d.%X.%c%d", spaceTag, body[1] & 0x1f, reversed,
+                     (body[1] & 0x20) ? 'H' : 'L', body[12]);
+            track.codecTag = tag;
+            int last = 11;
+            while (last >= 6 && body[last] == 0) {
+                last--;
+            }
+            for (int i = 6; i <= last; i++) {
+                snprintf(tag, sizeof(tag), ".%X", body[i]);
+                track.codecTag += tag;
+            }
+        } else if (type == "av1C" && len > 2) {
+            track.bitDepth = (body[2] & 0x40) ? ((body[2] & 0x20) ? 12 : 10) : 8;
+            snprintf(tag, sizeof(tag), "av01.%d.%02d%c.%02d", body[1] >> 5, body[1] & 0x1f, (body[2] & 0x80) ? 'H' : 'M',
+                     track.bitDepth);
+            track.codecTag = tag;
+        } else if (type == "vpcC" && len > 8) {
+            track.bitDepth = body[6] >> 4;
+            track.colorTransfer = body[8];
+            snprintf(tag, sizeof(tag), "vp09.%02d.%02d.%02d", body[4], body[5], track.bitDepth);
+            track.codecTag = tag;
+        } else if (type == "avcC" && len > 6) {
+            int profile = body[1];
+            snprintf(tag, sizeof(tag), "avc1.%02x%02x%02x", body[1], body[2], body[3]);
+            track.codecTag = tag;
+            size_t p = 5;
+            int numSps = body[p++] & 0x1f;
+            for (int i = 0; i < numSps && p + 2 <= len; i++) {
+                p += 2 + readBe16(body + p);
+            }
+            if (p < len) {
+                int numPps = body[p++];
+                for (int i = 0; i < numPps && p + 2 <= len; i++) {
+                    p += 2 + readBe16(body + p);
+                }
+            }
+            bool highProfile = profile == 100 || profile == 110 || profile == 122 || profile == 244;
+            if (highProfile && p + 2 <= len) {
+                track.bitDepth = (body[p + 1] & 0x07) + 8;
+            }
+        } else if (type == "colr" && len >= 10 && std::string(reinterpret_cast<const char*>(body), 4) == "nclx") {
+            track.colorTransfer = readBe16(body + 6);
+        }
+    }
+}
+
+// Parse the first sample entry of an stsd box
+void parseSampleDescription(const std::vector<unsigned char>& buf, size_t start, size_t end, TrackInfo& track) {
+    size_t pos = start + 8;  // version/flags + entry_count
+    std::string type;
+    size_t bodyStart, bodyEnd;
+    if (!nextBox(buf, pos, end, type, bodyStart, bodyEnd)) {
+        return;
+    }
+    track.codec = codecFromFourcc(type);
+    if (track.handler == "vide" && bodyEnd - bodyStart >= 78) {
+        track.width = readBe16(&buf[bodyStart + 24]);
+        track.height = readBe16(&buf[bodyStart + 26]);
+        parseVisualConfig(buf, bodyStart + 78, bodyEnd, track);
+        if ((type == "hev1" || type == "avc3") && track.codecTag.size() > 4) {
+            track.codecTag.replace(0, 4, type);  // The tag names the sample entry actually used
+        }
+    }
+}
+
+// Walk the boxes of a trak, descending into the containers we care about
+void parseTrackBoxes(const std::vector<unsigned char>& buf, size_t pos, size_t end, TrackInfo& track) {
+    std::string type;
+    size_t bodyStart, bodyEnd;
+    while (nextBox(buf, pos, end, type, bodyStart, bodyEnd)) {
+        size_t len = bodyEnd - bodyStart;
+        const unsigned char* body = &buf[bodyStart];
+        if (type == "mdia" || type == "minf" || type == "stbl") {
+            parseTrackBoxes(buf, bodyStart, bodyEnd, track);
+        } else if (type == "tkhd" && len >= 84) {
+            // Matrix starts after the version-dependent times, ids and layer fields
+            size_t matrix = body[0] == 1 ? 52 : 40;
+            if (matrix + 16 <= len) {
+                int32_t a = static_cast<int32_t>(readBe32(body + matrix));
+                int32_t b = static_cast<int32_t>(readBe32(body + matrix + 4));
+                if (a == 0 && b > 0) track.rotation = 90;
+                else if (a == 0 && b < 0) track.rotation = 270;
+                else if (a < 0 && b == 0) track.rotation = 180;
+            }
+        } else if (type == "mdhd" && len >= 24) {
+            if (body[0] == 1 && len >= 36) {
+                track.timescale = readBe32(body + 20);
+                track.mediaDuration = readBe64(body + 24);
+            } else {
+                track.timescale = readBe32(body + 12);
+                track.mediaDuration = readBe32(body + 16);
+            }
+        } else if (type == "hdlr" && len >= 12) {
+            track.handler.assign(reinterpret_cast<const char*>(body + 8), 4);
+        } else if (type == "stsd") {
+            parseSampleDescription(buf, bodyStart, bodyEnd, track);
+        } else if (type == "stts" && len >= 8) {
+            uint32_t entries = readBe32(body + 4);
+            for (uint32_t i = 0; i < entries && 8 + (i + 1) * 8 <= len; i++) {
+                uint64_t count = readBe32(body + 8 + i * 8);
+                track.sampleCount += count;
+                track.sampleDuration += count * readBe32(body + 12 + i * 8);
+            }
+        }
+    }
+}
+
+// Fill info from a moov box payload
+void parseMovie(const std::vector<unsigned char>& buf, MediaInfo& info) {
+    size_t pos = 0;
+    std::string type;
+    size_t bodyStart, bodyEnd;
+    bool haveVideo = false;
+    while (nextBox(buf, pos, buf.size(), type, bodyStart, bodyEnd)) {
+        const unsigned char* body = &buf[bodyStart];
+        size_t len = bodyEnd - bodyStart;
+        // Version 1 widens the times to 64 bits, moving timescale and duration
+        if (type == "mvhd" && len >= 20 && len >= (body[0] == 1 ? 32u : 20u)) {
+            uint32_t timescale = body[0] == 1 ? readBe32(body + 20) : readBe32(body + 12);
+            uint64_t duration = body[0] == 1 ? readBe64(body + 24) : readBe32(body + 16);
+            if (timescale > 0) {
+                info.duration = static_cast<double>(duration) / timescale;
+            }
+        } else if (type == "trak") {
+            TrackInfo track;
+            parseTrackBoxes(buf, bodyStart, bodyEnd, track);
+            if (track.handler == "vide" && !haveVideo) {
+                haveVideo = true;
+                info.width = track.width;
+                info.height = track.height;
+                info.rotation = track.rotation;
+                info.videoCodec = track.codec;
+                info.bitDepth = track.bitDepth;
+                info.colorTransfer = track.colorTransfer;
+                info.codecTag = track.codecTag;
+                if (track.sampleDuration > 0 && track.timescale > 0) {
+                    info.fps = static_cast<double>(track.sampleCount) * track.timescale / track.sampleDuration;
+                }
+            } else if (track.handler == "soun" && info.audioCodec.empty()) {
+                info.audioCodec = track.codec;
+            }
+        }
+    }
+}
+
+// Bytes of memory available to new work, or -1 when unknown
+long long availableMemory() {
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status)) {
+        return static_cast<long long>(status.ullAvailPhys);
+    }
+#endif
+#ifdef __linux__
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+        if (line.compare(0, 13, "MemAvailable:") == 0) {
+            return std::atoll(line.c_str() + 13) * 1024;
+        }
+    }
+#endif
+#ifdef _SC_AVPHYS_PAGES
+    long pages = sysconf(_SC_AVPHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pageSize > 0) {
+        return static_cast<long long>(pages) * pageSize;
+    }
+#endif
+    return -1;
+}
+
+// Parse a CPU list such as "0-3,8,10-11" into CPU numbers
+bool parseCpuList(const std::string& text, std::vector<int>& cpus) {
+    std::stringstream list(text);
+    std::string range;
+    while (std::getline(list, range, ',')) {
+        size_t dash = range.find('-');
+        char* end = nullptr;
+        long first = std::strtol(range.c_str(), &end, 10);
+        long last = dash == std::string::npos ? first : std::strtol(range.c_str() + dash + 1, &end, 10);
+        if (range.empty() || *end != '\0' || first < 0 || last < first || last >= 1024) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+    }
+    return !cpus.empty();
+}
+
+// Pin the runner to a CPU set and lower its CPU and I/O priority. Every
+// ffmpeg child inherits all three, which keeps encodes off cores and disk
+// bandwidth the serving path needs. Called before any thread is started,
+// since Linux applies niceness and I/O priority per thread.
+bool applyProcessLimits(const ProcessOptions& options) {
+    std::vector<int> cpus;
+    if (!options.cpus.empty() && !parseCpuList(options.cpus, cpus)) {
+        std::cerr << "Error: --cpus expects a CPU list, e.g. 0-3,8" << std::endl;
+        return false;
+    }
+#ifdef _WIN32
+    if (!cpus.empty()) {
+        DWORD_PTR mask = 0;
+        for (int cpu : cpus) {
+            mask |= cpu < static_cast<int>(sizeof(mask) * 8) ? static_cast<DWORD_PTR>(1) << cpu : 0;
+        }
+        if (!SetProcessAffinityMask(GetCurrentProcess(), mask)) {
+            std::cerr << "Error: Could not set CPU affinity to " << options.cpus << std::endl;
+            return false;
+        }
+    }
+    // Windows has priority classes rather than nice values; children
+    // inherit the below-normal and idle classes
+    if (options.nice > 0) {
+        SetPriorityClass(GetCurrentProcess(), options.nice >= 15 ? IDLE_PRIORITY_CLASS : BELOW_NORMAL_PRIORITY_CLASS);
+    }
+    if (!options.ioprio.empty()) {
+        std::cout << "I/O priority classes are not available on Windows, --ioprio ignored" << std::endl;
+    }
+#else
+#ifdef __linux__
+    if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            std::cerr << "Error: Could not set CPU affinity to " << options.cpus << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    if (!options.ioprio.empty()) {
+        // ioprio_set has no libc wrapper; class in the top bits, level below
+        const int whoProcess = 1, classShift = 13;
+        size_t colon = options.ioprio.find(':');
+        std::string name = options.ioprio.substr(0, colon);
+        int level = colon == std::string::npos ? 4 : std::atoi(options.ioprio.c_str() + colon + 1);
+        int ioClass = name == "best-effort" ? 2 : 3;
+        if (syscall(SYS_ioprio_set, whoProcess, 0, (ioClass << classShift) | (ioClass == 3 ? 0 : level)) != 0) {
+            std::cerr << "Warning: Could not set I/O priority " << options.ioprio << ": " << strerror(errno) << std::endl;
+        }
+    }
+#else
+    if (!cpus.empty() || !options.ioprio.empty()) {
+        std::cout << "CPU affinity and I/O priority need Linux, --cpus and --ioprio ignored" << std::endl;
+    }
+#endif
+    if (options.nice != 0 && setpriority(PRIO_PROCESS, 0, options.nice) != 0) {
+        std::cerr << "Warning: Could not set niceness " << options.nice << ": " << strerror(errno) << std::endl;
+    }
+#endif
+    return true;
+}
+
+// Memory pressure from the kernel's PSI accounting (Linux 4.20+): the share
+// of the last 10 seconds in which some task stalled waiting for memory.
+// New rungs are held while it is over the limit, so encodes back off before
+// the machine starts thrashing and the serving path stalls with it.
+class MemoryPressure {
+public:
+    void configure(double limit) { limit_ = limit; }
+
+    // "some avg10" in percent, or -1 where PSI is unavailable. The file is
+    // read at most once a second.
+    double current() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (read_.seconds() >= 1.0 || !fresh_) {
+            std::ifstream pressure("/proc/pressure/memory");
+            std::string line;
+            value_ = -1.0;
+            if (std::getline(pressure, line) && line.compare(0, 11, "some avg10=") == 0) {
+                value_ = std::atof(line.c_str() + 11);
+            }
+            read_ = Stopwatch();
+            fresh_ = true;
+        }
+        return value_;
+    }
+
+    bool high() { return limit_ > 0.0 && current() > limit_; }
+    double limit() const { return limit_; }
+
+private:
+    std::mutex mutex_;
+    double limit_ = 0.0;
+    double value_ = -1.0;
+    bool fresh_ = false;
+    Stopwatch read_;
+};
+
+MemoryPressure memoryPressure;
+
+// Per-job cgroup v2 groups holding a memory ceiling for the job's encoder
+// children. cgroup v2 only allows processes in leaf groups once a
+// controller is enabled for the children, so the runner first moves itself
+// into a leaf of its own cgroup; job groups are created beside it. This
+// needs the runner's cgroup delegated to it, e.g. systemd's Delegate=yes,
+// and is skipped with a notice otherwise.
+class CgroupGovernor {
+public:
+    // Create a group capped at memoryMax bytes; returns its directory, or
+    // empty when cgroups cannot be used
+    std::string create(long long memoryMax) {
+#ifdef __linux__
+        std::call_once(setup_, [this] { base_ = delegate(); });
+        if (base_.empty()) {
+            return "";
+        }
+        std::string group = base_ + "/process_video-" + std::to_string(getpid()) + "-job" + std::to_string(next_++);
+        // memory.high reclaims and throttles before memory.max kills; the
+        // whole group is killed together so no half-finished ffmpeg lingers
+        if (mkdir(group.c_str(), 0755) != 0 || !writeFile(group + "/memory.max", std::to_string(memoryMax)) ||
+            !writeFile(group + "/memory.high", std::to_string(memoryMax / 10 * 9))) {
+            std::cerr << "Warning: Could not create cgroup " << group << ": " << strerror(errno) << std::endl;
+            rmdir(group.c_str());
+            return "";
+        }
+        writeFile(group + "/memory.oom.group", "1");
+        return group;
+#else
+        (void)memoryMax;
+        std::call_once(setup_, [] { std::cout << "Memory ceilings need cgroup v2 on Linux, --memory-max ignored" << std::endl; });
+        return "";
+#endif
+    }
+
+    // A group is removed once its processes have exited
+    void remove(const std::string& group) {
+        if (!group.empty()) {
+            rmdir(group.c_str());
+        }
+    }
+
+private:
+#ifdef __linux__
+    static bool writeFile(const std::string& path, const std::string& value) {
+        std::ofstream out(path);
+        out << value << std::flush;
+        return out.good();
+    }
+
+    // The cgroup directory job groups go in, or empty if it cannot be used
+    std::string delegate() {
+        std::ifstream self("/proc/self/cgroup");
+        std::string line, path;
+        while (std::getline(self, line)) {
+            path = line.compare(0, 3, "0::") == 0 ? line.substr(3) : path;
+        }
+        std::string base = "/sys/fs/cgroup" + (path == "/" ? "" : path);
+        std::ifstream controllers(base + "/cgroup.controllers");
+        std::string available;
+        std::getline(controllers, available);
+        std::string runner = base + "/process_video-" + std::to_string(getpid()) + "-runner";
+        bool ok = !path.empty() && (" " + available + " ").find(" memory ") != std::string::npos &&
+                  (mkdir(runner.c_str(), 0755) == 0 || errno == EEXIST) &&
+                  writeFile(runner + "/cgroup.procs", std::to_string(getpid())) &&
+                  writeFile(base + "/cgroup.subtree_control", "+memory");
+        if (!ok) {
+            std::cout << "cgroup v2 memory controller not delegated to " << base << ", --memory-max ignored" << std::endl;
+            return "";
+        }
+        std::cout << "Encoder memory ceilings in cgroup " << base << std::endl;
+        return base;
+    }
+#endif
+
+    std::once_flag setup_;
+    std::string base_;
+    std::atomic<int> next_{0};
+};
+
+CgroupGovernor cgroups;
+
+// Read-only mapping of a whole file. Readers in this process (probe, hash)
+// use the mapping instead of their own buffered copies. The page cache
+// behind it is the one every ffmpeg process reading the same file uses, so
+// prefetching it once means the ladder reads the source from disk once.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER size;
+        if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size)) {
+            close();
+            return false;
+        }
+        size_ = static_cast<long long>(size.QuadPart);
+        if (size_ > 0) {
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            data_ = mapping_ ? static_cast<const unsigned char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        }
+#else
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd_ < 0 || fstat(fd_, &st) != 0) {
+            close();
+            return false;
+        }
+        size_ = static_cast<long long>(st.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, static_cast<size_t>(size_), PROT_READ, MAP_SHARED, fd_, 0);
+            data_ = data == MAP_FAILED ? nullptr : static_cast<const unsigned char*>(data);
+        }
+#endif
+        if (size_ > 0 && !data_) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_) munmap(const_cast<unsigned char*>(data_), static_cast<size_t>(size_));
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    const unsigned char* data() const { return data_; }
+    long long size() const { return size_; }
+
+    // Reads through the mapping go front to back; read ahead aggressively
+    // and drop pages behind the reader early
+    void adviseSequential() const {
+#ifndef _WIN32
+        if (data_) {
+            madvise(const_cast<unsigned char*>(data_), static_cast<size_t>(size_), MADV_SEQUENTIAL);
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        if (fd_ >= 0) {
+            posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+#endif
+#endif
+    }
+
+    // Start loading [offset, offset + length) into the page cache in the background
+    void prefetch(long long offset, long long length) const {
+        if (!data_ || offset >= size_) {
+            return;
+        }
+        length = std::min(length, size_ - offset);
+#ifdef _WIN32
+        WIN32_MEMORY_RANGE_ENTRY range = {const_cast<unsigned char*>(data_) + offset, static_cast<SIZE_T>(length)};
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+        long long page = sysconf(_SC_PAGESIZE);
+        long long start = offset - offset % page;
+        madvise(const_cast<unsigned char*>(data_) + start, static_cast<size_t>(offset + length - start), MADV_WILLNEED);
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fd_, offset, length, POSIX_FADV_WILLNEED);
+#endif
+#endif
+    }
+
+private:
+    const unsigned char* data_ = nullptr;
+    long long size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+// Parse the ISO BMFF box structure directly. Only the top-level box headers
+// and the moov payload are touched through the mapping, so probing a large
+// file faults in a few pages.
+bool probeMp4(const std::string& videoPath, MediaInfo& info) {
+    MappedFile file;
+    if (!file.open(videoPath)) {
+        return false;
+    }
+    long long fileSize = file.size();
+    info.fileSize = fileSize;
+
+    long long pos = 0;
+    long long mdatOffset = -1;
+    std::vector<unsigned char> moov;
+    while (pos + 8 <= fileSize) {
+        const unsigned char* header = file.data() + pos;
+        uint64_t size = readBe32(header);
+        std::string type(reinterpret_cast<const char*>(header + 4), 4);
+        long long headerSize = 8;
+        if (size == 1) {
+            if (pos + 16 > fileSize) {
+                return false;
+            }
+            size = readBe64(header + 8);
+            headerSize = 16;
+        } else if (size == 0) {
+            size = static_cast<uint64_t>(fileSize - pos);
+        }
+        if (size < static_cast<uint64_t>(headerSize) || pos + static_cast<long long>(size) > fileSize) {
+            break;  // Truncated or still being written
+        }
+
+        if (type == "mdat" && mdatOffset < 0) {
+            mdatOffset = pos;
+        } else if (type == "moov") {
+            const uint64_t maxMoov = 256ull * 1024 * 1024;
+            if (size > maxMoov) {
+                return false;
+            }
+            moov.assign(header + headerSize, header + size);
+            info.moovOffset = pos;
+            info.faststart = mdatOffset < 0;
+            break;
+        }
+        pos += static_cast<long long>(size);
+    }
+
+    if (moov.empty()) {
+        return false;
+    }
+    parseMovie(moov, info);
+    return info.height > 0;
+}
+
+// Fallback for containers the box parser does not handle. ffprobe output is
+// read through a pipe, one compact line per stream plus one for the format.
+bool probeWithFfprobe(const std::string& videoPath, MediaInfo& info) {
+    std::string cmd = "ffprobe -v error -show_entries "
+                      "stream=codec_type,codec_name,width,height,r_frame_rate,bits_per_raw_sample,color_transfer:"
+                      "stream_tags=rotate:format=duration,bit_rate,size -of compact=p=0 \"" + videoPath + "\"";
+    FILE* pipe = popen(cmd.c_str(), "r");
+    if (!pipe) {
+        std::cerr << "Error: Failed to execute ffprobe. Is it installed and in your PATH?" << std::endl;
+        return false;
+    }
+
+    bool haveVideo = false;
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), pipe)) {
+        std::map<std::string, std::string> fields;
+        std::stringstream line(buffer);
+        std::string item;
+        while (std::getline(line, item, '|')) {
+            size_t eq = item.find('=');
+            if (eq != std::string::npos) {
+                size_t last = item.find_last_not_of(" \t\n\r");
+                fields[item.substr(0, eq)] = item.substr(eq + 1, last == std::string::npos ? 0 : last - eq);
+            }
+        }
+        bool isStream = fields.count("codec_type") > 0;
+        try {
+            if (fields["codec_type"] == "video" && !haveVideo) {
+                haveVideo = true;
+                info.videoCodec = fields["codec_name"];
+                info.width = std::stoi(fields["width"]);
+                info.height = std::stoi(fields["height"]);
+                size_t slash = fields["r_frame_rate"].find('/');
+                if (slash != std::string::npos) {
+                    double den = std::stod(fields["r_frame_rate"].substr(slash + 1));
+                    info.fps = den > 0 ? std::stod(fields["r_frame_rate"].substr(0, slash)) / den : 0.0;
+                }
+                if (!fields["bits_per_raw_sample"].empty() && fields["bits_per_raw_sample"] != "N/A") {
+                    info.bitDepth = std::stoi(fields["bits_per_raw_sample"]);
+                }
+                if (fields["color_transfer"] == "smpte2084") info.colorTransfer = 16;
+                else if (fields["color_transfer"] == "arib-std-b67") info.colorTransfer = 18;
+                if (!fields["tag:rotate"].empty()) {
+                    info.rotation = ((std::stoi(fields["tag:rotate"]) % 360) + 360) % 360;
+                }
+            } else if (fields["codec_type"] == "audio" && info.audioCodec.empty()) {
+                info.audioCodec = fields["codec_name"];
+            } else if (!isStream && fields.count("duration")) {
+                info.duration = std::stod(fields["duration"]);
+                if (fields["size"] != "N/A" && !fields["size"].empty()) {
+                    info.fileSize = std::stoll(fields["size"]);
+                }
+                if (fields["bit_rate"] != "N/A" && !fields["bit_rate"].empty()) {
+                    info.bitrate = std::stoll(fields["bit_rate"]);
+                }
+            }
+        } catch (const std::exception&) {
+            // Leave fields that failed to parse at their defaults
+        }
+    }
+    int result = pclose(pipe);
+    if (result != 0 || info.height <= 0) {
+        std::cerr << "Error: ffprobe could not read video stream information." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Probe the input: MP4/MOV is parsed in-process, anything else goes through ffprobe
+bool probeMedia(const std::string& videoPath, MediaInfo& info) {
+    info = MediaInfo();
+    if (!probeMp4(videoPath, info)) {
+        info = MediaInfo();
+        if (!probeWithFfprobe(videoPath, info)) {
+            return false;
+        }
+    }
+    if (info.bitrate == 0 && info.duration > 0.0) {
+        info.bitrate = static_cast<long long>(info.fileSize * 8 / info.duration);
+    }
+    info.hdr = info.colorTransfer == 16 || info.colorTransfer == 18;
+    return true;
+}
+
+// Whether ffmpeg was built with the named filter; the list is read once
+bool hasFfmpegFilter(const std::string& name) {
+    static std::once_flag once;
+    static std::string filters;
+    std::call_once(once, [] {
+        FILE* pipe = popen("ffmpeg -hide_banner -filters 2>" NULL_DEVICE, "r");
+        if (pipe) {
+            char buffer[512];
+            while (fgets(buffer, sizeof(buffer), pipe)) {
+                filters += buffer;
+            }
+            pclose(pipe);
+        }
+    });
+    return filters.find(" " + name + " ") != std::string::npos;
+}
+
+// Whether ffmpeg has the zimg-based zscale filter tone mapping needs
+bool hasZscale() {
+    return hasFfmpegFilter("zscale");
+}
+
+// Filters bringing a rung's frames down to the 8-bit BT.709 SDR every rung
+// is encoded in: PQ and HLG are tone-mapped, other 10-bit sources only
+// change pixel format. Empty for 8-bit SDR sources.
+std::string sdrFilter(const MediaInfo& info) {
+    if (info.hdr && hasZscale()) {
+        return "zscale=t=linear:npl=100,format=gbrpf32le,zscale=p=bt709,tonemap=tonemap=hable:desat=0,"
+               "zscale=t=bt709:m=bt709:r=tv,format=yuv420p";
+    }
+    return info.hdr || info.bitDepth > 8 ? "format=yuv420p" : "";
+}
+
+// Source frames per kept frame for a rung capped at cap fps: the source
+// rate divided by the smallest whole number that brings it under the cap,
+// so the kept frames stay evenly spaced (60 -> 30, 50 -> 25, 120 -> 30)
+int fpsFrameStep(double sourceFps, int cap) {
+    if (cap <= 0 || sourceFps <= cap + 0.01) {
+        return 1;
+    }
+    return std::max(1, static_cast<int>(std::ceil(sourceFps / cap - 0.001)));
+}
+
+// Get subordinate qualities based on input resolution: the profile's rungs
+// below the input height (YouTube style by default)
+std::vector<std::pair<std::string, int>> getSubordinateQualities(int inputHeight,
+                                                                 const LadderProfile& profile = ladderProfiles[0]) {
+    std::vector<std::pair<std::string, int>> subordinateQualities;
+    
+    // Only include qualities that are lower than input resolution
+    for (size_t i = 0; i < profile.rungCount; i++) {
+        if (profile.rungs[i].height < inputHeight) {
+            subordinateQualities.push_back({std::to_string(profile.rungs[i].height), profile.rungs[i].height});
+        }
+    }
+    
+    return subordinateQualities;
+}
+
+// The profile's rung at the given height, or nullptr
+const LadderRung* findLadderRung(const LadderProfile& profile, int height) {
+    for (size_t i = 0; i < profile.rungCount; i++) {
+        if (profile.rungs[i].height == height) {
+            return &profile.rungs[i];
+        }
+    }
+    return nullptr;
+}
+
+// Key text for a profile's ladder, e.g. "mobile:720x0@30/2500,..."
+std::string profileKey(const LadderProfile& profile) {
+    std::string key = std::string(profile.name) + ":";
+    for (size_t i = 0; i < profile.rungCount; i++) {
+        const LadderRung& rung = profile.rungs[i];
+        key += (i ? "," : "") + std::to_string(rung.height) + "x" + std::to_string(rung.width) + "@" +
+               std::to_string(rung.maxFps) + "/" + std::to_string(rung.bitrateKbps);
+    }
+    return key;
+}
+
+// Helper function to extract filename without extension
+std::string getFilenameStem(const std::string& path) {
+    size_t lastSlash = path.find_last_of("/\\");
+    size_t start = (lastSlash == std::string::npos) ? 0 : lastSlash + 1;
+    size_t lastDot = path.find_last_of('.');
+    size_t end = (lastDot == std::string::npos || lastDot < start) ? path.length() : lastDot;
+    return path.substr(start, end - start);
+}
+
+// Helper function to copy file
+bool copyFile(const std::string& src, const std::string& dst) {
+    std::ifstream source(src, std::ios::binary);
+    std::ofstream dest(dst, std::ios::binary);
+    
+    if (!source || !dest) {
+        return false;
+    }
+    
+    dest << source.rdbuf();
+    return source.good() && dest.good();
+}
+
+#ifdef __linux__
+// Clone src into dst with a FICLONE reflink, falling back to copy_file_range()
+// which lets the kernel copy (or share extents) without a userspace round trip
+std::string kernelCopy(const std::string& src, const std::string& dst) {
+    int in = open(src.c_str(), O_RDONLY);
+    if (in < 0) {
+        return "";
+    }
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return "";
+    }
+
+    std::string method;
+    if (ioctl(out, FICLONE, in) == 0) {
+        method = "reflink";
+    } else {
+        struct stat st;
+        if (fstat(in, &st) == 0) {
+            off_t remaining = st.st_size;
+            while (remaining > 0) {
+                ssize_t n = copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(remaining), 0);
+                if (n <= 0) {
+                    break;
+                }
+                remaining -= n;
+            }
+            if (remaining == 0) {
+                method = "copy_file_range";
+            }
+        }
+    }
+    close(in);
+    close(out);
+    if (method.empty()) {
+        remove(dst.c_str());
+    }
+    return method;
+}
+#endif
+
+// Produce dst with the same contents as src as cheaply as the platform
+// allows: rename (when the input may be consumed), hardlink, reflink,
+// copy_file_range, and finally a byte copy. Returns the method used, or an
+// empty string on failure.
+std::string materializeFile(const std::string& src, const std::string& dst, bool consume) {
+    remove(dst.c_str());
+
+    if (consume && rename(src.c_str(), dst.c_str()) == 0) {
+        return "rename";
+    }
+#ifdef _WIN32
+    if (CreateHardLinkA(dst.c_str(), src.c_str(), nullptr)) {
+        return "hardlink";
+    }
+#else
+    if (link(src.c_str(), dst.c_str()) == 0) {
+        return "hardlink";
+    }
+#endif
+#ifdef __linux__
+    std::string method = kernelCopy(src, dst);
+    if (!method.empty()) {
+        return method;
+    }
+#endif
+    return copyFile(src, dst) ? "copy" : "";
+}
+
+// Helper function to check if directory exists
+bool directoryExists(const std::string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+// Helper function to check if a path is a directory
+bool isDirectory(const std::string& path) {
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+// Helper function to create a directory if it does not exist yet
+bool ensureDirectory(const std::string& path) {
+    return directoryExists(path) || mkdir(path.c_str(), 0755) == 0;
+}
+
+// Helper function to get file size in bytes, -1 if the file is missing
+long long getFileSize(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return -1;
+    }
+    return static_cast<long long>(st.st_size);
+}
+
+// Helper function to list a directory's entries as (name, isDirectory) pairs
+std::vector<std::pair<std::string, bool>> listDirectory(const std::string& dir) {
+    std::vector<std::pair<std::string, bool>> entries;
+#ifdef _WIN32
+    _finddata_t found;
+    intptr_t handle = _findfirst((dir + "/*").c_str(), &found);
+    if (handle == -1) {
+        return entries;
+    }
+    do {
+        std::string name = found.name;
+        if (name != "." && name != "..") {
+            entries.push_back({name, (found.attrib & _A_SUBDIR) != 0});
+        }
+    } while (_findnext(handle, &found) == 0);
+    _findclose(handle);
+#else
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) {
+        return entries;
+    }
+    while (dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        struct stat st;
+        if (name != "." && name != ".." && stat((dir + "/" + name).c_str(), &st) == 0) {
+            entries.push_back({name, S_ISDIR(st.st_mode)});
+        }
+    }
+    closedir(handle);
+#endif
+    return entries;
+}
+
+// Helper function to collect the files under dir, as paths prefixed with relative
+void listFiles(const std::string& dir, const std::string& relative, std::vector<std::string>& files) {
+    for (const auto& entry : listDirectory(dir)) {
+        if (entry.second) {
+            listFiles(dir + "/" + entry.first, relative + entry.first + "/", files);
+        } else {
+            files.push_back(relative + entry.first);
+        }
+    }
+}
+
+// Make a path absolute, e.g. so it survives changing into the bench work
+// directory or can be handed to a remote worker
+std::string absolutePath(const std::string& path) {
+#ifdef _WIN32
+    char buffer[_MAX_PATH];
+    return _fullpath(buffer, path.c_str(), sizeof(buffer)) ? std::string(buffer) : path;
+#else
+    char* resolved = realpath(path.c_str(), nullptr);
+    if (!resolved) {
+        return path;
+    }
+    std::string out = resolved;
+    free(resolved);
+    return out;
+#endif
+}
+
+// Helper function to delete a directory and everything under it
+void removeTree(const std::string& dir) {
+    for (const auto& entry : listDirectory(dir)) {
+        std::string path = dir + "/" + entry.first;
+        if (entry.second) {
+            removeTree(path);
+        } else {
+            remove(path.c_str());
+        }
+    }
+    rmdir(dir.c_str());
+}
+
+// Helper function to create every missing directory on the way to a file
+bool ensureParentDirectories(const std::string& path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        if (!ensureDirectory(path.substr(0, slash))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A hardware encode backend and the ffmpeg arguments that keep
+// decode -> scale -> encode on the device
+struct HwBackend {
+    const char* name;            // Value accepted by --hwaccel
+    const char* encoder;         // ffmpeg encoder name
+    const char* inputArgs;       // hwaccel options placed before -i
+    const char* scaleFilter;     // Device scaler, empty to scale on the CPU
+    const char* downloadFilter;  // Moves device frames to system memory for a software encoder
+    int maxSessions;             // Concurrent encoder sessions the device is assumed to allow
+};
+
+const HwBackend hwBackends[] = {
+    {"nvenc", "h264_nvenc", "-hwaccel cuda -hwaccel_output_format cuda", "scale_cuda",
+     ",hwdownload,format=nv12", 3},
+    {"qsv", "h264_qsv", "-hwaccel qsv -hwaccel_output_format qsv", "scale_qsv",
+     ",hwdownload,format=nv12", 8},
+    {"vaapi", "h264_vaapi", "-hwaccel vaapi -hwaccel_device /dev/dri/renderD128 -hwaccel_output_format vaapi",
+     "scale_vaapi", ",hwdownload,format=nv12", 8},
+    {"videotoolbox", "h264_videotoolbox", "-hwaccel videotoolbox", "", "", 4},
+};
+
+// Check that a backend is compiled into ffmpeg and can open a session on
+// this machine by encoding a few frames of a synthetic source
+bool hwBackendWorks(const HwBackend& backend, const std::string& encoderList) {
+    if (encoderList.find(backend.encoder) == std::string::npos) {
+        return false;
+    }
+    std::string scale = backend.scaleFilter[0] ? std::string(",hwupload,") + backend.scaleFilter + "=256:144" : "";
+    std::string device = std::string(backend.name) == "vaapi" ? " -vaapi_device /dev/dri/renderD128" :
+                         std::string(backend.name) == "nvenc" ? " -init_hw_device cuda" :
+                         std::string(backend.name) == "qsv" ? " -init_hw_device qsv" : "";
+    std::string cmd = "ffmpeg -v error" + device + " -f lavfi -i color=s=256x144:d=0.2 -vf \"format=nv12" + scale +
+                      "\" -c:v " + backend.encoder + " -f null - 2>" NULL_DEVICE;
+    return system(cmd.c_str()) == 0;
+}
+
+// Resolve --hwaccel to a working backend. "auto" picks the first backend
+// that passes a trial encode; nullptr means software encoding. Results are
+// cached so daemon jobs after the first skip the trial encodes.
+const HwBackend* detectHwBackend(const std::string& requested) {
+    if (requested == "none") {
+        return nullptr;
+    }
+
+    static std::mutex cacheMutex;
+    static std::map<std::string, const HwBackend*> cache;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto cached = cache.find(requested);
+    if (cached != cache.end()) {
+        return cached->second;
+    }
+
+    std::string encoderList;
+    FILE* pipe = popen("ffmpeg -hide_banner -encoders 2>" NULL_DEVICE, "r");
+    if (pipe) {
+        char buffer[512];
+        while (fgets(buffer, sizeof(buffer), pipe)) {
+            encoderList += buffer;
+        }
+        pclose(pipe);
+    }
+
+    for (const auto& backend : hwBackends) {
+        if (requested != "auto" && requested != backend.name) {
+            continue;
+        }
+        if (hwBackendWorks(backend, encoderList)) {
+            cache[requested] = &backend;
+            return &backend;
+        }
+        if (requested != "auto") {
+            std::cerr << "Warning: " << backend.name << " is not available, using software encoding." << std::endl;
+        }
+    }
+    cache[requested] = nullptr;
+    return nullptr;
+}
+
+// Tracks open hardware encoder sessions so rungs beyond the device limit
+// go to libx264 instead of failing
+class HwSessionPool {
+public:
+    explicit HwSessionPool(int limit) : limit_(limit) {}
+
+    bool tryAcquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (inUse_ >= limit_) {
+            return false;
+        }
+        inUse_++;
+        return true;
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        inUse_--;
+    }
+
+private:
+    std::mutex mutex_;
+    int limit_;
+    int inUse_ = 0;
+};
+
+// A video codec the ladder can be encoded in. H.264 is the compatibility
+// codec and keeps the plain rung names; other codecs add their name to the
+// rung label, e.g. "video 720-av1.mp4".
+struct VideoCodec {
+    const char* name;            // Value accepted by --codecs
+    const char* encoder;         // ffmpeg software encoder
+    const char* tuning;          // Preset and other encoder settings
+    const char* quality;         // Constant-quality rate control, replaced by a bitrate target with --two-pass
+    double costFactor;           // Encode cost relative to libx264 at the same size
+    double bitrateFactor;        // Bits needed relative to libx264 for similar quality
+};
+
+const VideoCodec videoCodecs[] = {
+    {"h264", "libx264", "", "", 1.0, 1.0},
+    {"hevc", "libx265", " -preset medium -tag:v hvc1", " -crf 26", 2.5, 0.6},
+    {"vp9", "libvpx-vp9", " -deadline good -cpu-used 2 -row-mt 1", " -crf 33 -b:v 0", 3.0, 0.65},
+    {"av1", "libsvtav1", " -preset 8", " -crf 35", 3.0, 0.5},
+};
+
+const VideoCodec* findVideoCodec(const std::string& name) {
+    for (const auto& codec : videoCodecs) {
+        if (name == codec.name) {
+            return &codec;
+        }
+    }
+    return nullptr;
+}
+
+// Encoder arguments for a rung in a software codec. H.264 relies on
+// ffmpeg's default encoder unless libx264 has to be named explicitly.
+// Non-empty rateArgs take the place of the codec's constant quality.
+std::string codecEncoderArgs(const std::string& name, bool explicitH264, const std::string& rateArgs = "") {
+    const VideoCodec* codec = findVideoCodec(name);
+    if (!codec || (std::string(codec->name) == "h264" && !explicitH264)) {
+        return rateArgs;
+    }
+    return std::string(" -c:v ") + codec->encoder + codec->tuning + (rateArgs.empty() ? codec->quality : rateArgs);
+}
+
+// --codecs as text, e.g. "h264,av1@720"
+std::string codecList(const ProcessOptions& options) {
+    std::string list;
+    for (const auto& codec : options.codecs) {
+        list += (list.empty() ? "" : ",") + codec.first + (codec.second > 0 ? "@" + std::to_string(codec.second) : "");
+    }
+    return list;
+}
+
+// Width for a rung at the given height, preserving the source aspect ratio
+// and rounded to an even number as required by most encoders
+int scaledWidth(int inputWidth, int inputHeight, int height) {
+    int width = static_cast<int>(static_cast<double>(inputWidth) * height / inputHeight + 0.5);
+    return std::max(2, width - (width % 2));
+}
+
+// Codecs that can be stream-copied into the MP4 rungs unchanged
+bool mp4AudioCodec(const std::string& codec) {
+    static const char* codecs[] = {"aac", "mp3", "ac3", "eac3", "opus", "flac", "alac"};
+    for (const char* candidate : codecs) {
+        if (codec == candidate) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// RFC 6381 codec string for an audio codec, or empty if unknown
+std::string audioCodecTag(const std::string& codec) {
+    if (codec == "aac") return "mp4a.40.2";
+    if (codec == "mp3") return "mp4a.40.34";
+    if (codec == "ac3") return "ac-3";
+    if (codec == "eac3") return "ec-3";
+    if (codec == "opus") return "opus";
+    if (codec == "flac") return "fLaC";
+    return "";
+}
+
+// Codec the shared audio stage produces for an input
+std::string sharedAudioCodec(const MediaInfo& info, const ProcessOptions& options) {
+    if (options.audio == "opus") {
+        return "opus";
+    }
+    if (options.audio == "copy" && !options.loudnorm && mp4AudioCodec(info.audioCodec)) {
+        return info.audioCodec;
+    }
+    return "aac";
+}
+
+// Extract the source's audio once into audioFile: a stream copy when the
+// track fits MP4 as it is, otherwise a single AAC or Opus transcode. With
+// loudnorm the track is normalized to EBU R128 (-16 LUFS) in the same pass.
+bool prepareAudio(const std::string& source, const MediaInfo& info, const ProcessOptions& options,
+                  const std::string& audioFile) {
+    std::string codec = sharedAudioCodec(info, options);
+    std::string codecArgs = codec == "opus"              ? " -c:a libopus -b:a 96k"
+                            : codec != info.audioCodec || options.loudnorm ? " -c:a aac -b:a 128k"
+                                                                           : " -c:a copy";
+    // loudnorm upsamples internally; bring the output back to 48 kHz
+    std::string filter = options.loudnorm ? " -af loudnorm=I=-16:TP=-1.5:LRA=11 -ar 48000" : "";
+    std::string cmd = "ffmpeg -v error -y -i \"" + source + "\" -map 0:a:0 -vn" + filter + codecArgs + " \"" +
+                      audioFile + "\"";
+    if (system(cmd.c_str()) != 0 || getFileSize(audioFile) <= 0) {
+        std::cerr << "✗ Audio stage failed. Command was: " << cmd << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Input and map options putting a rung's audio in place: the shared audio
+// file as input 1, or the source's own track when there is none
+std::string audioInputArgs(const std::string& audioFile) {
+    return audioFile.empty() ? "" : " -i \"" + audioFile + "\"";
+}
+
+std::string audioMapArgs(const std::string& audioFile) {
+    return audioFile.empty() ? " -map 0:a:0?" : " -map 1:a:0";
+}
+
+// Build the filter graph for a ladder. parents[i] is the index of the rung
+// that rung i is scaled from, or -1 to scale it straight from the source.
+// Rungs are expected in descending height order so parents precede children.
+// widths[i] may be -2 to let ffmpeg derive the width from the aspect ratio.
+// A non-empty tap is a graph fragment fed source frames on [pv].
+// scaler names the scale filter; outSuffixes[i] is appended to rung i's
+// chain before its output pad (e.g. a hwdownload for a software encoder).
+// frameSteps[i] keeps every Nth source frame for rung i, dropped before its
+// scaler; a parent's step must divide its children's. A non-empty
+// sourceFilter runs once on the source frames before anything else reads
+// them, e.g. a tone map shared by every rung.
+std::string buildLadderGraph(const std::vector<int>& heights, const std::vector<int>& widths,
+                             const std::vector<int>& parents, const std::string& scaler,
+                             const std::vector<std::string>& outSuffixes, const std::vector<int>& frameSteps,
+                             const std::string& sourceFilter = "", const std::string& tap = "") {
+    size_t n = heights.size();
+    std::vector<std::vector<size_t>> children(n);
+    std::vector<size_t> sourceChildren;
+    for (size_t i = 0; i < n; i++) {
+        if (parents[i] < 0) {
+            sourceChildren.push_back(i);
+        } else {
+            children[parents[i]].push_back(i);
+        }
+    }
+
+    // Input pad each rung's scaler reads from
+    std::vector<std::string> inputs(n);
+    std::string graph;
+    std::string source = "[0:v]";
+    if (!sourceFilter.empty()) {
+        graph = source + sourceFilter + "[src]";
+        source = "[src]";
+    }
+    size_t sourceOutputs = sourceChildren.size() + (tap.empty() ? 0 : 1);
+    if (sourceOutputs == 1) {
+        inputs[sourceChildren[0]] = source;
+    } else {
+        graph += (graph.empty() ? "" : ";") + source + "split=" + std::to_string(sourceOutputs);
+        for (size_t i : sourceChildren) {
+            inputs[i] = "[s" + std::to_string(i) + "]";
+            graph += inputs[i];
+        }
+        graph += tap.empty() ? "" : "[pv]";
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (!graph.empty()) {
+            graph += ";";
+        }
+        int step = parents[i] < 0 ? frameSteps[i] : frameSteps[i] / frameSteps[parents[i]];
+        graph += inputs[i] + (step > 1 ? "framestep=" + std::to_string(step) + "," : "") + scaler + "=" +
+                 std::to_string(widths[i]) + ":" + std::to_string(heights[i]);
+        if (children[i].empty()) {
+            graph += outSuffixes[i] + "[v" + std::to_string(i) + "]";
+            continue;
+        }
+        std::string splitLabel = outSuffixes[i].empty() ? "[v" + std::to_string(i) + "]" : "[t" + std::to_string(i) + "]";
+        graph += ",split=" + std::to_string(children[i].size() + 1) + splitLabel;
+        for (size_t c : children[i]) {
+            inputs[c] = "[c" + std::to_string(c) + "]";
+            graph += inputs[c];
+        }
+        if (!outSuffixes[i].empty()) {
+            graph += ";" + splitLabel + "null" + outSuffixes[i] + "[v" + std::to_string(i) + "]";
+        }
+    }
+    if (!tap.empty()) {
+        graph += ";" + tap;
+    }
+    return graph;
+}
+
+// Build a single ffmpeg command that decodes the input once and feeds every
+// rung through one filter graph, writing all outputs in one pass
+std::string buildSingleDecodeCommand(const std::string& videoPath, const std::string& inputArgs,
+                                     const std::string& graph, const std::vector<std::string>& outFiles,
+                                     const std::vector<std::string>& encoderArgs, int threads,
+                                     const std::string& audioFile = "", const std::string& extraOutputs = "") {
+    std::string threadArg = threads > 0 ? " -threads " + std::to_string(threads) : "";
+    std::string cmd = "ffmpeg -y" + threadArg + inputArgs + " -i \"" + videoPath + "\"" + audioInputArgs(audioFile) +
+                      " -filter_complex \"" + graph + "\"";
+    for (size_t i = 0; i < outFiles.size(); i++) {
+        cmd += " -map \"[v" + std::to_string(i) + "]\"" + audioMapArgs(audioFile) + threadArg + encoderArgs[i] +
+               " -c:a copy -movflags +faststart \"" + outFiles[i] + "\"";
+    }
+    return cmd + extraOutputs;
+}
+
+// Poster frame, seek-preview sprite sheet and WebVTT thumbnail track. The
+// frames are tapped from a decode that already runs for the ladder.
+struct PreviewPlan {
+    std::string dir;          // Output directory, <folder>/previews
+    double duration = 0.0;    // Input duration covered by the sprite
+    double posterTime = 0.0;  // Seconds into the input of the poster frame
+    double interval = 10.0;   // Seconds between sprite tiles
+    int posterWidth = 0;
+    int posterHeight = 0;
+    int tileWidth = 160;
+    int tileHeight = 90;
+    int columns = 1;
+    int rows = 1;
+    int count = 1;            // Tiles in the sprite
+
+    std::string poster() const { return dir + "/poster.jpg"; }
+    std::string sprite() const { return dir + "/sprite.jpg"; }
+    std::string track() const { return dir + "/thumbnails.vtt"; }
+};
+
+// Lay out the previews for an input. Returns false if its duration is unknown.
+bool planPreviews(const std::string& folderName, const MediaInfo& info, double interval, PreviewPlan& plan) {
+    if (info.duration <= 0.0 || info.displayWidth() <= 0 || info.displayHeight() <= 0) {
+        return false;
+    }
+    plan.dir = folderName + "/previews";
+    plan.duration = info.duration;
+    plan.posterTime = std::min(info.duration * 0.1, 10.0);
+    plan.interval = interval;
+    plan.posterHeight = std::min(720, info.displayHeight() - info.displayHeight() % 2);
+    plan.posterWidth = scaledWidth(info.displayWidth(), info.displayHeight(), plan.posterHeight);
+    plan.tileHeight = std::max(2, static_cast<int>(160.0 * info.displayHeight() / info.displayWidth() + 0.5) & ~1);
+    plan.count = std::max(1, static_cast<int>(info.duration / interval - 1e-9) + 1);
+    plan.columns = std::min(10, plan.count);
+    plan.rows = (plan.count + plan.columns - 1) / plan.columns;
+    return ensureDirectory(plan.dir);
+}
+
+// Filter graph fragment that turns the frames on inputPad into [poster] and
+// [sprite]. Device frames are scaled with scaler and downloaded by suffix
+// before the CPU filters.
+std::string buildPreviewGraph(const PreviewPlan& plan, const std::string& inputPad, const std::string& scaler,
+                              const std::string& suffix) {
+    std::ostringstream graph;
+    graph << inputPad << scaler << "=" << plan.posterWidth << ":" << plan.posterHeight << suffix
+          << ",split=2[pp][ps];"
+          << "[pp]select=gte(t\\," << std::fixed << std::setprecision(3) << plan.posterTime << "),format=yuvj420p[poster];"
+          << "[ps]fps=1/" << plan.interval << ",scale=" << plan.tileWidth << ":" << plan.tileHeight
+          << ",format=yuvj420p,tile=" << plan.columns << "x" << plan.rows << "[sprite]";
+    return graph.str();
+}
+
+// Output options writing the [poster] and [sprite] pads as one image each
+std::string previewOutputArgs(const PreviewPlan& plan) {
+    return " -map \"[poster]\" -frames:v 1 -q:v 3 \"" + plan.poster() + "\"" +
+           " -map \"[sprite]\" -frames:v 1 -q:v 5 \"" + plan.sprite() + "\"";
+}
+
+// Format seconds as a WebVTT timestamp
+std::string vttTimestamp(double seconds) {
+    long long ms = static_cast<long long>(seconds * 1000.0 + 0.5);
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%02lld:%02lld:%02lld.%03lld", ms / 3600000, ms / 60000 % 60, ms / 1000 % 60,
+             ms % 1000);
+    return buffer;
+}
+
+// Write the WebVTT track mapping each interval to its tile of the sprite
+bool writeThumbnailTrack(const PreviewPlan& plan) {
+    std::ofstream track(plan.track());
+    track << "WEBVTT\n";
+    for (int i = 0; i < plan.count; i++) {
+        double start = i * plan.interval;
+        double end = std::min(plan.duration, start + plan.interval);
+        track << "\n" << vttTimestamp(start) << " --> " << vttTimestamp(end) << "\n"
+              << "sprite.jpg#xywh=" << (i % plan.columns) * plan.tileWidth << "," << (i / plan.columns) * plan.tileHeight
+              << "," << plan.tileWidth << "," << plan.tileHeight << "\n";
+    }
+    return track.good();
+}
+
+// Measure the SSIM lost by producing the last height in chain through the
+// whole cascade instead of scaling the source directly. Only a short sample
+// window is decoded. Returns the mean SSIM (All) or -1 on failure.
+double measureCascadeSsim(const std::string& videoPath, const std::vector<int>& chain,
+                          int inputWidth, int inputHeight, double sampleStart,
+                          const std::string& statsFile) {
+    int targetHeight = chain.back();
+    int targetWidth = scaledWidth(inputWidth, inputHeight, targetHeight);
+
+    std::string cascade = "[a]";
+    for (size_t i = 0; i < chain.size(); i++) {
+        cascade += (i == 0 ? "" : ",");
+        cascade += "scale=" + std::to_string(scaledWidth(inputWidth, inputHeight, chain[i])) + ":" + std::to_string(chain[i]);
+    }
+    std::string graph = "[0:v]split=2[a][b];" + cascade + "[c];[b]scale=" + std::to_string(targetWidth) + ":" +
+                        std::to_string(targetHeight) + "[d];[c][d]ssim=stats_file=" + statsFile;
+
+    std::ostringstream start;
+    start << std::fixed << std::setprecision(2) << sampleStart;
+    std::string cmd = "ffmpeg -v error -y -ss " + start.str() + " -t 3 -i \"" + videoPath +
+                      "\" -filter_complex \"" + graph + "\" -an -f null -";
+    if (system(cmd.c_str()) != 0) {
+        remove(statsFile.c_str());
+        return -1.0;
+    }
+
+    // Stats lines look like: n:1 Y:0.98 U:0.99 V:0.99 All:0.985 (18.2)
+    std::ifstream stats(statsFile);
+    std::string line;
+    double sum = 0.0;
+    int frames = 0;
+    while (std::getline(stats, line)) {
+        size_t pos = line.find("All:");
+        if (pos == std::string::npos) {
+            continue;
+        }
+        try {
+            sum += std::stod(line.substr(pos + 4));
+            frames++;
+        } catch (const std::exception&) {
+            // Skip malformed lines
+        }
+    }
+    stats.close();
+    remove(statsFile.c_str());
+    return frames > 0 ? sum / frames : -1.0;
+}
+
+// Pick cascade parents: each rung is derived from the nearest higher rung as
+// long as the accumulated SSIM loss of its chain stays within tolerance.
+// Rungs that exceed it, or cannot be measured, are scaled from the source.
+std::vector<int> planCascade(const std::string& videoPath, const std::vector<int>& heights,
+                             int inputWidth, int inputHeight, double duration,
+                             double ssimTolerance, const std::string& folderName) {
+    std::vector<int> parents(heights.size(), -1);
+    std::vector<std::vector<int>> chains(heights.size());
+    double sampleStart = duration > 6.0 ? duration / 2.0 : 0.0;
+
+    for (size_t i = 0; i < heights.size(); i++) {
+        chains[i] = {heights[i]};
+        if (i == 0) {
+            continue;
+        }
+        std::vector<int> chain = chains[i - 1];
+        chain.push_back(heights[i]);
+        std::string statsFile = folderName + "/.ssim_" + std::to_string(heights[i]) + ".log";
+        double ssim = measureCascadeSsim(videoPath, chain, inputWidth, inputHeight, sampleStart, statsFile);
+
+        if (ssim >= 0.0 && 1.0 - ssim <= ssimTolerance) {
+            parents[i] = static_cast<int>(i - 1);
+            chains[i] = chain;
+            std::cout << "Cascade: " << heights[i] << "p from " << heights[i - 1] << "p (SSIM "
+                      << std::fixed << std::setprecision(4) << ssim << ")" << std::endl;
+        } else {
+            std::cout << "Cascade: " << heights[i] << "p from source";
+            if (ssim >= 0.0) {
+                std::cout << " (cascaded SSIM " << std::fixed << std::setprecision(4) << ssim << " exceeds tolerance)";
+            }
+            std::cout << std::endl;
+        }
+    }
+    return parents;
+}
+
+// Headroom of a per-title rung's bitrate cap over its measured rate
+constexpr double maxrateHeadroom = 1.5;
+
+// Per-title ladder. Short CRF trial encodes of a few sample windows measure
+// the bitrate each rung needs at constant quality. Walking up from the
+// lowest rung, a rung is kept only when it needs at least perTitleStep times
+// the bits of the rung kept below it; otherwise the extra resolution carries
+// little detail the lower rung does not, as with slideshows or upscaled
+// sources. Kept rungs get a bitrate cap with headroom over the measured rate
+// in maxrates (bits/s, keyed by height). On failure the ladder is unchanged.
+std::vector<std::pair<std::string, int>> planPerTitleLadder(const std::string& videoPath,
+                                                            const std::vector<std::pair<std::string, int>>& qualities,
+                                                            double duration, const std::string& folderName,
+                                                            std::map<int, long long>& maxrates) {
+    const int trialCrf = 23;           // libx264's default, which the real encodes use
+    const int sampleCount = 3;
+    const double perTitleStep = 1.5;   // Minimum bitrate ratio between adjacent kept rungs
+    if (qualities.size() < 2) {
+        return qualities;
+    }
+
+    std::vector<int> heights;
+    std::string graph = "[0:v]split=" + std::to_string(qualities.size());
+    for (size_t i = 0; i < qualities.size(); i++) {
+        heights.push_back(qualities[i].second);
+        graph += "[s" + std::to_string(i) + "]";
+    }
+    for (size_t i = 0; i < qualities.size(); i++) {
+        graph += ";[s" + std::to_string(i) + "]scale=-2:" + std::to_string(heights[i]) + "[v" + std::to_string(i) + "]";
+    }
+
+    // Windows centered in equal slices of the input
+    double window = duration > 0.0 ? std::min(2.0, duration / sampleCount) : 2.0;
+    int samples = duration > 0.0 ? sampleCount : 1;
+    std::vector<long long> bytes(qualities.size(), 0);
+    for (int s = 0; s < samples; s++) {
+        double start = duration > 0.0 ? duration * (s + 0.5) / samples - window / 2 : 0.0;
+        std::ostringstream seek;
+        seek << std::fixed << std::setprecision(2) << " -ss " << start << " -t " << window;
+        std::string cmd = "ffmpeg -v error -y" + seek.str() + " -i \"" + videoPath + "\" -filter_complex \"" + graph + "\"";
+        std::vector<std::string> trialFiles;
+        for (size_t i = 0; i < qualities.size(); i++) {
+            trialFiles.push_back(folderName + "/.trial_" + qualities[i].first + "_" + std::to_string(s) + ".mp4");
+            cmd += " -map \"[v" + std::to_string(i) + "]\" -an -c:v libx264 -preset veryfast -crf " +
+                   std::to_string(trialCrf) + " \"" + trialFiles.back() + "\"";
+        }
+        bool ok = system(cmd.c_str()) == 0;
+        for (size_t i = 0; i < trialFiles.size(); i++) {
+            long long size = getFileSize(trialFiles[i]);
+            ok = ok && size > 0;
+            bytes[i] += std::max(0LL, size);
+            remove(trialFiles[i].c_str());
+        }
+        if (!ok) {
+            std::cout << "Per-title: trial encode failed, keeping the full ladder" << std::endl;
+            return qualities;
+        }
+    }
+
+    std::vector<std::pair<std::string, int>> kept;
+    long long keptBelow = 0;
+    for (size_t i = qualities.size(); i-- > 0;) {
+        long long bitrate = static_cast<long long>(bytes[i] * 8 / (window * samples));
+        bool keep = keptBelow == 0 || bitrate >= keptBelow * perTitleStep;
+        std::cout << "  Per-title " << qualities[i].first << "p: " << bitrate / 1000 << " kbps at CRF " << trialCrf
+                  << (keep ? "" : " (dropped)") << std::endl;
+        if (keep) {
+            kept.insert(kept.begin(), qualities[i]);
+            maxrates[qualities[i].second] = static_cast<long long>(bitrate * maxrateHeadroom);
+            keptBelow = bitrate;
+        }
+    }
+    return kept;
+}
+
+// Shared first pass. One fast x264 CRF encode at analysisHeight writes
+// per-frame statistics. The frame sizes in them give the input's complexity
+// over time, and their average bitrate gives the level every rung's target
+// is scaled from. x264 only accepts stats from an encode at the same
+// resolution, so rungs are not fed the stats file itself. Instead they turn
+// the per-frame complexity into rate-control zones, which buys two-pass
+// bitrate allocation for one extra low-resolution pass per job.
+struct FirstPass {
+    static constexpr int analysisHeight = 144;
+    std::vector<double> frameBits;   // Bits each input frame took, by input frame number
+    double fps = 0.0;
+    int width = 0;
+
+    double bitrate() const {
+        double total = 0.0;
+        for (double bits : frameBits) {
+            total += bits;
+        }
+        return frameBits.empty() ? 0.0 : total / frameBits.size() * fps;
+    }
+};
+
+// Read frame sizes (texture, motion vector and other bits) from an x264
+// stats file; lines look like "in:12 out:12 type:P ... tex:900 mv:40 misc:60 ..."
+bool readFirstPassStats(const std::string& statsFile, FirstPass& pass) {
+    std::ifstream stats(statsFile);
+    std::string line;
+    while (std::getline(stats, line)) {
+        if (line.compare(0, 3, "in:") != 0) {
+            continue;  // "#options:" header
+        }
+        std::stringstream fields(line);
+        std::string field;
+        long long frame = -1;
+        double bits = 0.0;
+        while (fields >> field) {
+            size_t colon = field.find(':');
+            std::string key = field.substr(0, colon);
+            double value = colon == std::string::npos ? 0.0 : std::atof(field.c_str() + colon + 1);
+            if (key == "in") {
+                frame = static_cast<long long>(value);
+            } else if (key == "tex" || key == "mv" || key == "misc") {
+                bits += value;
+            }
+        }
+        if (frame >= 0 && frame < 100000000) {
+            if (static_cast<size_t>(frame) >= pass.frameBits.size()) {
+                pass.frameBits.resize(frame + 1, 0.0);
+            }
+            pass.frameBits[frame] = bits;
+        }
+    }
+    return !pass.frameBits.empty();
+}
+
+// Run the shared first pass, leaving its stats in statsFile (a path ending
+// in "-0.log", as ffmpeg names it). pass.fps and pass.width are set by the caller.
+bool runFirstPass(const std::string& source, const std::string& inputArgs, const std::string& statsFile,
+                  FirstPass& pass) {
+    std::string logPrefix = statsFile.substr(0, statsFile.size() - std::string("-0.log").size());
+    std::string cmd = "ffmpeg -v error -y" + inputArgs + " -i \"" + source + "\" -map 0:v:0 -vf scale=-2:" +
+                      std::to_string(FirstPass::analysisHeight) + " -an -c:v libx264 -preset faster -crf 23 -pass 1"
+                      " -passlogfile \"" + logPrefix + "\" -f null " NULL_DEVICE;
+    if (system(cmd.c_str()) != 0) {
+        std::cerr << "✗ First pass failed. Command was: " << cmd << std::endl;
+        return false;
+    }
+    remove((statsFile + ".mbtree").c_str());
+    return readFirstPassStats(statsFile, pass);
+}
+
+// Target bitrate for a rung: the first pass's bitrate scaled by pixel count
+// to the power 0.75, which tracks how bits grow with resolution at constant
+// quality, and by the codec's efficiency relative to H.264
+long long firstPassTarget(const FirstPass& pass, int width, int height, const VideoCodec& codec) {
+    double analysisPixels = static_cast<double>(pass.width) * FirstPass::analysisHeight;
+    double pixels = static_cast<double>(width) * height;
+    return static_cast<long long>(pass.bitrate() * std::pow(pixels / analysisPixels, 0.75) * codec.bitrateFactor);
+}
+
+// Zones for the frames in [start, start + duration) of the input, numbered
+// from the start of that range in the frames of a rung that keeps every
+// frameStep-th one. Each window of about two seconds gets the ratio of its
+// bits to the average, clamped to [0.5, 2]; neighbouring windows with the
+// same multiplier are merged.
+std::string firstPassZones(const FirstPass& pass, double start, double duration, int frameStep) {
+    size_t first = static_cast<size_t>(std::max(0.0, start * pass.fps));
+    size_t end = duration > 0.0 ? std::min(pass.frameBits.size(), static_cast<size_t>((start + duration) * pass.fps))
+                                : pass.frameBits.size();
+    if (first >= end || pass.fps <= 0.0) {
+        return "";
+    }
+    size_t step = static_cast<size_t>(std::max(1, frameStep));
+    double average = pass.bitrate() / pass.fps;
+    size_t window = std::max(static_cast<size_t>(pass.fps * 2.0), (end - first) / 400 + 1);
+    std::string zones;
+    size_t zoneStart = first;
+    double zoneFactor = -1.0;
+    for (size_t f = first; f < end; f += window) {
+        size_t last = std::min(end, f + window);
+        double bits = 0.0;
+        for (size_t i = f; i < last; i++) {
+            bits += pass.frameBits[i];
+        }
+        double factor = average > 0.0 ? bits / (last - f) / average : 1.0;
+        factor = std::round(std::min(2.0, std::max(0.5, factor)) * 20.0) / 20.0;
+        if (factor != zoneFactor && zoneFactor >= 0.0) {
+            char zone[64];
+            snprintf(zone, sizeof(zone), "%s%zu,%zu,b=%.2f", zones.empty() ? "" : "/", (zoneStart - first) / step,
+                     (f - first) / step - 1, zoneFactor);
+            zones += zone;
+            zoneStart = f;
+        }
+        zoneFactor = factor;
+    }
+    char zone[64];
+    snprintf(zone, sizeof(zone), "%s%zu,%zu,b=%.2f", zones.empty() ? "" : "/", (zoneStart - first) / step,
+             (end - first - 1) / step, zoneFactor);
+    return zones + zone;
+}
+
+// A unit of encode work handed to the rung scheduler
+struct EncodeJob {
+    std::string label;       // Rung label, e.g. "720"
+    int height = 0;          // Output height
+    int width = -2;          // Output width, -2 to derive it from the aspect ratio
+    std::string outFile;     // Output path
+    std::string keyframeArgs; // Keyframe placement on the segment grid
+    std::string videoArgs;   // Extra video encoder arguments, e.g. a frame rate cap
+    double cost = 0.0;       // Expected cost: output pixels * duration
+    double duration = 0.0;   // Seconds of source this job encodes
+    double frames = 0.0;     // Expected output frames, for fps metrics
+    int threads = 1;         // Encoder threads reserved from the budget
+    std::string input;       // Source override, e.g. a chunk of the source (empty = job source)
+    int chunk = -1;          // Chunk index when encoding one chunk of a rung
+    int chunkCount = 0;
+    bool success = false;
+    ProgressReporter* progress = &progressStream; // Where this job's events go
+    const PreviewPlan* previews = nullptr;        // Previews cut from this job's decode, if any
+    std::string audioFile;   // Shared audio muxed in place of the source track (empty = source)
+    std::string codec = "h264"; // Video codec; also names the encoder pool the job runs in
+    long long bitrate = 0;   // Target video bits/s from the shared first pass (0 = constant quality)
+    std::string zones;       // Bitrate multipliers per frame range from the shared first pass, x264/x265 syntax
+    int frameStep = 1;       // Keep every Nth source frame, decimated before scaling
+    std::string toSdr;       // Filters bringing the scaled frames to 8-bit SDR (empty = source already is)
+    std::string cgroup;      // cgroup v2 directory the encode runs in (empty = the runner's)
+
+    std::string name() const {
+        size_t dash = label.find('-');
+        std::string n = dash == std::string::npos ? label + "p" : label.substr(0, dash) + "p " + label.substr(dash + 1);
+        if (chunk >= 0) {
+            n += " chunk " + std::to_string(chunk + 1) + "/" + std::to_string(chunkCount);
+        }
+        return n;
+    }
+};
+
+// Bitrate and VBV arguments for a rung with a target bitrate. The zones are
+// only understood by the x264 and x265 software encoders.
+std::string rateControlArgs(const EncodeJob& job, bool softwareEncoder) {
+    if (job.bitrate <= 0) {
+        return "";
+    }
+    long long kbps = std::max(1LL, job.bitrate / 1000);
+    std::string args = " -b:v " + std::to_string(kbps) + "k -maxrate " + std::to_string(kbps * 3 / 2) +
+                       "k -bufsize " + std::to_string(kbps * 3) + "k";
+    if (softwareEncoder && !job.zones.empty() && (job.codec == "h264" || job.codec == "hevc")) {
+        args += std::string(job.codec == "h264" ? " -x264-params" : " -x265-params") + " zones=" + job.zones;
+    }
+    return args;
+}
+
+// Parse a number from ffmpeg progress output, which uses "N/A" when unknown
+double parseProgressNumber(const std::string& value) {
+    char* end = nullptr;
+    double number = std::strtod(value.c_str(), &end);
+    return end == value.c_str() ? 0.0 : number;
+}
+
+// Turn one -progress block into a JSON event per target job
+void emitFfmpegProgress(std::map<std::string, std::string>& block, const std::vector<const EncodeJob*>& targets) {
+    double outTime = parseProgressNumber(block["out_time_us"]) / 1e6;
+    double speed = parseProgressNumber(block["speed"]);
+    bool finished = block["progress"] == "end";
+
+    for (const EncodeJob* job : targets) {
+        double fraction = finished ? 1.0 : (job->duration > 0.0 ? outTime / job->duration : 0.0);
+        long long bytes = targets.size() == 1 ? static_cast<long long>(parseProgressNumber(block["total_size"]))
+                                              : std::max(0LL, getFileSize(job->outFile));
+        JsonObject event("progress");
+        event.add("task", job->name()).add("rung", job->label).add("chunk", job->chunk)
+             .add("frame", static_cast<long long>(parseProgressNumber(block["frame"])))
+             .add("fps", parseProgressNumber(block["fps"])).add("speed", speed)
+             .add("out_time", outTime).add("bytes", bytes)
+             .add("percent", 100.0 * std::min(1.0, fraction));
+        if (speed > 0.0 && job->duration > outTime) {
+            event.add("eta", (job->duration - outTime) / speed);
+        }
+        event.add("job_percent", job->progress->update(job->name(), fraction));
+        job->progress->emit(event);
+    }
+}
+
+// Run an ffmpeg command. With a progress stream open, ffmpeg writes its
+// -progress key=value blocks to stdout, which are read here and re-emitted
+// as JSON events for each target job; otherwise this is a plain system().
+int runFfmpeg(const std::string& cmd, const std::vector<const EncodeJob*>& targets) {
+    // The shell joins the job's cgroup first, so ffmpeg starts inside it
+    const std::string prefix = "ffmpeg ";
+    std::string join = targets.empty() || targets[0]->cgroup.empty() ? ""
+                     : "echo $$ > \"" + targets[0]->cgroup + "/cgroup.procs\" && ";
+    if (targets.empty() || !targets[0]->progress->enabled() || cmd.compare(0, prefix.size(), prefix) != 0) {
+        return system((join + cmd).c_str());
+    }
+
+    std::string tracked = join + "ffmpeg -progress pipe:1 -nostats " + cmd.substr(prefix.size());
+    FILE* pipe = popen(tracked.c_str(), "r");
+    if (!pipe) {
+        return -1;
+    }
+    std::map<std::string, std::string> block;
+    char buffer[512];
+    while (fgets(buffer, sizeof(buffer), pipe)) {
+        std::string line(buffer);
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        size_t last = line.find_last_not_of(" \t\n\r");
+        std::string key = line.substr(0, eq);
+        block[key] = last > eq ? line.substr(eq + 1, last - eq) : "";
+        if (key == "progress") {
+            emitFfmpegProgress(block, targets);
+            block.clear();
+        }
+    }
+    return pclose(pipe);
+}
+
+// Record one finished rung or chunk encode
+void recordRungMetrics(const EncodeJob& job, double seconds, bool ok) {
+    std::string rung = metricLabel("rung", job.label);
+    metrics.observe("process_video_rung_encode_seconds", rung, seconds);
+    if (!ok) {
+        metrics.count("process_video_failures", metricLabel("stage", "encode"));
+    } else if (seconds > 0.0 && job.frames > 0.0) {
+        metrics.observe("process_video_rung_fps", rung, job.frames / seconds);
+    }
+}
+
+// Build the ffmpeg command for one rung, optionally capping its threads.
+// With a hardware backend the rung is decoded, scaled and encoded on the
+// device; forceSoftware selects libx264 explicitly for fallback runs.
+std::string buildRungCommand(const std::string& videoPath, const std::string& inputArgs, const EncodeJob& job,
+                             int threads, const HwBackend* hw, bool forceSoftware) {
+    std::string threadArg = threads > 0 ? " -threads " + std::to_string(threads) : "";
+    std::string size = std::to_string(job.width) + ":" + std::to_string(job.height);
+    std::string scaler = hw && hw->scaleFilter[0] ? hw->scaleFilter : "scale";
+    // Frames are dropped before scaling and converted to SDR after it, at the rung's size
+    std::string chain = (job.frameStep > 1 ? "framestep=" + std::to_string(job.frameStep) + "," : "") + scaler + "=" +
+                        size + (job.toSdr.empty() ? "" : "," + job.toSdr);
+    std::string filter = audioInputArgs(job.audioFile) + " -vf \"" + chain + "\" -map 0:v:0" +
+                         audioMapArgs(job.audioFile);
+    std::string previewArgs;
+    if (job.previews) {
+        // Split the decoded frames between the rung and the preview graph
+        std::string tap = job.toSdr.empty() ? "" : "[pv]" + job.toSdr + "[pvs];";
+        tap += buildPreviewGraph(*job.previews, job.toSdr.empty() ? "[pv]" : "[pvs]", scaler, hw ? hw->downloadFilter : "");
+        filter = audioInputArgs(job.audioFile) + " -filter_complex \"[0:v]split=2[r][pv];[r]" + chain +
+                 "[v0];" + tap + "\" -map \"[v0]\"" + audioMapArgs(job.audioFile);
+        previewArgs = previewOutputArgs(*job.previews);
+    }
+    // Finished rungs get their moov up front; chunks are only concatenated
+    std::string movflags = job.chunk < 0 ? " -movflags +faststart" : "";
+    if (hw) {
+        return "ffmpeg -y " + std::string(hw->inputArgs) + inputArgs + " -i \"" + videoPath + "\"" + filter +
+               " -c:v " + hw->encoder + rateControlArgs(job, false) + job.keyframeArgs + job.videoArgs + " -c:a copy" + movflags +
+               " \"" + job.outFile + "\"" + previewArgs;
+    }
+    std::string encoderArg = codecEncoderArgs(job.codec, forceSoftware, rateControlArgs(job, true));
+    return "ffmpeg -y" + threadArg + inputArgs + " -i \"" + videoPath + "\"" + filter +
+           threadArg + encoderArg + job.keyframeArgs + job.videoArgs + " -c:a copy" + movflags + " \"" + job.outFile + "\"" +
+           previewArgs;
+}
+
+// Encode one rung in its own ffmpeg process. A hardware rung that finds
+// every device session taken, or whose hardware encode fails, is run on
+// libx264 instead. Rungs in other codecs always encode in software.
+bool encodeRung(const std::string& source, const std::string& inputArgs, const EncodeJob& job, int threads,
+                const HwBackend* hw, HwSessionPool& sessions) {
+    if (job.codec != "h264") {
+        hw = nullptr;  // The device backends encode H.264 only
+    }
+    const std::string& input = job.input.empty() ? source : job.input;
+    const std::string& args = job.input.empty() ? inputArgs : std::string();
+    bool onDevice = hw && sessions.tryAcquire();
+    if (hw && !onDevice) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cout << "  " << job.name() << ": " << hw->name << " session limit reached, using libx264" << std::endl;
+    }
+
+    ProgressReporter& progress = *job.progress;
+    Stopwatch timer;
+    progress.emit(JsonObject("rung_start").add("task", job.name()).add("rung", job.label).add("chunk", job.chunk)
+                      .add("threads", threads).add("backend", onDevice ? hw->name : "software"));
+    std::string cmd = buildRungCommand(input, args, job, threads, onDevice ? hw : nullptr, hw != nullptr);
+    int result = runFfmpeg(cmd, {&job});
+    if (onDevice) {
+        sessions.release();
+        if (result != 0) {
+            {
+                std::lock_guard<std::mutex> lock(logMutex);
+                std::cout << "  " << job.name() << ": " << hw->name << " encode failed, retrying with libx264" << std::endl;
+            }
+            cmd = buildRungCommand(input, args, job, threads, nullptr, true);
+            result = runFfmpeg(cmd, {&job});
+        }
+    }
+
+    progress.emit(JsonObject("rung_done").add("task", job.name()).add("rung", job.label).add("chunk", job.chunk)
+                      .add("ok", result == 0).add("bytes", getFileSize(job.outFile)));
+    recordRungMetrics(job, timer.seconds(), result == 0);
+    std::lock_guard<std::mutex> lock(logMutex);
+    if (result == 0) {
+        std::cout << "✓ " << job.name() << " completed" << std::endl;
+        return true;
+    }
+    std::cout << "✗ " << job.name() << " failed" << std::endl;
+    std::cerr << "✗ " << job.name() << " failed. Command was: " << cmd << std::endl;
+    return false;
+}
+
+// Per-rung scores from the quality stage; -1 where a metric was not measured
+struct RungQuality {
+    double ssim = -1.0;
+    double psnr = -1.0;     // dB, capped at 100 for identical frames
+    double vmaf = -1.0;
+    bool retuned = false;   // Re-encoded with more bits after scoring under the floor
+    bool dropped = false;   // Removed by per-title as no better than the rung below
+
+    double score(const std::string& metric) const {
+        return metric == "ssim" ? ssim : metric == "psnr" ? psnr : metric == "vmaf" ? vmaf : -1.0;
+    }
+
+    // Add the measured scores; SSIM needs a fourth decimal to tell rungs apart
+    JsonObject& addScores(JsonObject& object) const {
+        if (ssim >= 0.0) {
+            std::ostringstream number;
+            number << std::fixed << std::setprecision(4) << ssim;
+            object.addRaw("ssim", number.str());
+        }
+        if (psnr >= 0.0) {
+            object.add("psnr", psnr);
+        }
+        if (vmaf >= 0.0) {
+            object.add("vmaf", vmaf);
+        }
+        return object.add("retuned", retuned);
+    }
+};
+
+// Smallest score gain over the next lower rung that makes a rung worth its
+// extra bits, in each metric's own units
+double qualityMargin(const std::string& metric) {
+    return metric == "vmaf" ? 1.0 : metric == "psnr" ? 0.5 : 0.002;
+}
+
+// Scores kept in <folder>/.quality across runs, one rung per line: label,
+// SSIM, PSNR, VMAF and flags ("-", "retuned", "dropped"), tab separated
+std::map<std::string, RungQuality> readQualityScores(const std::string& path) {
+    std::map<std::string, RungQuality> scores;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::stringstream fields(line);
+        std::string label, flags;
+        RungQuality quality;
+        if (fields >> label >> quality.ssim >> quality.psnr >> quality.vmaf >> flags) {
+            quality.retuned = flags.find("retuned") != std::string::npos;
+            quality.dropped = flags.find("dropped") != std::string::npos;
+            scores[label] = quality;
+        }
+    }
+    return scores;
+}
+
+bool writeQualityScores(const std::string& path, const std::map<std::string, RungQuality>& scores) {
+    std::ofstream out(path, std::ios::trunc);
+    out << std::fixed << std::setprecision(4);
+    for (const auto& entry : scores) {
+        const RungQuality& q = entry.second;
+        std::string flags = std::string(q.retuned ? "retuned" : "") + (q.retuned && q.dropped ? "," : "") +
+                            (q.dropped ? "dropped" : "");
+        out << entry.first << "\t" << q.ssim << "\t" << q.psnr << "\t" << q.vmaf << "\t"
+            << (flags.empty() ? "-" : flags) << "\n";
+    }
+    return out.good();
+}
+
+// Mean of the number following key on each line of an ssim or psnr stats
+// file, e.g. "All:" in "n:1 Y:0.98 U:0.99 V:0.99 All:0.985 (18.2)". The
+// file is removed. Returns -1 if no line had the key.
+double meanStatsValue(const std::string& statsFile, const std::string& key, double cap) {
+    std::ifstream stats(statsFile);
+    std::string line;
+    double sum = 0.0;
+    int frames = 0;
+    while (std::getline(stats, line)) {
+        size_t pos = line.find(key);
+        if (pos == std::string::npos) {
+            continue;
+        }
+        try {
+            sum += std::min(cap, std::stod(line.substr(pos + key.size())));
+            frames++;
+        } catch (const std::exception&) {
+            // Skip malformed lines
+        }
+    }
+    stats.close();
+    remove(statsFile.c_str());
+    return frames > 0 ? sum / frames : -1.0;
+}
+
+// Pooled mean from a libvmaf JSON log ("pooled_metrics": {"vmaf": {"mean": ...}}).
+// The log is removed. Returns -1 if it has no pooled VMAF.
+double vmafLogMean(const std::string& logFile) {
+    std::ifstream in(logFile);
+    std::stringstream text;
+    text << in.rdbuf();
+    in.close();
+    remove(logFile.c_str());
+    std::string log = text.str();
+    size_t pos = log.find("\"pooled_metrics\"");
+    pos = pos == std::string::npos ? pos : log.find("\"vmaf\"", pos);
+    pos = pos == std::string::npos ? pos : log.find("\"mean\"", pos);
+    pos = pos == std::string::npos ? pos : log.find(':', pos);
+    if (pos == std::string::npos) {
+        return -1.0;
+    }
+    char* end = nullptr;
+    double mean = std::strtod(log.c_str() + pos + 1, &end);
+    return end == log.c_str() + pos + 1 ? -1.0 : mean;
+}
+
+// Score finished rungs against the source over a few short windows. Each
+// window of the source is decoded once, brought to SDR like the rungs and
+// split to every rung; each rung is upscaled to the source size, so scores
+// compare across heights. The reference frames are decoded again here rather
+// than tapped from the ladder decode: chunked, parallel and remote rungs
+// have no shared decode, and a tap would have to keep full-size frames of
+// every window on disk until the rungs exist. The extra decode is the
+// sampled windows only. metricNames holds ssim, psnr and/or vmaf. Fills one
+// RungQuality per rung; returns false if a measurement failed.
+bool measureRungQuality(const std::string& source, const MediaInfo& info, const std::vector<const EncodeJob*>& rungs,
+                        const std::vector<std::string>& metricNames, const std::string& folderName,
+                        std::vector<RungQuality>& scores) {
+    const int sampleCount = 3;
+    std::string size = std::to_string(info.displayWidth()) + ":" + std::to_string(info.displayHeight());
+    std::string toSdr = rungs.empty() || rungs[0]->toSdr.empty() ? "format=yuv420p" : rungs[0]->toSdr;
+    size_t refs = rungs.size() * metricNames.size();
+
+    // Rung (distorted) frames lead each comparison, so rungs with a capped
+    // frame rate are compared against the source frame at their timestamp
+    std::string graph = "[0:v]setpts=PTS-STARTPTS,scale=" + size + "," + toSdr + ",split=" + std::to_string(refs);
+    for (size_t k = 0; k < refs; k++) {
+        graph += "[r" + std::to_string(k) + "]";
+    }
+    auto statsFile = [&](size_t rung, const std::string& metric, int sample) {
+        return folderName + "/.quality_" + std::to_string(rung) + "_" + metric + "_" + std::to_string(sample) +
+               (metric == "vmaf" ? ".json" : ".log");
+    };
+    std::vector<std::map<std::string, double>> sums(rungs.size());
+
+    double duration = info.duration;
+    double window = duration > 0.0 ? std::min(2.0, duration / sampleCount) : 2.0;
+    int samples = duration > 0.0 ? sampleCount : 1;
+    for (int s = 0; s < samples; s++) {
+        double start = duration > 0.0 ? duration * (s + 0.5) / samples - window / 2 : 0.0;
+        std::ostringstream seek;
+        seek << std::fixed << std::setprecision(2) << " -ss " << start << " -t " << window;
+        std::string cmd = "ffmpeg -v error -y" + seek.str() + " -i \"" + source + "\"";
+        std::string sampleGraph = graph;
+        std::string maps;
+        size_t ref = 0;
+        for (size_t i = 0; i < rungs.size(); i++) {
+            cmd += seek.str() + " -i \"" + rungs[i]->outFile + "\"";
+            std::string last = "d" + std::to_string(i);
+            sampleGraph += ";[" + std::to_string(i + 1) + ":v]setpts=PTS-STARTPTS,scale=" + size +
+                           ":flags=bicubic,format=yuv420p[" + last + "]";
+            // ssim, psnr and libvmaf pass their first input through, so one
+            // rung's comparisons chain
+            for (size_t m = 0; m < metricNames.size(); m++) {
+                const std::string& metric = metricNames[m];
+                std::string next = "q" + std::to_string(i) + "_" + std::to_string(m);
+                std::string filter = metric == "vmaf" ? "libvmaf=log_fmt=json:log_path=" + statsFile(i, metric, s)
+                                                      : metric + "=stats_file=" + statsFile(i, metric, s);
+                sampleGraph += ";[" + last + "][r" + std::to_string(ref++) + "]" + filter + "[" + next + "]";
+                last = next;
+            }
+            maps += " -map \"[" + last + "]\"";
+        }
+        cmd += " -filter_complex \"" + sampleGraph + "\"" + maps + " -an -f null -";
+        bool ok = system(cmd.c_str()) == 0;
+        for (size_t i = 0; i < rungs.size(); i++) {
+            for (const auto& metric : metricNames) {
+                double mean = metric == "vmaf" ? vmafLogMean(statsFile(i, metric, s))
+                            : meanStatsValue(statsFile(i, metric, s), metric == "ssim" ? "All:" : "psnr_avg:", 100.0);
+                ok = ok && mean >= 0.0;
+                sums[i][metric] += mean;
+            }
+        }
+        if (!ok) {
+            std::cerr << "✗ Quality measurement failed. Command was: " << cmd << std::endl;
+            return false;
+        }
+    }
+
+    // Every window counts alike, whatever its frame count
+    scores.assign(rungs.size(), RungQuality());
+    for (size_t i = 0; i < rungs.size(); i++) {
+        for (const auto& sum : sums[i]) {
+            double mean = sum.second / samples;
+            (sum.first == "ssim" ? scores[i].ssim : sum.first == "psnr" ? scores[i].psnr : scores[i].vmaf) = mean;
+        }
+    }
+    return true;
+}
+
+// Resolve the encoder thread budget, defaulting to every available core;
+// on Linux only the cores the runner may run on count (--cpus, taskset)
+int resolveThreadBudget(int requested) {
+    if (requested > 0) {
+        return requested;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        return CPU_COUNT(&set);
+    }
+#endif
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores > 0 ? static_cast<int>(cores) : 1;
+}
+
+// Encoder threads shared by every input of a --batch run. Rung tasks of all
+// inputs queue here together and the most expensive task that fits starts
+// first, so the machine stays busy while single inputs probe or package.
+class SharedThreads {
+public:
+    void enable(int capacity) { capacity_ = capacity; }
+    bool enabled() const { return capacity_ > 0; }
+
+    // Wait until threads are free; a no-op unless enabled
+    void acquire(int threads, double cost) {
+        if (!enabled()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        threads = std::min(threads, capacity_);
+        auto ticket = waiting_.insert(std::make_tuple(-cost, next_++, threads)).first;
+        cv_.wait(lock, [&] {
+            for (const auto& waiter : waiting_) {
+                if (inUse_ + std::get<2>(waiter) <= capacity_) {
+                    return waiter == *ticket;
+                }
+            }
+            return false;
+        });
+        waiting_.erase(ticket);
+        inUse_ += threads;
+        cv_.notify_all();
+    }
+
+    void release(int threads) {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        inUse_ -= std::min(threads, capacity_);
+        cv_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::set<std::tuple<double, unsigned long long, int>> waiting_; // (-cost, arrival, threads)
+    unsigned long long next_ = 0;
+    int capacity_ = 0;
+    int inUse_ = 0;
+};
+
+SharedThreads sharedThreads;
+
+// Split the thread budget across jobs in proportion to their expected cost.
+// With a codec given, only that codec's jobs share the budget.
+void assignThreads(std::vector<EncodeJob>& jobs, int threadBudget, const std::string& codec = "") {
+    double totalCost = 0.0;
+    size_t count = 0;
+    for (const auto& job : jobs) {
+        if (codec.empty() || job.codec == codec) {
+            totalCost += job.cost;
+            count++;
+        }
+    }
+    for (auto& job : jobs) {
+        if (!codec.empty() && job.codec != codec) {
+            continue;
+        }
+        double share = totalCost > 0.0 ? job.cost / totalCost : 1.0 / count;
+        job.threads = std::max(1, static_cast<int>(threadBudget * share + 0.5));
+        job.threads = std::min(job.threads, threadBudget);
+    }
+}
+
+// Run jobs concurrently, most expensive first, keeping the sum of reserved
+// encoder threads within threadBudget and holding further jobs while memory
+// pressure is over its limit. A job is always admitted when nothing else is
+// running so an oversized job cannot stall the queue. With a codec given,
+// only that codec's jobs are run.
+void runScheduled(std::vector<EncodeJob>& jobs, int threadBudget,
+                  const std::function<bool(EncodeJob&)>& runJob, const std::string& codec = "") {
+    std::vector<size_t> order;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (codec.empty() || jobs[i].codec == codec) {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return jobs[a].cost > jobs[b].cost;
+    });
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    int threadsInUse = 0;
+    int running = 0;
+    std::vector<std::thread> workers;
+
+    for (size_t idx : order) {
+        EncodeJob& job = jobs[idx];
+        {
+            // Under memory pressure further rungs wait; pressure is polled,
+            // so the wait wakes every second
+            std::unique_lock<std::mutex> lock(mtx);
+            bool held = false;
+            auto admit = [&] {
+                if (running == 0) {
+                    return true;
+                }
+                if (threadsInUse + job.threads > threadBudget) {
+                    return false;
+                }
+                bool pressured = memoryPressure.high();
+                if (pressured && !held) {
+                    held = true;
+                    metrics.count("process_video_pressure_holds");
+                    std::lock_guard<std::mutex> logLock(logMutex);
+                    std::cout << "  Memory pressure " << memoryPressure.current() << "% over " << memoryPressure.limit()
+                              << "%, holding " << job.name() << " behind " << running << " running" << std::endl;
+                }
+                return !pressured;
+            };
+            while (!cv.wait_for(lock, std::chrono::seconds(1), admit)) {
+            }
+            threadsInUse += job.threads;
+            running++;
+        }
+        workers.emplace_back([&, idx] {
+            EncodeJob& j = jobs[idx];
+            sharedThreads.acquire(j.threads, j.cost);
+            j.success = runJob(j);
+            sharedThreads.release(j.threads);
+            std::lock_guard<std::mutex> lock(mtx);
+            threadsInUse -= j.threads;
+            running--;
+            cv.notify_all();
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Thread budget of each codec's encoder pool. Codecs given in
+// --codec-threads get that many threads; the rest split what is left evenly.
+std::map<std::string, int> codecThreadBudgets(const std::vector<EncodeJob>& jobs, const ProcessOptions& options,
+                                              int threadBudget) {
+    std::map<std::string, int> budgets;
+    int reserved = 0;
+    for (const auto& job : jobs) {
+        auto fixed = options.codecThreads.find(job.codec);
+        if (!budgets.count(job.codec) && fixed != options.codecThreads.end()) {
+            reserved += fixed->second;
+            budgets[job.codec] = fixed->second;
+        } else if (!budgets.count(job.codec)) {
+            budgets[job.codec] = 0;
+        }
+    }
+    int shared = 0;
+    for (const auto& budget : budgets) {
+        shared += budget.second == 0 ? 1 : 0;
+    }
+    for (auto& budget : budgets) {
+        if (budget.second == 0) {
+            budget.second = std::max(1, (threadBudget - reserved) / shared);
+        }
+    }
+    return budgets;
+}
+
+// Run each codec's jobs in its own pool with its own thread budget, so slow
+// encodes in one codec cannot hold back another codec's rungs
+void runCodecPools(std::vector<EncodeJob>& jobs, const std::map<std::string, int>& budgets,
+                   const std::function<bool(EncodeJob&)>& runJob) {
+    if (budgets.size() == 1) {
+        runScheduled(jobs, budgets.begin()->second, runJob);
+        return;
+    }
+    std::vector<std::thread> pools;
+    for (const auto& budget : budgets) {
+        pools.emplace_back([&jobs, &runJob, budget] { runScheduled(jobs, budget.second, runJob, budget.first); });
+    }
+    for (auto& pool : pools) {
+        pool.join();
+    }
+}
+
+// A keyframe-aligned piece of the source produced by splitSource()
+struct SourceChunk {
+    std::string file;
+    double start = 0.0;      // Start time in the source, seconds
+    double duration = 0.0;
+};
+
+// Split the source's video stream into roughly count chunks with the
+// segment muxer. Cuts land on the first keyframe after each boundary and
+// packets are stream-copied, so concatenating the chunks is lossless.
+std::vector<SourceChunk> splitSource(const std::string& source, const std::string& chunkDir,
+                                     double duration, int count) {
+    std::vector<SourceChunk> chunks;
+    std::string listFile = chunkDir + "/chunks.csv";
+    std::ostringstream segmentTime;
+    segmentTime << std::fixed << std::setprecision(3) << duration / count;
+
+    std::string cmd = "ffmpeg -v error -y -i \"" + source + "\" -map 0:v:0 -c copy -f segment -segment_time " +
+                      segmentTime.str() + " -reset_timestamps 1 -segment_list \"" + listFile +
+                      "\" -segment_list_type csv \"" + chunkDir + "/source_%04d.mp4\"";
+    if (system(cmd.c_str()) != 0) {
+        std::cerr << "✗ Chunk split failed. Command was: " << cmd << std::endl;
+        return chunks;
+    }
+
+    // Each line is: filename,start,end
+    std::ifstream list(listFile);
+    std::string line;
+    while (std::getline(list, line)) {
+        std::stringstream fields(line);
+        std::string name, start, end;
+        if (!std::getline(fields, name, ',') || !std::getline(fields, start, ',') || !std::getline(fields, end, ',')) {
+            continue;
+        }
+        try {
+            SourceChunk chunk;
+            chunk.file = chunkDir + "/" + name;
+            chunk.start = std::stod(start);
+            chunk.duration = std::stod(end) - chunk.start;
+            chunks.push_back(chunk);
+        } catch (const std::exception&) {
+            // Skip malformed lines
+        }
+    }
+    list.close();
+    remove(listFile.c_str());
+    return chunks;
+}
+
+// Forced keyframe times for a chunk, relative to its start, that put
+// keyframes on the absolute segment grid of the whole rung
+std::string chunkKeyframeTimes(const SourceChunk& chunk, int segmentSeconds) {
+    std::ostringstream times;
+    times << "0";
+    long long k = static_cast<long long>(chunk.start / segmentSeconds) + 1;
+    for (; k * segmentSeconds < chunk.start + chunk.duration; k++) {
+        times << "," << std::fixed << std::setprecision(3) << k * segmentSeconds - chunk.start;
+    }
+    return times.str();
+}
+
+// Losslessly join a rung's encoded chunks with the concat demuxer and mux
+// the audio of audioSource (the source or the shared audio) back in
+bool concatChunks(const std::vector<std::string>& chunkFiles, const std::string& audioSource,
+                  const std::string& listFile, const std::string& outFile) {
+    std::ofstream list(listFile);
+    for (const auto& file : chunkFiles) {
+        // Paths in the list are resolved relative to the list file
+        size_t slash = file.find_last_of("/\\");
+        list << "file '" << (slash == std::string::npos ? file : file.substr(slash + 1)) << "'\n";
+    }
+    list.close();
+
+    std::string cmd = "ffmpeg -v error -y -f concat -safe 0 -i \"" + listFile + "\" -i \"" + audioSource +
+                      "\" -map 0:v -map 1:a:0? -c copy -movflags +faststart \"" + outFile + "\"";
+    bool ok = list.good() && system(cmd.c_str()) == 0;
+    if (!ok) {
+        std::cerr << "✗ Chunk concat failed. Command was: " << cmd << std::endl;
+    }
+    remove(listFile.c_str());
+    return ok;
+}
+
+// An input that is still being written, either an upload in progress or
+// the stdin spool. It is complete once a "<path>.done" marker exists, the
+// writer signals EOF, or the file has not grown for idleSeconds.
+class GrowingInput {
+public:
+    GrowingInput(const std::string& path, int idleSeconds)
+        : path_(path), idleSeconds_(idleSeconds), lastGrowth_(std::chrono::steady_clock::now()) {}
+
+    const std::string& path() const { return path_; }
+    std::string doneMarker() const { return path_ + ".done"; }
+
+    void markComplete() { eof_ = true; }
+
+    bool isComplete() {
+        if (eof_ || directoryExists(doneMarker())) {
+            return true;
+        }
+        long long size = getFileSize(path_);
+        auto now = std::chrono::steady_clock::now();
+        if (size != lastSize_) {
+            lastSize_ = size;
+            lastGrowth_ = now;
+            return false;
+        }
+        return now - lastGrowth_ >= std::chrono::seconds(idleSeconds_);
+    }
+
+    // Poll until the movie header can be parsed. For faststart MP4 this is
+    // as soon as the first few KB arrive; when moov sits at the end of the
+    // file (or the container is not MP4) this waits for the whole input.
+    bool waitForHeader(MediaInfo& info) {
+        bool announced = false;
+        while (true) {
+            if (probeMp4(path_, info)) {
+                return true;
+            }
+            if (isComplete()) {
+                return getFileSize(path_) > 0 && probeMedia(path_, info);
+            }
+            if (!announced) {
+                std::cout << "Waiting for input header; inputs without faststart start once fully received" << std::endl;
+                announced = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        }
+    }
+
+    void waitForComplete() {
+        while (!isComplete()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        }
+    }
+
+private:
+    std::string path_;
+    int idleSeconds_;
+    std::atomic<bool> eof_{false};
+    long long lastSize_ = -1;
+    std::chrono::steady_clock::time_point lastGrowth_;
+};
+
+// A finished rung handed to the packaging stage
+struct PackagedRung {
+    std::string label;
+    std::string file;
+    std::string codec;   // Video codec; DASH groups renditions into one adaptation set per codec
+};
+
+// Write the HLS master playlist. Bandwidth, resolution and codecs come from
+// probing each packaged rung, so the playlist matches what was produced.
+// With shared audio every variant references the one audio rendition.
+bool writeHlsMaster(const std::vector<PackagedRung>& rungs, const std::string& hlsDir, bool sharedAudio,
+                    const std::string& sharedCodec) {
+    std::ofstream master(hlsDir + "/master.m3u8");
+    if (!master) {
+        return false;
+    }
+    master << "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-INDEPENDENT-SEGMENTS\n";
+    if (sharedAudio) {
+        master << "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"audio\",NAME=\"Default\",DEFAULT=YES,AUTOSELECT=YES,"
+                  "URI=\"audio/index.m3u8\"\n";
+    }
+    for (const auto& rung : rungs) {
+        MediaInfo info;
+        if (!probeMedia(rung.file, info)) {
+            continue;
+        }
+        // Peak bandwidth is not known without scanning segments; allow 25% headroom
+        long long average = info.bitrate;
+        master << "#EXT-X-STREAM-INF:BANDWIDTH=" << average + average / 4 << ",AVERAGE-BANDWIDTH=" << average
+               << ",RESOLUTION=" << info.displayWidth() << "x" << info.displayHeight();
+        if (info.fps > 0.0) {
+            master << ",FRAME-RATE=" << std::fixed << std::setprecision(3) << info.fps;
+        }
+        std::string audioTag = audioCodecTag(sharedAudio ? sharedCodec : info.audioCodec);
+        if (!info.codecTag.empty()) {
+            master << ",CODECS=\"" << info.codecTag << (audioTag.empty() ? "" : "," + audioTag) << "\"";
+        }
+        if (sharedAudio) {
+            master << ",AUDIO=\"audio\"";
+        }
+        master << "\n" << rung.label << "/index.m3u8\n";
+    }
+    return master.good();
+}
+
+// Package the ladder as fragmented MP4 (CMAF) segments with HLS media
+// playlists plus a master playlist, and/or a DASH manifest. Segments are
+// stream copies; alignment across rungs comes from the forced keyframes
+// set on every encode. Shared audio is packaged once as its own rendition
+// instead of inside every variant; sourceAudio says whether the rungs carry
+// a track of their own when there is no shared audio.
+void packageLadder(const std::vector<PackagedRung>& rungs, const std::string& folderName,
+                   const ProcessOptions& options, const std::string& audioFile, const std::string& audioCodec,
+                   bool sourceAudio) {
+    std::string seg = std::to_string(options.segmentSeconds);
+
+    if (options.packageHls) {
+        std::string hlsDir = folderName + "/hls";
+        bool ok = ensureDirectory(hlsDir);
+        std::vector<PackagedRung> renditions = rungs;
+        if (!audioFile.empty()) {
+            renditions.push_back({"audio", audioFile, ""});
+        }
+        for (const auto& rung : renditions) {
+            std::string dir = hlsDir + "/" + rung.label;
+            if (!ok || !ensureDirectory(dir)) {
+                ok = false;
+                break;
+            }
+            std::string maps = rung.file == audioFile ? " -map 0:a:0"
+                               : audioFile.empty()    ? " -map 0:v:0 -map 0:a:0?"
+                                                      : " -map 0:v:0";
+            std::string cmd = "ffmpeg -v error -y -i \"" + rung.file + "\"" + maps + " -c copy -f hls"
+                              " -hls_time " + seg + " -hls_playlist_type vod -hls_segment_type fmp4"
+                              " -hls_fmp4_init_filename init.mp4 -hls_segment_filename \"" + dir + "/seg_%05d.m4s\" \"" +
+                              dir + "/index.m3u8\"";
+            if (system(cmd.c_str()) != 0) {
+                std::cerr << "✗ HLS packaging failed for " << rung.label << "p. Command was: " << cmd << std::endl;
+                ok = false;
+            }
+        }
+        if (ok && writeHlsMaster(rungs, hlsDir, !audioFile.empty(), audioCodec)) {
+            std::cout << "✓ HLS packaged: " << hlsDir << "/master.m3u8" << std::endl;
+        } else {
+            std::cout << "✗ HLS packaging failed" << std::endl;
+        }
+    }
+
+    if (options.packageDash) {
+        std::string dashDir = folderName + "/dash";
+        std::string cmd = "ffmpeg -v error -y";
+        std::string maps;
+        std::map<std::string, std::string> codecStreams;  // codec -> output stream indices
+        for (size_t i = 0; i < rungs.size(); i++) {
+            cmd += " -i \"" + rungs[i].file + "\"";
+            maps += " -map " + std::to_string(i) + ":v:0";
+            std::string& streams = codecStreams[rungs[i].codec];
+            streams += (streams.empty() ? "" : ",") + std::to_string(i);
+        }
+        std::string adaptationSets;
+        int setId = 0;
+        for (const auto& codec : codecStreams) {
+            adaptationSets += (adaptationSets.empty() ? "id=" : " id=") + std::to_string(setId++) + ",streams=" + codec.second;
+        }
+        // A silent input has no audio for the dash muxer to put in a set
+        if (!audioFile.empty()) {
+            cmd += " -i \"" + audioFile + "\"";
+            maps += " -map " + std::to_string(rungs.size()) + ":a:0";
+            adaptationSets += " id=" + std::to_string(setId) + ",streams=a";
+        } else if (sourceAudio) {
+            maps += " -map 0:a:0";
+            adaptationSets += " id=" + std::to_string(setId) + ",streams=a";
+        }
+        // The segment templates' $ must reach ffmpeg unexpanded by the shell
+#ifdef _WIN32
+        std::string id = "$RepresentationID$", number = "$Number%05d$";
+#else
+        std::string id = "\\$RepresentationID\\$", number = "\\$Number%05d\\$";
+#endif
+        cmd += maps + " -c copy -f dash -dash_segment_type mp4 -seg_duration " + seg +
+               " -use_template 1 -use_timeline 1 -adaptation_sets \"" + adaptationSets + "\""
+               " -init_seg_name \"init_" + id + ".m4s\" -media_seg_name \"chunk_" + id + "_" + number + ".m4s\" \"" +
+               dashDir + "/manifest.mpd\"";
+        if (ensureDirectory(dashDir) && system(cmd.c_str()) == 0) {
+            std::cout << "✓ DASH packaged: " << dashDir << "/manifest.mpd" << std::endl;
+        } else {
+            std::cout << "✗ DASH packaging failed" << std::endl;
+            std::cerr << "✗ DASH packaging failed. Command was: " << cmd << std::endl;
+        }
+    }
+}
+
+// Rewrite an MP4 so its moov box precedes mdat, letting players start and
+// seek with a few range requests instead of reading to the end of the file
+bool relocateMoov(const std::string& path) {
+    std::string temp = path + ".faststart";
+    std::string cmd = "ffmpeg -v error -y -i \"" + path + "\" -map 0 -c copy -movflags +faststart -f mp4 \"" + temp + "\"";
+    if (system(cmd.c_str()) != 0 || getFileSize(temp) <= 0) {
+        std::cerr << "✗ moov relocation failed. Command was: " << cmd << std::endl;
+        remove(temp.c_str());
+        return false;
+    }
+    // Replacing breaks any hardlink to the upload or the cache, not their contents
+    remove(path.c_str());
+    return rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// Write <folder>/index.json describing every rung in the folder: its file,
+// size, MIME type with RFC 6381 codecs, duration and moov offset, plus the
+// streaming manifests and previews. Rungs without faststart get their moov
+// relocated first, so the server can answer range requests from the index
+// without scanning the folder.
+bool writeOutputIndex(const std::string& folderName, const std::string& stem, const std::string& originalLabel) {
+    struct IndexedRung {
+        std::string label;
+        std::string file;
+        MediaInfo info;
+    };
+    std::vector<IndexedRung> rungs;
+    std::string prefix = stem + " ";
+    for (const auto& entry : listDirectory(folderName)) {
+        const std::string& name = entry.first;
+        if (entry.second || name.size() <= prefix.size() + 4 || name.compare(0, prefix.size(), prefix) != 0 ||
+            name.compare(name.size() - 4, 4, ".mp4") != 0) {
+            continue;
+        }
+        IndexedRung rung;
+        rung.label = name.substr(prefix.size(), name.size() - prefix.size() - 4);
+        rung.file = name;
+        std::string path = folderName + "/" + name;
+        if (!probeMedia(path, rung.info)) {
+            continue;
+        }
+        if (!rung.info.faststart && rung.info.moovOffset >= 0) {
+            if (!relocateMoov(path) || !probeMedia(path, rung.info)) {
+                continue;
+            }
+            metrics.count("process_video_moov_relocations");
+        }
+        rungs.push_back(rung);
+    }
+    std::sort(rungs.begin(), rungs.end(), [](const IndexedRung& a, const IndexedRung& b) {
+        return a.info.height != b.info.height ? a.info.height > b.info.height : a.label < b.label;
+    });
+
+    // Scores from the quality stage, when it ran
+    std::map<std::string, RungQuality> scores = readQualityScores(folderName + "/.quality");
+    std::string list;
+    for (const auto& rung : rungs) {
+        const MediaInfo& info = rung.info;
+        std::string audioTag = audioCodecTag(info.audioCodec);
+        std::string mime = "video/mp4";
+        if (!info.codecTag.empty()) {
+            mime += "; codecs=\"" + info.codecTag + (audioTag.empty() ? "" : "," + audioTag) + "\"";
+        }
+        size_t dash = rung.label.find('-');
+        JsonObject item;
+        item.add("label", rung.label).add("file", rung.file).add("width", info.displayWidth())
+            .add("height", info.displayHeight()).add("codec", dash == std::string::npos ? info.videoCodec : rung.label.substr(dash + 1))
+            .add("size", getFileSize(folderName + "/" + rung.file)).add("mime", mime)
+            .add("duration", info.duration).add("bitrate", info.bitrate).add("moov_offset", info.moovOffset)
+            .add("faststart", info.faststart || info.moovOffset < 0).add("original", rung.label == originalLabel);
+        auto score = scores.find(rung.label);
+        if (score != scores.end()) {
+            JsonObject quality;
+            item.addRaw("quality", score->second.addScores(quality).str());
+        }
+        list += (list.empty() ? "" : ",") + item.str();
+    }
+
+    JsonObject index;
+    index.add("version", 1).add("stem", stem).add("original", originalLabel).addRaw("rungs", "[" + list + "]");
+    JsonObject streams;
+    if (access((folderName + "/hls/master.m3u8").c_str(), F_OK) == 0) {
+        streams.add("hls", "hls/master.m3u8");
+    }
+    if (access((folderName + "/dash/manifest.mpd").c_str(), F_OK) == 0) {
+        streams.add("dash", "dash/manifest.mpd");
+    }
+    index.addRaw("streams", streams.str());
+    if (access((folderName + "/previews/thumbnails.vtt").c_str(), F_OK) == 0) {
+        index.addRaw("previews", JsonObject().add("poster", "previews/poster.jpg").add("sprite", "previews/sprite.jpg")
+                                     .add("thumbnails", "previews/thumbnails.vtt").str());
+    }
+
+    // Written aside and renamed, so a reader never sees half an index
+    std::string path = folderName + "/index.json";
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out << index.str() << "\n";
+        if (!out.good()) {
+            std::cerr << "✗ Could not write " << path << std::endl;
+            remove(temp.c_str());
+            return false;
+        }
+    }
+    remove(path.c_str());
+    return rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// Minimal SHA-256 (FIPS 180-4) used to content-address inputs
+class Sha256 {
+public:
+    void update(const unsigned char* data, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            block_[blockLength_++] = data[i];
+            if (blockLength_ == 64) {
+                compress();
+                blockLength_ = 0;
+            }
+        }
+        totalLength_ += length;
+    }
+
+    void update(const std::string& data) {
+        update(reinterpret_cast<const unsigned char*>(data.data()), data.size());
+    }
+
+    // The 32-byte digest; the hasher must not be updated afterwards
+    std::string digest() {
+        uint64_t bits = totalLength_ * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (blockLength_ != 56) {
+            update(&pad, 1);
+        }
+        unsigned char length[8];
+        for (int i = 0; i < 8; i++) {
+            length[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        update(length, 8);
+
+        std::string out;
+        for (uint32_t word : state_) {
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                out += static_cast<char>((word >> shift) & 0xff);
+            }
+        }
+        return out;
+    }
+
+    std::string hexDigest() {
+        static const char* hex = "0123456789abcdef";
+        std::string out;
+        for (unsigned char c : digest()) {
+            out += hex[c >> 4];
+            out += hex[c & 0x0f];
+        }
+        return out;
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress() {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = readBe32(block_ + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+        uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state_[0] += a; state_[1] += b; state_[2] += c; state_[3] += d;
+        state_[4] += e; state_[5] += f; state_[6] += g; state_[7] += h;
+    }
+
+    uint32_t state_[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char block_[64];
+    size_t blockLength_ = 0;
+    uint64_t totalLength_ = 0;
+};
+
+// Content hash of a file: SHA-256 over the file size and the SHA-256 of
+// each 8 MiB chunk. Chunks are hashed in parallel, so large uploads hash at
+// disk speed. Returns an empty string if the file cannot be read.
+std::string hashFileContents(const MappedFile& file) {
+    const long long chunkSize = 8LL << 20;
+    long long size = file.size();
+    size_t chunkCount = static_cast<size_t>(std::max(1LL, (size + chunkSize - 1) / chunkSize));
+    std::vector<std::string> digests(chunkCount);
+    std::atomic<size_t> nextChunk{0};
+
+    file.adviseSequential();
+    auto hashChunks = [&]() {
+        for (size_t c = nextChunk++; c < chunkCount; c = nextChunk++) {
+            long long offset = static_cast<long long>(c) * chunkSize;
+            // Keep the disk one chunk ahead of the hashing
+            file.prefetch(offset + chunkSize, chunkSize);
+            Sha256 sha;
+            if (size > 0) {
+                sha.update(file.data() + offset, static_cast<size_t>(std::min(chunkSize, size - offset)));
+            }
+            digests[c] = sha.digest();
+        }
+    };
+
+    unsigned workers = std::min<unsigned>(std::max(1u, std::thread::hardware_concurrency()), 8);
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < std::min<size_t>(workers, chunkCount); i++) {
+        threads.emplace_back(hashChunks);
+    }
+    hashChunks();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    Sha256 root;
+    root.update(std::to_string(size) + "\n");
+    for (const auto& digest : digests) {
+        root.update(digest);
+    }
+    return root.hexDigest();
+}
+
+std::string hashFileContents(const std::string& path) {
+    MappedFile file;
+    return file.open(path) ? hashFileContents(file) : "";
+}
+
+// First line of `ffmpeg -version`, so upgrading the encoder invalidates the cache
+std::string encoderVersion() {
+    static std::once_flag once;
+    static std::string version;
+    std::call_once(once, [] {
+        FILE* pipe = popen("ffmpeg -version 2>" NULL_DEVICE, "r");
+        if (pipe) {
+            char buffer[512];
+            if (fgets(buffer, sizeof(buffer), pipe)) {
+                version = buffer;
+                version.erase(version.find_last_not_of("\r\n") + 1);
+            }
+            pclose(pipe);
+        }
+    });
+    return version;
+}
+
+// Key for an input's outputs: its content hash combined with every option
+// that changes the produced bytes
+std::string outputKey(const std::string& contentHash, const ProcessOptions& options) {
+    std::string qualityMetrics;
+    for (const auto& metric : options.qualityMetrics) {
+        qualityMetrics += (qualityMetrics.empty() ? "" : ",") + metric;
+    }
+    std::ostringstream config;
+    config << contentHash << "\n" << encoderVersion()
+           << "\nladder=" << (options.cascade ? "cascade:" + std::to_string(options.ssimTolerance) : "scale")
+           << "\nhwaccel=" << options.hwaccel
+           << "\nprofile=" << profileKey(*options.profile)
+           << "\ncodecs=" << codecList(options)
+           << "\npackage=" << options.packageHls << options.packageDash << ":" << options.segmentSeconds
+           << "\nchunks=" << options.chunks << ":" << options.chunkMinHeight
+           << "\nper-title=" << options.perTitle
+           << "\ntwo-pass=" << options.twoPass
+           << "\nfps-cap=" << options.fpsCapHeight << ":" << options.fpsCap
+           << "\nquality=" << qualityMetrics << ":" << options.qualityFloorMetric << ":" << options.qualityFloor
+           << "\naudio=" << options.audio << (options.loudnorm ? ":loudnorm" : "")
+           << "\npreviews=" << (options.previews ? std::to_string(options.spriteInterval) : "off") << "\n";
+    Sha256 key;
+    key.update(config.str());
+    return key.hexDigest();
+}
+
+// Cache entry directory for an input's content hash, or empty if the
+// cache cannot be used
+std::string cacheEntryFor(const std::string& contentHash, const ProcessOptions& options) {
+    if (contentHash.empty() || !ensureDirectory(options.cacheDir)) {
+        return "";
+    }
+    return options.cacheDir + "/" + outputKey(contentHash, options);
+}
+
+// Link a cached ladder into the output folder. Rung files are cached under
+// their label and take this job's stem; everything else keeps its path.
+bool restoreFromCache(const std::string& entry, const std::string& folderName, const std::string& stem) {
+    std::ifstream manifest(entry + "/manifest.txt");
+    std::string relative;
+    int restored = 0;
+    while (std::getline(manifest, relative)) {
+        std::string target = folderName + "/" + (relative.find('/') == std::string::npos ? stem + " " : "") + relative;
+        if (!ensureParentDirectories(target) || materializeFile(entry + "/" + relative, target, false).empty()) {
+            std::cerr << "Warning: Could not restore cached " << relative << ", encoding instead" << std::endl;
+            return false;
+        }
+        restored++;
+    }
+    return restored > 0;
+}
+
+// Publish outputs as a cache entry. Files are linked into a private staging
+// directory that is renamed into place, so a reader never sees a partial
+// entry and concurrent jobs for the same input cannot collide.
+void storeInCache(const std::string& entry, const std::vector<std::pair<std::string, std::string>>& files) {
+    static std::atomic<int> staged{0};
+    std::string staging = entry + ".tmp-" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) +
+                          "-" + std::to_string(staged++);
+    bool ok = !directoryExists(entry) && ensureDirectory(staging);
+    std::ofstream manifest(staging + "/manifest.txt");
+    for (size_t i = 0; ok && i < files.size(); i++) {
+        std::string target = staging + "/" + files[i].second;
+        ok = ensureParentDirectories(target) && !materializeFile(files[i].first, target, false).empty();
+        manifest << files[i].second << "\n";
+    }
+    manifest.close();
+    if (ok && manifest && rename(staging.c_str(), entry.c_str()) == 0) {
+        std::cout << "✓ Outputs cached: " << entry << std::endl;
+    } else {
+        removeTree(staging);
+    }
+}
+
+// Checkpoint of a job's finished pieces, kept next to the outputs. The
+// first line fingerprints the input and settings; a manifest from a
+// different input or settings is discarded. Each later line records one
+// finished piece (original, rung or chunk) with its size and checksum,
+// flushed as soon as the piece completes, so a run that dies leaves a valid
+// prefix. A rerun skips a piece only if its file still matches both.
+class JobManifest {
+public:
+    bool open(const std::string& path, const std::string& fingerprint) {
+        std::ifstream existing(path);
+        std::string line;
+        bool matches = std::getline(existing, line) && line == "fingerprint\t" + fingerprint;
+        while (matches && std::getline(existing, line)) {
+            std::stringstream fields(line);
+            std::string key, size, checksum;
+            if (std::getline(fields, key, '\t') && std::getline(fields, size, '\t') && std::getline(fields, checksum) &&
+                checksum.size() == 64) {
+                entries_[key] = {std::atoll(size.c_str()), checksum};
+            }
+        }
+        existing.close();
+
+        out_.open(path, matches ? std::ios::app : std::ios::trunc);
+        if (!matches) {
+            out_ << "fingerprint\t" << fingerprint << "\n" << std::flush;
+        } else if (!entries_.empty()) {
+            std::cout << "Resuming: " << entries_.size() << " finished pieces recorded in " << path << std::endl;
+        }
+        return out_.good();
+    }
+
+    // True if key was finished by an earlier run and file still matches
+    bool isDone(const std::string& key, const std::string& file) {
+        std::pair<long long, std::string> entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto found = entries_.find(key);
+            if (!out_.is_open() || found == entries_.end()) {
+                return false;
+            }
+            entry = found->second;
+        }
+        bool valid = getFileSize(file) == entry.first && hashFileContents(file) == entry.second;
+        if (valid) {
+            metrics.count("process_video_resumed", metricLabel("piece", key.substr(0, key.find(' '))));
+        }
+        return valid;
+    }
+
+    // Record a finished piece; checksum may be passed when already known
+    void record(const std::string& key, const std::string& file, std::string checksum = "") {
+        if (!out_.is_open()) {
+            return;
+        }
+        long long size = getFileSize(file);
+        if (checksum.empty()) {
+            checksum = hashFileContents(file);
+        }
+        if (size < 0 || checksum.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_[key] = {size, checksum};
+        out_ << key << "\t" << size << "\t" << checksum << "\n" << std::flush;
+    }
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, std::pair<long long, std::string>> entries_;  // key -> size, checksum
+    std::ofstream out_;
+};
+
+// Uploads finished outputs to object storage while encoding continues. The
+// command template is run once per file with {file} replaced by the quoted
+// local path and {key} by the quoted object key, e.g.
+//   aws s3 cp {file} s3://bucket/videos/{key}
+// The storage CLI does the multipart transfer. Failed uploads are retried
+// twice with a short backoff.
+class Offloader {
+public:
+    Offloader(const std::string& commandTemplate, int workers,
+              std::function<void(const std::string&, const std::string&)> onUploaded)
+        : template_(commandTemplate), workers_(std::max(1, workers)), onUploaded_(std::move(onUploaded)) {}
+
+    ~Offloader() { finish(); }
+
+    bool enabled() const { return !template_.empty(); }
+
+    // Queue file for upload under key; the first submission starts the workers
+    void submit(const std::string& file, const std::string& key) {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back({file, key});
+        if (threads_.empty()) {
+            for (int i = 0; i < workers_; i++) {
+                threads_.emplace_back([this] { work(); });
+            }
+        }
+        cv_.notify_one();
+    }
+
+    // Wait for every queued upload. Returns true if all of them succeeded.
+    bool finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        cv_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+        threads_.clear();
+        return failures_ == 0;
+    }
+
+private:
+    // Substitute the quoted file and key into the template
+    std::string command(const std::string& file, const std::string& key) const {
+        std::string cmd = template_;
+        for (const auto& field : {std::make_pair(std::string("{file}"), file), std::make_pair(std::string("{key}"), key)}) {
+            for (size_t at = cmd.find(field.first); at != std::string::npos;
+                 at = cmd.find(field.first, at + field.second.size() + 2)) {
+                cmd.replace(at, field.first.size(), "\"" + field.second + "\"");
+            }
+        }
+        return cmd;
+    }
+
+    void work() {
+        while (true) {
+            std::pair<std::string, std::string> item;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+                if (queue_.empty()) {
+                    return;
+                }
+                item = queue_.front();
+                queue_.pop_front();
+            }
+            Stopwatch timer;
+            std::string cmd = command(item.first, item.second);
+            bool ok = false;
+            for (int attempt = 0; attempt < 3 && !ok; attempt++) {
+                if (attempt > 0) {
+                    std::this_thread::sleep_for(std::chrono::seconds(2 * attempt));
+                }
+                ok = system(cmd.c_str()) == 0;
+            }
+            metrics.count("process_video_offload", metricLabel("result", ok ? "uploaded" : "failed"));
+            if (ok) {
+                metrics.count("process_video_offload_bytes", "", static_cast<double>(std::max(0LL, getFileSize(item.first))));
+                onUploaded_(item.first, item.second);
+            } else {
+                failures_++;
+            }
+            std::lock_guard<std::mutex> lock(logMutex);
+            if (ok) {
+                std::cout << "✓ Offloaded " << item.second << " (" << std::fixed << std::setprecision(2)
+                          << timer.seconds() << " s)" << std::endl;
+            } else {
+                std::cout << "✗ Offload failed: " << item.second << std::endl;
+                std::cerr << "✗ Offload failed. Command was: " << cmd << std::endl;
+            }
+        }
+    }
+
+    std::string template_;
+    int workers_;
+    std::function<void(const std::string&, const std::string&)> onUploaded_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::pair<std::string, std::string>> queue_;  // (file, key)
+    std::vector<std::thread> threads_;
+    bool closed_ = false;
+    std::atomic<int> failures_{0};
+};
+
+// Helper function to get a file's modification time in seconds since the epoch
+long long getModifiedTime(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return -1;
+    }
+    return static_cast<long long>(st.st_mtime);
+}
+
+// Helper function to sum the sizes of all files under a directory
+long long directorySize(const std::string& dir) {
+    std::vector<std::string> files;
+    listFiles(dir, "", files);
+    long long total = 0;
+    for (const auto& file : files) {
+        total += std::max(0LL, getFileSize(dir + "/" + file));
+    }
+    return total;
+}
+
+// Folder a job's outputs are written to
+std::string outputFolder(const std::string& stem, const ProcessOptions& options) {
+    return options.outputDir.empty() ? stem : options.outputDir + "/" + stem;
+}
+
+// Keep the finished job folders under the output root within quota bytes by
+// deleting the least recently used ones. A folder is finished once it has a
+// .accessed marker, whose mtime is its last use (the server touches it on
+// every download). With offload configured, only folders whose uploads all
+// succeeded (.offloaded) are evicted, so nothing is deleted before it has
+// been uploaded.
+void enforceDiskQuota(const ProcessOptions& options, const std::string& keep) {
+    static std::mutex quotaMutex;
+    std::lock_guard<std::mutex> lock(quotaMutex);
+    std::string root = options.outputDir.empty() ? "." : options.outputDir;
+
+    struct Candidate {
+        long long accessed;
+        long long size;
+        std::string folder;
+    };
+    std::vector<Candidate> candidates;
+    long long used = 0;
+    for (const auto& entry : listDirectory(root)) {
+        std::string folder = root + "/" + entry.first;
+        long long accessed = entry.second ? getModifiedTime(folder + "/.accessed") : -1;
+        if (accessed < 0) {
+            continue;
+        }
+        long long size = directorySize(folder);
+        used += size;
+        bool evictable = options.offloadCommand.empty() || getFileSize(folder + "/.offloaded") >= 0;
+        if (evictable && entry.first != keep) {
+            candidates.push_back({accessed, size, folder});
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate& a, const Candidate& b) { return a.accessed < b.accessed; });
+
+    for (const auto& candidate : candidates) {
+        if (used <= options.diskQuota) {
+            break;
+        }
+        removeTree(candidate.folder);
+        used -= candidate.size;
+        metrics.count("process_video_evicted_bytes", "", static_cast<double>(candidate.size));
+        std::cout << "Evicted " << candidate.folder << " (" << candidate.size / (1024 * 1024) << " MiB) to stay within the disk quota"
+                  << std::endl;
+    }
+    if (used > options.diskQuota) {
+        std::cout << "Disk quota exceeded by " << (used - options.diskQuota) / (1024 * 1024)
+                  << " MiB; nothing left that can be evicted" << std::endl;
+    }
+}
+
+// Cut the previews in a pass of their own, for when no ladder encode can
+// carry them. Only keyframes are decoded.
+bool generatePreviews(const std::string& source, const PreviewPlan& plan) {
+    std::string cmd = "ffmpeg -v error -y -skip_frame nokey -i \"" + source + "\" -filter_complex \"" +
+                      buildPreviewGraph(plan, "[0:v]", "scale", "") + "\"" + previewOutputArgs(plan);
+    return system(cmd.c_str()) == 0;
+}
+
+#ifndef _WIN32
+// Resolve "host:port", or just "port" for every local interface
+addrinfo* resolveAddress(const std::string& address, bool passive) {
+    size_t colon = address.rfind(':');
+    std::string host = colon == std::string::npos ? "" : address.substr(0, colon);
+    std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0) {
+        return nullptr;
+    }
+    return result;
+}
+
+// Open a TCP socket listening on address, or -1
+int listenTcp(const std::string& address) {
+    addrinfo* addresses = resolveAddress(address, true);
+    int fd = -1;
+    for (addrinfo* a = addresses; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        int reuse = 1;
+        if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+                        bind(fd, a->ai_addr, a->ai_addrlen) != 0 || listen(fd, 64) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (addresses) {
+        freeaddrinfo(addresses);
+    }
+    return fd;
+}
+
+// Open a TCP connection to address, or -1
+int connectTcp(const std::string& address) {
+    addrinfo* addresses = resolveAddress(address, false);
+    int fd = -1;
+    for (addrinfo* a = addresses; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (addresses) {
+        freeaddrinfo(addresses);
+    }
+    return fd;
+}
+
+// Tab-separated request lines over a connected socket
+class LineSocket {
+public:
+    explicit LineSocket(int fd) : fd_(fd) {}
+
+    // Read the next line's fields; false once the peer is gone
+    bool read(std::vector<std::string>& fields) {
+        size_t newline;
+        while ((newline = pending_.find('\n')) == std::string::npos) {
+            char buffer[4096];
+            ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                return false;
+            }
+            pending_.append(buffer, static_cast<size_t>(n));
+        }
+        std::string line = pending_.substr(0, newline);
+        pending_.erase(0, newline + 1);
+        // Split by hand: getline drops a trailing empty field, and TASK
+        // lines end in fields that are often empty
+        fields.clear();
+        size_t start = 0;
+        for (size_t tab = line.find('\t'); tab != std::string::npos; tab = line.find('\t', start)) {
+            fields.push_back(line.substr(start, tab - start));
+            start = tab + 1;
+        }
+        fields.push_back(line.substr(start));
+        return !fields.empty() && !fields[0].empty();
+    }
+
+    bool write(const std::vector<std::string>& fields) {
+        std::string line;
+        for (const auto& field : fields) {
+            line += (line.empty() ? "" : "\t") + field;
+        }
+        line += "\n";
+        return send(fd_, line.data(), line.size(), 0) == static_cast<ssize_t>(line.size());
+    }
+
+private:
+    int fd_;
+    std::string pending_;
+};
+
+// Absolute form of a path whose parent directory exists
+std::string absoluteFilePath(const std::string& path) {
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) {
+        return absolutePath(".") + "/" + path;
+    }
+    return absolutePath(path.substr(0, slash)) + path.substr(slash);
+}
+
+// Coordinator side of distributed encoding. Workers connect over TCP, one
+// connection per encode slot, and pull (rung, chunk) tasks whose input and
+// output paths are on storage shared with the coordinator. A batch is dealt
+// out when it is submitted, most expensive task first, to the slot with the
+// least queued cost. A slot that runs dry takes unassigned tasks, then
+// steals from the back of the busiest slot's queue. A task whose worker
+// disconnects is queued again for another slot, up to three attempts.
+//
+// Workers send tab-separated lines:
+//   PULL <name>        answered with TASK <id> <label> <chunk> <chunks> <input>
+//                      <output> <width> <height> <video args> <audio> <duration> <codec>
+//                      <bitrate> <zones> <frame step> <SDR filters>
+//                      (any field may be empty, the last ones usually are)
+//   DONE <id> <ok>
+class WorkerPool {
+public:
+    using DoneCallback = std::function<void(EncodeJob&, const std::string& worker, double seconds)>;
+
+    bool listen(const std::string& address) {
+        listener_ = listenTcp(address);
+        if (listener_ < 0) {
+            std::cerr << "Error: Could not listen for workers on " << address << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        signal(SIGPIPE, SIG_IGN);
+        std::cout << "Coordinator listening for workers on " << address << std::endl;
+        std::thread([this] {
+            while (true) {
+                int fd = accept(listener_, nullptr, nullptr);
+                if (fd >= 0) {
+                    std::thread(&WorkerPool::serveSlot, this, fd).detach();
+                } else if (errno != EINTR) {
+                    break;
+                }
+            }
+        }).detach();
+        return true;
+    }
+
+    bool enabled() const { return listener_ >= 0; }
+
+    // Run tasks on the connected workers and return once every task has
+    // finished or failed. onDone runs as each one finishes. Once stop is set,
+    // tasks not yet handed out are withdrawn and left unfinished.
+    void run(const std::vector<EncodeJob*>& jobs, const std::atomic<bool>* stop, const DoneCallback& onDone) {
+        Batch batch;
+        batch.onDone = onDone;
+        std::vector<EncodeJob*> order(jobs);
+        std::stable_sort(order.begin(), order.end(), [](const EncodeJob* a, const EncodeJob* b) {
+            return a->cost > b->cost;
+        });
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (EncodeJob* job : order) {
+            auto task = std::make_shared<Task>();
+            task->job = job;
+            task->batch = &batch;
+            task->id = std::to_string(nextId_++);
+            job->success = false;
+            Slot* lightest = nullptr;
+            for (Slot* slot : slots_) {
+                if (!lightest || slot->queuedCost < lightest->queuedCost) {
+                    lightest = slot;
+                }
+            }
+            if (lightest) {
+                lightest->queue.push_back(task);
+                lightest->queuedCost += job->cost;
+            } else {
+                unassigned_.push_back(task);
+            }
+            batch.remaining++;
+        }
+        if (slots_.empty() && batch.remaining > 0) {
+            std::lock_guard<std::mutex> logLock(logMutex);
+            std::cout << "Waiting for workers to connect..." << std::endl;
+        }
+        changed_.notify_all();
+
+        while (batch.remaining > 0) {
+            changed_.wait_for(lock, std::chrono::milliseconds(200));
+            if (stop && stop->load()) {
+                withdraw(&batch, unassigned_);
+                for (Slot* slot : slots_) {
+                    slot->queuedCost -= withdraw(&batch, slot->queue);
+                }
+            }
+        }
+    }
+
+private:
+    struct Batch {
+        int remaining = 0;
+        DoneCallback onDone;
+    };
+
+    struct Task {
+        EncodeJob* job = nullptr;
+        Batch* batch = nullptr;
+        std::string id;
+        int attempts = 0;
+    };
+
+    struct Slot {
+        std::string name;
+        std::deque<std::shared_ptr<Task>> queue;
+        double queuedCost = 0.0;
+    };
+
+    // Drop a batch's tasks from a queue; returns their cost. Called with mutex_ held.
+    static double withdraw(Batch* batch, std::deque<std::shared_ptr<Task>>& queue) {
+        double cost = 0.0;
+        for (auto it = queue.begin(); it != queue.end();) {
+            if ((*it)->batch == batch) {
+                cost += (*it)->job->cost;
+                batch->remaining--;
+                it = queue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return cost;
+    }
+
+    // Next task for a slot: its own queue, then unassigned tasks, then the
+    // back of the busiest other slot's queue. Called with mutex_ held.
+    std::shared_ptr<Task> next(Slot& slot, std::unique_lock<std::mutex>& lock) {
+        while (true) {
+            std::shared_ptr<Task> task;
+            if (!slot.queue.empty()) {
+                task = slot.queue.front();
+                slot.queue.pop_front();
+                slot.queuedCost -= task->job->cost;
+                return task;
+            }
+            if (!unassigned_.empty()) {
+                task = unassigned_.front();
+                unassigned_.pop_front();
+                return task;
+            }
+            Slot* busiest = nullptr;
+            for (Slot* other : slots_) {
+                if (!other->queue.empty() && (!busiest || other->queuedCost > busiest->queuedCost)) {
+                    busiest = other;
+                }
+            }
+            if (busiest) {
+                task = busiest->queue.back();
+                busiest->queue.pop_back();
+                busiest->queuedCost -= task->job->cost;
+                metrics.count("process_video_worker_steals");
+                return task;
+            }
+            changed_.wait(lock);
+        }
+    }
+
+    void finish(const std::shared_ptr<Task>& task, bool ok, const std::string& worker, double seconds) {
+        EncodeJob& job = *task->job;
+        job.success = ok && getFileSize(job.outFile) > 0;
+        metrics.count("process_video_remote_tasks", metricLabel("result", job.success ? "ok" : "failed"));
+        task->batch->onDone(job, worker, seconds);
+        std::lock_guard<std::mutex> lock(mutex_);
+        task->batch->remaining--;
+        changed_.notify_all();
+    }
+
+    void serveSlot(int fd) {
+        LineSocket conn(fd);
+        Slot slot;
+        std::shared_ptr<Task> current;
+        Stopwatch started;
+        std::vector<std::string> fields;
+        std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+        while (conn.read(fields)) {
+            if (fields[0] == "PULL" && fields.size() >= 2 && !current) {
+                lock.lock();
+                if (slot.name.empty()) {
+                    slot.name = fields[1];
+                    slots_.push_back(&slot);
+                    metrics.gauge("process_video_workers_connected", static_cast<double>(slots_.size()));
+                    std::lock_guard<std::mutex> logLock(logMutex);
+                    std::cout << "Worker connected: " << slot.name << std::endl;
+                }
+                current = next(slot, lock);
+                lock.unlock();
+
+                const EncodeJob& job = *current->job;
+                started = Stopwatch();
+                job.progress->emit(JsonObject("rung_start").add("task", job.name()).add("rung", job.label)
+                                       .add("chunk", job.chunk).add("worker", slot.name));
+                if (!conn.write({"TASK", current->id, job.label, std::to_string(job.chunk),
+                                 std::to_string(job.chunkCount), absoluteFilePath(job.input),
+                                 absoluteFilePath(job.outFile), std::to_string(job.width), std::to_string(job.height),
+                                 job.keyframeArgs + job.videoArgs, job.audioFile.empty() ? "" : absoluteFilePath(job.audioFile),
+                                 std::to_string(job.duration), job.codec, std::to_string(job.bitrate), job.zones,
+                                 std::to_string(job.frameStep), job.toSdr})) {
+                    break;
+                }
+            } else if (fields[0] == "DONE" && fields.size() >= 3 && current && fields[1] == current->id) {
+                finish(current, fields[2] == "1", slot.name, started.seconds());
+                current.reset();
+            }
+        }
+        close(fd);
+
+        // Queued tasks return to the shared queue; the one in flight is
+        // retried elsewhere unless it has used up its attempts
+        lock.lock();
+        slots_.erase(std::remove(slots_.begin(), slots_.end(), &slot), slots_.end());
+        metrics.gauge("process_video_workers_connected", static_cast<double>(slots_.size()));
+        for (auto& task : slot.queue) {
+            unassigned_.push_back(task);
+        }
+        bool retry = current && ++current->attempts < 3;
+        if (retry) {
+            unassigned_.push_front(current);
+        }
+        changed_.notify_all();
+        lock.unlock();
+        if (!slot.name.empty()) {
+            std::lock_guard<std::mutex> logLock(logMutex);
+            std::cout << "Worker disconnected: " << slot.name
+                      << (current ? (retry ? ", requeued " : ", giving up on ") + current->job->name() : "") << std::endl;
+        }
+        if (current && !retry) {
+            finish(current, false, slot.name, started.seconds());
+        }
+    }
+
+    int listener_ = -1;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::vector<Slot*> slots_;
+    std::deque<std::shared_ptr<Task>> unassigned_;
+    unsigned long long nextId_ = 1;
+};
+
+// Set up by --coordinate; jobs hand their encode tasks to it when enabled.
+// Never destroyed, since slot threads wait on it until the process exits.
+WorkerPool& workerPool = *new WorkerPool;
+
+// Worker side of distributed encoding. Each slot connects to the
+// coordinator, pulls one task at a time, encodes it with this machine's
+// encoder backend and reports the result. --path-map rewrites coordinator
+// paths when the shared storage is mounted elsewhere here. A lost
+// connection is retried every few seconds.
+int runWorker(const ProcessOptions& options) {
+    signal(SIGPIPE, SIG_IGN);
+    std::string from;
+    std::string to;
+    size_t eq = options.pathMap.find('=');
+    if (eq != std::string::npos) {
+        from = options.pathMap.substr(0, eq);
+        to = options.pathMap.substr(eq + 1);
+    }
+    auto localPath = [&](const std::string& path) {
+        return !from.empty() && path.compare(0, from.size(), from) == 0 ? to + path.substr(from.size()) : path;
+    };
+
+    const HwBackend* hw = detectHwBackend(options.hwaccel);
+    HwSessionPool sessions(hw ? (options.hwSessions > 0 ? options.hwSessions : hw->maxSessions) : 0);
+    int slots = std::max(1, options.workerSlots);
+    int threads = std::max(1, resolveThreadBudget(options.threadBudget) / slots);
+    char host[256] = "worker";
+    gethostname(host, sizeof(host) - 1);
+    std::cout << "Worker " << host << ": " << slots << " slots of " << threads << " threads, coordinator "
+              << options.worker << (hw ? std::string(", ") + hw->name : "") << std::endl;
+
+    std::vector<std::thread> workers;
+    for (int s = 0; s < slots; s++) {
+        workers.emplace_back([&, s] {
+            std::string name = std::string(host) + ":" + std::to_string(getpid()) + "/" + std::to_string(s + 1);
+            while (true) {
+                int fd = connectTcp(options.worker);
+                if (fd >= 0) {
+                    LineSocket conn(fd);
+                    std::vector<std::string> fields;
+                    while (conn.write({"PULL", name}) && conn.read(fields) && fields[0] == "TASK" && fields.size() >= 17) {
+                        EncodeJob job;
+                        job.label = fields[2];
+                        job.chunk = std::atoi(fields[3].c_str());
+                        job.chunkCount = std::atoi(fields[4].c_str());
+                        job.input = localPath(fields[5]);
+                        job.outFile = localPath(fields[6]);
+                        job.width = std::atoi(fields[7].c_str());
+                        job.height = std::atoi(fields[8].c_str());
+                        job.videoArgs = fields[9];
+                        job.audioFile = fields[10].empty() ? "" : localPath(fields[10]);
+                        job.duration = std::atof(fields[11].c_str());
+                        job.codec = fields[12];
+                        job.bitrate = std::atoll(fields[13].c_str());
+                        job.zones = fields[14];
+                        job.frameStep = std::max(1, std::atoi(fields[15].c_str()));
+                        job.toSdr = fields[16];
+                        {
+                            std::lock_guard<std::mutex> lock(logMutex);
+                            std::cout << "Processing " << job.name() << " (" << threads << " threads)..." << std::endl;
+                        }
+                        bool ok = encodeRung(job.input, "", job, threads, hw, sessions);
+                        if (!conn.write({"DONE", fields[1], ok ? "1" : "0"})) {
+                            break;
+                        }
+                    }
+                    close(fd);
+                }
+                std::this_thread::sleep_for(std::chrono::seconds(3));
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return 0;
+}
+#endif
+
+// Manifest key of one chunk encode
+std::string chunkKey(const EncodeJob& task) {
+    return "chunk " + task.label + " " + std::to_string(task.chunk);
+}
+
+// Encode the ladder for one input. Returns true when every rung was produced.
+bool processVideo(const std::string& videoPath, const ProcessOptions& options, GrowingInput* growing) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    ProgressReporter& progress = options.progress ? *options.progress : progressStream;
     
-    int result = system(cmd.c_str());
-    if (result != 0) {
-        std::cerr << "Error: Failed to execute ffprobe. Is it installed and in your PATH?" << std::endl;
+    std::string stem = getFilenameStem(videoPath);
+    std::string folderName = outputFolder(stem, options);
+
+    // Create output folder. Until the job finishes it carries no .accessed
+    // marker, so quota enforcement leaves it alone.
+    if (!ensureParentDirectories(folderName + "/")) {
+        std::cerr << "Error: Failed to create directory '" << folderName << "'" << std::endl;
+        return false;
+    }
+    remove((folderName + "/.accessed").c_str());
+    // Probe the input once; every later stage reads from this
+    MediaInfo info;
+    Stopwatch stage;
+    bool probed;
+    if (growing) {
+        probed = growing->waitForHeader(info);
+    } else if (options.probe) {
+        info = *options.probe;
+        probed = true;
+    } else {
+        probed = probeMedia(videoPath, info);
+    }
+    metrics.observe("process_video_stage_seconds", metricLabel("stage", "probe"), stage.seconds());
+    if (!probed) {
+        metrics.count("process_video_failures", metricLabel("stage", "probe"));
+        std::cerr << "Could not determine input video height.\n";
+        progress.emit(JsonObject("error").add("stage", "probe").add("message", "Could not determine input video height"));
+        return false;
+    }
+    progress.emit(JsonObject("stage").add("stage", "probe").add("width", info.width).add("height", info.height)
+                      .add("fps", info.fps).add("duration", info.duration).add("video_codec", info.videoCodec)
+                      .add("audio_codec", info.audioCodec).add("hdr", info.hdr));
+
+    // While the input is still arriving ffmpeg reads it with the file
+    // protocol's follow mode, treating a stall of followIdleSeconds as EOF
+    bool following = growing && !growing->isComplete();
+    std::string sourceArgs = following ? " -follow 1 -rw_timeout " + std::to_string(options.followIdleSeconds * 1000000LL) : "";
+    if (following) {
+        std::cout << "Input is still arriving, encoding progressively" << std::endl;
+    }
+    int inputHeight = info.height;
+    
+    std::cout << "Input video resolution: " << inputHeight << "p" << std::endl;
+    std::cout << "Input: " << info.width << "x" << info.height << " " << info.videoCodec
+              << (info.audioCodec.empty() ? "" : " / " + info.audioCodec) << ", "
+              << std::fixed << std::setprecision(2) << info.fps << " fps, " << info.duration << " s"
+              << (info.hdr ? ", HDR" : "") << std::endl;
+    
+    // Materialize original video with height in filename. A growing input
+    // is only complete after the encodes have followed it to the end.
+    std::string originalOut = folderName + "/" + stem + " " + std::to_string(inputHeight) + ".mp4";
+    auto materializeOriginal = [&]() {
+        Stopwatch copyTimer;
+        std::string method = materializeFile(videoPath, originalOut, options.consumeInput);
+        metrics.observe("process_video_stage_seconds", metricLabel("stage", "original"), copyTimer.seconds());
+        metrics.count("process_video_materialize", metricLabel("method", method.empty() ? "failed" : method));
+        if (method.empty()) {
+            metrics.count("process_video_failures", metricLabel("stage", "original"));
+            std::cerr << "Error: Failed to copy original video to '" << originalOut << "'" << std::endl;
+            progress.emit(JsonObject("error").add("stage", "original").add("message", "Failed to copy original video"));
+        } else {
+            std::cout << "Original copied as: " << originalOut << " (" << method << ")" << std::endl;
+            progress.emit(JsonObject("stage").add("stage", "original").add("file", originalOut).add("method", method));
+        }
+        return method;
+    };
+
+    // Map the source once for the life of the job. If it fits in free
+    // memory it is prefetched into the page cache, so the hash and every
+    // ffmpeg process after it read the source from disk once between them.
+    MappedFile sourceMap;
+    if (!growing && sourceMap.open(videoPath)) {
+        if (sourceMap.size() < availableMemory() / 2) {
+            sourceMap.prefetch(0, sourceMap.size());
+        }
+    }
+
+    // The content hash keys both the output cache and the job manifest. A
+    // growing input is hashed once it is complete, so it cannot resume.
+    std::string contentHash;
+    if ((!options.cacheDir.empty() || options.resume) && !growing) {
+        contentHash = sourceMap.data() ? hashFileContents(sourceMap) : hashFileContents(videoPath);
+    }
+    JobManifest manifest;
+    if (options.resume && !contentHash.empty()) {
+        manifest.open(folderName + "/.manifest", outputKey(contentHash, options));
+    }
+
+    // Rungs are uploaded as soon as they finish, while later rungs encode;
+    // everything else follows when the job wraps up. Hidden working files
+    // stay local.
+    Offloader offloader(options.offloadCommand, options.offloadJobs,
+                        [&](const std::string& file, const std::string& key) { manifest.record("offload " + key, file); });
+    std::mutex offloadMutex;
+    std::set<std::string> offloaded;
+    auto offload = [&](const std::string& file) {
+        std::string relative = file.substr(folderName.size() + 1);
+        std::string key = stem + "/" + relative;
+        {
+            std::lock_guard<std::mutex> lock(offloadMutex);
+            if (!offloader.enabled() || !offloaded.insert(relative).second) {
+                return;
+            }
+        }
+        if (!manifest.isDone("offload " + key, file)) {
+            offloader.submit(file, key);
+        }
+    };
+    auto wrapUp = [&](bool complete) {
+        Stopwatch indexing;
+        if (writeOutputIndex(folderName, stem, std::to_string(inputHeight))) {
+            progress.emit(JsonObject("stage").add("stage", "index").add("file", folderName + "/index.json"));
+        }
+        metrics.observe("process_video_stage_seconds", metricLabel("stage", "index"), indexing.seconds());
+        std::vector<std::string> files;
+        listFiles(folderName, "", files);
+        for (const auto& relative : files) {
+            if (relative[0] != '.' && relative.find("/.") == std::string::npos) {
+                offload(folderName + "/" + relative);
+            }
+        }
+        bool uploaded = offloader.finish();
+        if (offloader.enabled() && uploaded && complete) {
+            std::ofstream(folderName + "/.offloaded").put('\n');
+        }
+        std::ofstream(folderName + "/.accessed").put('\n');
+    };
+
+    std::string copyMethod;
+    if (!growing) {
+        if (manifest.isDone("original", originalOut)) {
+            copyMethod = "resumed";
+            std::cout << "✓ Original already in place (resumed)" << std::endl;
+        } else {
+            copyMethod = materializeOriginal();
+            if (copyMethod.empty()) {
+                return false;
+            }
+            // Players seek the original with range requests too; its moov is
+            // moved up front before it is recorded, so a resumed run keeps it
+            bool moved = false;
+            if (!info.faststart && info.moovOffset >= 0) {
+                moved = relocateMoov(originalOut);
+                std::cout << (moved ? "✓ Original rewritten with moov first (faststart)"
+                                    : "✗ Original kept without faststart") << std::endl;
+                if (moved) {
+                    metrics.count("process_video_moov_relocations");
+                }
+            }
+            manifest.record("original", originalOut, moved ? "" : contentHash);
+        }
+    }
+
+    // A renamed upload no longer exists at its old path; encode from the original rung
+    const std::string source = copyMethod == "rename" ? originalOut : videoPath;
+
+    // Get subordinate qualities
+    std::vector<std::pair<std::string, int>> subordinateQualities = getSubordinateQualities(inputHeight, *options.profile);
+    
+    bool packaging = options.packageHls || options.packageDash;
+    if (subordinateQualities.empty()) {
+        std::cout << "No subordinate qualities to process for " << inputHeight << "p video." << std::endl;
+        if (!packaging) {
+            wrapUp(true);
+            return true;
+        }
+    } else {
+        std::cout << "Processing subordinate qualities: ";
+        for (const auto& q : subordinateQualities) {
+            std::cout << q.first << "p ";
+        }
+        std::cout << std::endl;
+    }
+
+    // An input already encoded with the same settings is linked from the
+    // cache instead of being encoded again. A growing input is hashed once
+    // it is complete, so it can only populate the cache.
+    std::string cacheEntry;
+    if (!options.cacheDir.empty() && !growing) {
+        Stopwatch lookup;
+        cacheEntry = cacheEntryFor(contentHash, options);
+        bool hit = !cacheEntry.empty() && restoreFromCache(cacheEntry, folderName, stem);
+        metrics.observe("process_video_stage_seconds", metricLabel("stage", "cache_lookup"), lookup.seconds());
+        metrics.count("process_video_cache", metricLabel("result", hit ? "hit" : "miss"));
+        if (hit) {
+            double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::high_resolution_clock::now() - start_time).count() / 1000.0;
+            std::cout << "✓ Cache hit: outputs linked from " << cacheEntry << std::endl;
+            std::cout << "\nProcessing complete. Files saved in folder: " << folderName << std::endl;
+            std::cout << "Total processing time: " << std::fixed << std::setprecision(2) << elapsed << " seconds" << std::endl;
+            int rungCount = static_cast<int>(subordinateQualities.size());
+            progress.emit(JsonObject("stage").add("stage", "cache").add("entry", cacheEntry));
+            progress.emit(JsonObject("job_done").add("folder", folderName).add("rungs", rungCount)
+                              .add("completed", rungCount).add("elapsed", elapsed).add("cached", true));
+            wrapUp(true);
+            return true;
+        }
+    }
+
+    // Trial encodes seek across the whole input, so a growing input keeps the full ladder
+    std::map<int, long long> maxrates;
+    if (options.perTitle && following) {
+        std::cout << "Per-title: input still arriving, keeping the full ladder" << std::endl;
+    } else if (options.perTitle && !subordinateQualities.empty()) {
+        Stopwatch analysis;
+        subordinateQualities = planPerTitleLadder(source, subordinateQualities, info.duration, folderName, maxrates);
+        metrics.observe("process_video_stage_seconds", metricLabel("stage", "per_title"), analysis.seconds());
+        progress.emit(JsonObject("stage").add("stage", "per_title").add("rungs", static_cast<int>(subordinateQualities.size())));
+    }
+
+    // Hardware decode does not compose with the CPU transpose inserted for
+    // rotated inputs, so those stay on the software path
+    const HwBackend* hw = detectHwBackend(options.hwaccel);
+    if (hw && info.rotation != 0) {
+        std::cout << "Rotated input, using software encoding instead of " << hw->name << std::endl;
+        hw = nullptr;
+    }
+
+    // Every rung is 8-bit SDR; only the original keeps a 10-bit or HDR
+    // source's format. The conversion runs on the CPU.
+    const std::string toSdr = sdrFilter(info);
+    if (info.hdr) {
+        std::cout << (hasZscale() ? "HDR input, tone-mapping the rungs to SDR (BT.709)"
+                                  : "HDR input, but ffmpeg lacks zscale: rungs are not tone-mapped") << std::endl;
+    }
+    if (hw && !toSdr.empty()) {
+        std::cout << info.bitDepth << "-bit input, using software encoding instead of " << hw->name << std::endl;
+        hw = nullptr;
+    }
+    HwSessionPool sessions(hw ? (options.hwSessions > 0 ? options.hwSessions : hw->maxSessions) : 0);
+    if (hw) {
+        std::cout << "Encoder backend: " << hw->name << " (" << hw->encoder << ")" << std::endl;
+    }
+
+    // One low-resolution first pass shared by every rung's rate control. A
+    // growing input cannot be analysed ahead of its encodes.
+    FirstPass firstPass;
+    std::string firstPassFile = folderName + "/.firstpass-0.log";
+    if (options.twoPass && following) {
+        std::cout << "Two-pass: input still arriving, using constant quality" << std::endl;
+    } else if (options.twoPass && !subordinateQualities.empty()) {
+        firstPass.fps = info.fps > 0.0 ? info.fps : 30.0;
+        firstPass.width = scaledWidth(info.displayWidth(), info.displayHeight(), FirstPass::analysisHeight);
+        Stopwatch analysis;
+        bool ok;
+        if (manifest.isDone("first pass", firstPassFile) && readFirstPassStats(firstPassFile, firstPass)) {
+            ok = true;
+            std::cout << "✓ First pass already complete (resumed)" << std::endl;
+        } else {
+            ok = runFirstPass(source, sourceArgs, firstPassFile, firstPass);
+            if (ok) {
+                manifest.record("first pass", firstPassFile);
+            }
+        }
+        metrics.observe("process_video_stage_seconds", metricLabel("stage", "first_pass"), analysis.seconds());
+        if (ok) {
+            std::cout << "✓ First pass: " << firstPass.frameBits.size() << " frames at " << FirstPass::analysisHeight
+                      << "p, " << static_cast<long long>(firstPass.bitrate() / 1000) << " kbps" << std::endl;
+            progress.emit(JsonObject("stage").add("stage", "first_pass")
+                              .add("frames", static_cast<long long>(firstPass.frameBits.size()))
+                              .add("bitrate", static_cast<long long>(firstPass.bitrate())));
+        } else {
+            metrics.count("process_video_failures", metricLabel("stage", "first_pass"));
+            std::cout << "✗ First pass failed, using constant quality" << std::endl;
+            firstPass.frameBits.clear();
+        }
+    }
+
+    // One job per rung and codec, all of the first codec's rungs first;
+    // explicit widths are needed by the device scalers and the cascade. The
+    // playable tier only needs the first codec.
+    bool explicitWidths = hw || options.cascade;
+    double aspect = static_cast<double>(info.displayWidth()) / info.displayHeight();
+    // Every encode of the job shares one memory ceiling; the group goes
+    // away however the job returns
+    struct JobGroup {
+        std::string path;
+        ~JobGroup() { cgroups.remove(path); }
+    } jobGroup{options.memoryMax > 0 ? cgroups.create(options.memoryMax) : ""};
+    std::vector<EncodeJob> jobs;
+    for (size_t c = 0; c < options.codecs.size() && !(options.partial && c > 0); c++) {
+        const VideoCodec* codec = findVideoCodec(options.codecs[c].first);
+        for (const auto& q : subordinateQualities) {
+            if ((options.maxRungHeight > 0 && q.second > options.maxRungHeight) || q.second < options.codecs[c].second) {
+                continue;
+            }
+            const LadderRung* rung = findLadderRung(*options.profile, q.second);
+            int fixedWidth = rung ? rung->width : 0;
+            EncodeJob job;
+            job.codec = codec->name;
+            job.label = q.first + (job.codec == "h264" ? "" : "-" + job.codec);
+            job.height = q.second;
+            job.width = fixedWidth > 0 ? fixedWidth
+                      : explicitWidths ? scaledWidth(info.displayWidth(), info.displayHeight(), q.second) : -2;
+            job.outFile = folderName + "/" + stem + " " + job.label + ".mp4";
+            job.cost = codec->costFactor * (fixedWidth > 0 ? fixedWidth : aspect * q.second) * q.second *
+                       (info.duration > 0 ? info.duration : 1.0);
+            job.duration = info.duration;
+            job.frames = info.duration * info.fps;
+            job.progress = &progress;
+            if (packaging) {
+                // Keyframes on the segment grid keep segments aligned across rungs
+                job.keyframeArgs = " -force_key_frames \"expr:gte(t,n_forced*" + std::to_string(options.segmentSeconds) + ")\"";
+            }
+            // A profile's cap applies to its rung; otherwise low rungs get --fps-cap
+            int fpsCap = rung && rung->maxFps > 0 ? rung->maxFps
+                       : q.second <= options.fpsCapHeight ? options.fpsCap : 0;
+            job.frameStep = fpsFrameStep(info.fps, fpsCap);
+            job.frames /= job.frameStep;
+            job.cost /= job.frameStep;
+            job.toSdr = toSdr;
+            job.cgroup = jobGroup.path;
+            if (info.hdr && hasZscale()) {
+                job.videoArgs += " -color_primaries bt709 -color_trc bt709 -colorspace bt709";
+            }
+            // A per-title trial measured this rung's rate directly; a profile
+            // bitrate comes next, and otherwise the first pass is scaled
+            auto maxrate = maxrates.find(q.second);
+            long long profileBitrate = rung && rung->bitrateKbps > 0 && maxrate == maxrates.end()
+                                     ? static_cast<long long>(rung->bitrateKbps * 1000.0 * codec->bitrateFactor) : 0;
+            if (!firstPass.frameBits.empty()) {
+                int width = fixedWidth > 0 ? fixedWidth : scaledWidth(info.displayWidth(), info.displayHeight(), q.second);
+                job.bitrate = maxrate != maxrates.end() ? static_cast<long long>(maxrate->second / maxrateHeadroom * codec->bitrateFactor)
+                            : profileBitrate > 0 ? profileBitrate : firstPassTarget(firstPass, width, q.second, *codec);
+                job.zones = firstPassZones(firstPass, 0.0, info.duration, job.frameStep);
+            } else if (maxrate != maxrates.end()) {
+                long long kbps = std::max(1LL, static_cast<long long>(maxrate->second * codec->bitrateFactor / 1000));
+                job.videoArgs += " -maxrate " + std::to_string(kbps) + "k -bufsize " + std::to_string(2 * kbps) + "k";
+            } else {
+                job.bitrate = profileBitrate;
+            }
+            jobs.push_back(job);
+        }
+    }
+
+    // Quality scores an earlier run recorded stay valid for its resumed
+    // rungs, and a rung its quality stage dropped is not encoded again
+    std::string qualityFile = folderName + "/.quality";
+    std::map<std::string, RungQuality> qualityScores;
+    if (options.qualityMetrics.empty() && options.qualityFloorMetric.empty()) {
+        remove(qualityFile.c_str());
+    } else if (manifest.isDone("quality", qualityFile)) {
+        qualityScores = readQualityScores(qualityFile);
+        for (auto it = jobs.begin(); it != jobs.end();) {
+            auto found = qualityScores.find(it->label);
+            if (found != qualityScores.end() && found->second.dropped) {
+                std::cout << "✓ " << it->name() << " dropped by an earlier run's quality stage (resumed)" << std::endl;
+                it = jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    std::string rungList;
+    for (const auto& job : jobs) {
+        rungList += (rungList.empty() ? "\"" : ",\"") + job.label + "\"";
+    }
+    progress.emit(JsonObject("job_start").add("input", videoPath).add("folder", folderName)
+                      .add("profile", options.profile->name).addRaw("rungs", "[" + rungList + "]"));
+
+    // Rungs an earlier run finished are set aside and rejoin for packaging
+    std::vector<EncodeJob> resumedJobs;
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        if (manifest.isDone("rung " + it->label, it->outFile)) {
+            std::cout << "✓ " << it->label << "p already complete (resumed)" << std::endl;
+            progress.emit(JsonObject("rung_done").add("task", it->name()).add("rung", it->label)
+                              .add("chunk", it->chunk).add("ok", true).add("resumed", true));
+            it->success = true;
+            resumedJobs.push_back(*it);
+            it = jobs.erase(it);
+        } else {
+            qualityScores.erase(it->label);  // Encoded again, so scored again
+            ++it;
+        }
+    }
+
+    // Previews are cut from frames of a ladder decode. A set finished by an
+    // earlier run is kept.
+    PreviewPlan previewPlan;
+    const PreviewPlan* previews = nullptr;
+    bool previewsTapped = false;
+    bool previewsOk = true;
+    if (options.previews && following) {
+        std::cout << "Previews skipped while the input is still arriving" << std::endl;
+    } else if (options.previews && !planPreviews(folderName, info, options.spriteInterval, previewPlan)) {
+        std::cout << "Previews skipped: input duration unknown" << std::endl;
+    } else if (options.previews && manifest.isDone("preview poster", previewPlan.poster()) &&
+               manifest.isDone("preview sprite", previewPlan.sprite())) {
+        std::cout << "✓ Previews already complete (resumed)" << std::endl;
+    } else if (options.previews) {
+        previews = &previewPlan;
+        remove(previewPlan.poster().c_str());
+        remove(previewPlan.sprite().c_str());
+    }
+
+    // Audio is extracted or transcoded once and muxed into every rung. A
+    // following input is not complete yet, so its rungs copy the source audio.
+    std::string audioFile;
+    std::string audioCodec = sharedAudioCodec(info, options);
+    if (!info.audioCodec.empty() && !following && (!jobs.empty() || packaging)) {
+        audioFile = folderName + "/.audio.mp4";
+        if (manifest.isDone("audio", audioFile)) {
+            std::cout << "✓ Audio already prepared (resumed)" << std::endl;
+        } else {
+            Stopwatch audioTimer;
+            bool ok = prepareAudio(source, info, options, audioFile);
+            metrics.observe("process_video_stage_seconds", metricLabel("stage", "audio"), audioTimer.seconds());
+            if (ok) {
+                manifest.record("audio", audioFile);
+                std::cout << "✓ Audio prepared once for all rungs (" << audioCodec
+                          << (options.loudnorm ? ", loudness-normalized" : "") << ")" << std::endl;
+                progress.emit(JsonObject("stage").add("stage", "audio").add("codec", audioCodec)
+                                  .add("loudnorm", options.loudnorm));
+            } else {
+                metrics.count("process_video_failures", metricLabel("stage", "audio"));
+                std::cout << "✗ Audio stage failed, rungs copy the source audio" << std::endl;
+                audioFile.clear();
+            }
+        }
+        for (auto& job : jobs) {
+            job.audioFile = audioFile;
+        }
+    }
+
+    // A source needing SDR conversion would otherwise be converted again by
+    // every rung's own ffmpeg; run serial ladders through the shared graph
+    // so it is converted once. Parallel, chunked and remote rungs keep
+    // their own processes and convert per rung.
+#ifndef _WIN32
+    bool remoteLadder = workerPool.enabled() && !following;
+#else
+    bool remoteLadder = false;
+#endif
+    bool shareSdr = !toSdr.empty() && !options.parallel && options.chunks <= 1 && !remoteLadder;
+    if (shareSdr && !options.singleDecode && !options.cascade && !jobs.empty()) {
+        std::cout << "SDR conversion shared: encoding the ladder from one decode" << std::endl;
+    }
+
+    if (jobs.empty()) {
+        // Nothing to encode; only the original is packaged
+    } else if (options.singleDecode || options.cascade || shareSdr) {
+        // Decode once, encode every rung from the shared filter graph
+        std::vector<int> heights;
+        std::vector<int> widths;
+        std::vector<int> frameSteps;
+        std::vector<std::string> outFiles;
+        for (const auto& job : jobs) {
+            heights.push_back(job.height);
+            widths.push_back(job.width);
+            frameSteps.push_back(job.frameStep);
+            outFiles.push_back(job.outFile);
+        }
+
+        // The cascade is planned over one rung per height; further codecs of
+        // a height branch off that rung's scaled frames
+        std::vector<size_t> firstOfHeight;
+        std::vector<int> parents(jobs.size(), -1);
+        for (size_t i = 0; i < jobs.size(); i++) {
+            for (size_t f : firstOfHeight) {
+                parents[i] = jobs[f].height == jobs[i].height ? static_cast<int>(f) : parents[i];
+            }
+            if (parents[i] < 0) {
+                firstOfHeight.push_back(i);
+            }
+        }
+        if (options.cascade && following) {
+            // Sampling the middle of the input would stall until it arrives
+            std::cout << "Cascade: input still arriving, scaling every rung from source" << std::endl;
+        } else if (options.cascade) {
+            Stopwatch planning;
+            std::vector<int> firstHeights;
+            for (size_t f : firstOfHeight) {
+                firstHeights.push_back(jobs[f].height);
+            }
+            std::vector<int> plan = planCascade(source, firstHeights, info.displayWidth(), info.displayHeight(),
+                                                info.duration, options.ssimTolerance, folderName);
+            for (size_t k = 0; k < firstOfHeight.size(); k++) {
+                parents[firstOfHeight[k]] = plan[k] < 0 ? -1 : static_cast<int>(firstOfHeight[plan[k]]);
+            }
+            metrics.observe("process_video_stage_seconds", metricLabel("stage", "cascade_plan"), planning.seconds());
+        }
+        // A rung can only drop frames its parent kept
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (parents[i] >= 0 && frameSteps[i] % frameSteps[parents[i]] != 0) {
+                parents[i] = -1;
+            }
+        }
+
+        // Frames no rung keeps are dropped first, and the SDR conversion
+        // runs once, at the top rung's size; every rung scales from its output
+        int sharedStep = 0;
+        for (int step : frameSteps) {
+            sharedStep = std::gcd(sharedStep, step);
+        }
+        for (int& step : frameSteps) {
+            step /= sharedStep;
+        }
+        std::string sourceFilter = sharedStep > 1 ? "framestep=" + std::to_string(sharedStep) : "";
+        if (!toSdr.empty()) {
+            sourceFilter += (sourceFilter.empty() ? "" : ",") + std::string("scale=") + std::to_string(widths[0]) + ":" +
+                            std::to_string(heights[0]) + "," + toSdr;
+        }
+
+        // The highest rungs take the device sessions; the rest download
+        // their frames and encode on libx264
+        auto buildCommand = [&](const HwBackend* backend) {
+            std::vector<std::string> suffixes(jobs.size());
+            std::vector<std::string> encoderArgs(jobs.size());
+            size_t deviceRungs = backend ? static_cast<size_t>(options.hwSessions > 0 ? options.hwSessions : backend->maxSessions) : 0;
+            for (size_t i = 0; i < jobs.size(); i++) {
+                if (backend && jobs[i].codec == "h264" && deviceRungs > 0) {
+                    encoderArgs[i] = std::string(" -c:v ") + backend->encoder + rateControlArgs(jobs[i], false);
+                    deviceRungs--;
+                } else if (backend) {
+                    suffixes[i] = backend->downloadFilter;
+                    encoderArgs[i] = codecEncoderArgs(jobs[i].codec, true, rateControlArgs(jobs[i], true));
+                } else {
+                    encoderArgs[i] = codecEncoderArgs(jobs[i].codec, false, rateControlArgs(jobs[i], true));
+                }
+                encoderArgs[i] += jobs[i].keyframeArgs + jobs[i].videoArgs;
+            }
+            std::string scaler = backend && backend->scaleFilter[0] ? backend->scaleFilter : "scale";
+            std::string inputArgs = (backend ? std::string(" ") + backend->inputArgs : "") + sourceArgs;
+            std::string tap = previews ? buildPreviewGraph(*previews, "[pv]", scaler, backend ? backend->downloadFilter : "") : "";
+            std::string graph = buildLadderGraph(heights, widths, parents, scaler, suffixes, frameSteps, sourceFilter, tap);
+            return buildSingleDecodeCommand(source, inputArgs, graph, outFiles, encoderArgs, options.threadBudget,
+                                            audioFile, previews ? previewOutputArgs(*previews) : "");
+        };
+        previewsTapped = previews != nullptr;
+
+        std::vector<const EncodeJob*> targets;
+        for (const auto& job : jobs) {
+            std::cout << "Processing " << job.name() << "..." << std::endl;
+            progress.plan(job.name(), job.cost);
+            progress.emit(JsonObject("rung_start").add("task", job.name()).add("rung", job.label).add("chunk", job.chunk));
+            targets.push_back(&job);
+        }
+        Stopwatch encode;
+        std::string cmd = buildCommand(hw);
+        int result = runFfmpeg(cmd, targets);
+        if (result != 0 && hw) {
+            std::cout << "  " << hw->name << " ladder encode failed, retrying with libx264" << std::endl;
+            cmd = buildCommand(nullptr);
+            result = runFfmpeg(cmd, targets);
+        }
+
+        double encodeSeconds = encode.seconds();
+        for (size_t i = 0; i < jobs.size(); i++) {
+            jobs[i].success = result == 0 && getFileSize(outFiles[i]) > 0;
+            recordRungMetrics(jobs[i], encodeSeconds, jobs[i].success);
+            progress.emit(JsonObject("rung_done").add("task", jobs[i].name()).add("rung", jobs[i].label)
+                              .add("chunk", jobs[i].chunk).add("ok", jobs[i].success).add("bytes", getFileSize(outFiles[i])));
+            if (jobs[i].success) {
+                std::cout << "✓ " << jobs[i].name() << " completed" << std::endl;
+                manifest.record("rung " + jobs[i].label, outFiles[i]);
+                offload(outFiles[i]);
+            } else {
+                std::cout << "✗ " << jobs[i].name() << " failed" << std::endl;
+                std::cerr << "✗ " << jobs[i].name() << " failed. Command was: " << cmd << std::endl;
+            }
+        }
+    } else {
+        // Long rungs can be split on keyframes and their chunks encoded concurrently
+        std::string chunkDir = folderName + "/.chunks";
+        std::vector<SourceChunk> chunks;
+        if (options.chunks > 1 && following) {
+            std::cout << "Chunking skipped while the input is still arriving" << std::endl;
+        } else if (options.chunks > 1 && info.duration > 0.0 && ensureDirectory(chunkDir)) {
+            Stopwatch split;
+            chunks = splitSource(source, chunkDir, info.duration, options.chunks);
+            metrics.observe("process_video_stage_seconds", metricLabel("stage", "split"), split.seconds());
+            std::cout << "Split source into " << chunks.size() << " keyframe-aligned chunks" << std::endl;
+        }
+
+        // Expand rungs into tasks: whole rungs, or one task per (rung, chunk)
+        std::vector<EncodeJob> tasks;
+        std::vector<std::vector<size_t>> rungTasks(jobs.size());
+        for (size_t r = 0; r < jobs.size(); r++) {
+            const EncodeJob& job = jobs[r];
+            if (chunks.size() < 2 || job.height < options.chunkMinHeight) {
+                rungTasks[r].push_back(tasks.size());
+                tasks.push_back(job);
+                continue;
+            }
+            for (size_t c = 0; c < chunks.size(); c++) {
+                EncodeJob task = job;
+                task.input = chunks[c].file;
+                task.chunk = static_cast<int>(c);
+                task.chunkCount = static_cast<int>(chunks.size());
+                task.audioFile.clear();  // Chunks are video-only; audio joins at concat
+                task.outFile = chunkDir + "/" + job.label + "_" + std::to_string(c) + ".mp4";
+                task.cost = job.cost * (info.duration > 0.0 ? chunks[c].duration / info.duration : 1.0);
+                task.duration = chunks[c].duration;
+                task.frames = job.duration > 0.0 ? job.frames * chunks[c].duration / job.duration : job.frames;
+                if (packaging) {
+                    task.keyframeArgs = " -force_key_frames " + chunkKeyframeTimes(chunks[c], options.segmentSeconds);
+                }
+                if (task.bitrate > 0) {
+                    task.zones = firstPassZones(firstPass, chunks[c].start, chunks[c].duration, task.frameStep);
+                }
+                // Chunk encodes survive until their rung is stitched
+                task.success = manifest.isDone(chunkKey(task), task.outFile);
+                rungTasks[r].push_back(tasks.size());
+                tasks.push_back(task);
+            }
+        }
+
+        // Remote workers read the source from the shared output folder, so
+        // an input still being written is encoded here
+#ifndef _WIN32
+        bool remote = workerPool.enabled() && !following;
+#else
+        bool remote = false;
+#endif
+
+        for (auto& task : tasks) {
+            progress.plan(task.name(), task.cost);
+            // The first whole-rung encode also feeds the previews
+            if (previews && !previewsTapped && task.chunk < 0 && !remote) {
+                task.previews = previews;
+                previewsTapped = true;
+            }
+        }
+
+        // How long each task sat behind others once encoding began
+        Stopwatch encodePhase;
+        auto recordWait = [&](const EncodeJob& task) {
+            metrics.observe("process_video_rung_wait_seconds", metricLabel("rung", task.label), encodePhase.seconds());
+        };
+
+        // Encode one task and checkpoint it; resumed chunks are already done
+        auto runTask = [&](EncodeJob& task, int threads) {
+            if (task.success) {
+                std::lock_guard<std::mutex> lock(logMutex);
+                std::cout << "✓ " << task.name() << " already complete (resumed)" << std::endl;
+                return true;
+            }
+            if (options.preempt && options.preempt->load()) {
+                return false;  // Yield at this boundary; the resumed run encodes it
+            }
+            recordWait(task);
+            bool ok = encodeRung(source, sourceArgs, task, threads, hw, sessions);
+            if (ok) {
+                manifest.record(task.chunk < 0 ? "rung " + task.label : chunkKey(task), task.outFile);
+                if (task.chunk < 0) {
+                    offload(task.outFile);
+                }
+            }
+            return ok;
+        };
+
+        if (remote) {
+#ifndef _WIN32
+            // Hand every unfinished task to the worker pool; stitching and
+            // packaging stay here
+            std::vector<EncodeJob*> pending;
+            for (auto& task : tasks) {
+                if (task.success) {
+                    std::cout << "✓ " << task.name() << " already complete (resumed)" << std::endl;
+                    continue;
+                }
+                if (task.input.empty()) {
+                    task.input = originalOut;
+                }
+                pending.push_back(&task);
+            }
+            std::cout << "Dispatching " << pending.size() << " tasks to remote workers" << std::endl;
+            workerPool.run(pending, options.preempt, [&](EncodeJob& task, const std::string& worker, double seconds) {
+                recordWait(task);
+                recordRungMetrics(task, seconds, task.success);
+                progress.emit(JsonObject("rung_done").add("task", task.name()).add("rung", task.label)
+                                  .add("chunk", task.chunk).add("ok", task.success).add("worker", worker)
+                                  .add("bytes", getFileSize(task.outFile))
+                                  .add("job_percent", progress.update(task.name(), 1.0)));
+                if (task.success) {
+                    manifest.record(task.chunk < 0 ? "rung " + task.label : chunkKey(task), task.outFile);
+                    if (task.chunk < 0) {
+                        offload(task.outFile);
+                    }
+                }
+                std::lock_guard<std::mutex> lock(logMutex);
+                std::cout << (task.success ? "✓ " : "✗ ") << task.name() << (task.success ? " completed" : " failed")
+                          << " on " << worker << std::endl;
+            });
+#endif
+        } else if (options.parallel || !chunks.empty()) {
+            // Weight each task by pixels * duration and run them through the
+            // scheduler, one pool per codec
+            int threadBudget = resolveThreadBudget(options.threadBudget);
+            std::map<std::string, int> pools = codecThreadBudgets(tasks, options, threadBudget);
+            for (const auto& pool : pools) {
+                assignThreads(tasks, pool.second, pool.first);
+            }
+
+            std::cout << "Running rungs in parallel with a budget of " << threadBudget << " encoder threads" << std::endl;
+            if (pools.size() > 1) {
+                for (const auto& pool : pools) {
+                    std::cout << "  " << pool.first << " pool: " << pool.second << " threads" << std::endl;
+                }
+            }
+            runCodecPools(tasks, pools, [&](EncodeJob& task) {
+                {
+                    std::lock_guard<std::mutex> lock(logMutex);
+                    std::cout << "Processing " << task.name() << " (" << task.threads << " threads)..." << std::endl;
+                }
+                return runTask(task, task.threads);
+            });
+        } else {
+            // Process each subordinate quality
+            for (auto& task : tasks) {
+                std::cout << "Processing " << task.name() << "..." << std::endl;
+                task.success = runTask(task, options.threadBudget);
+            }
+        }
+
+        // Stitch chunked rungs back together
+        Stopwatch concat;
+        for (size_t r = 0; r < jobs.size(); r++) {
+            if (rungTasks[r].size() == 1) {
+                jobs[r].success = tasks[rungTasks[r][0]].success;
+                continue;
+            }
+            bool allChunks = true;
+            std::vector<std::string> chunkFiles;
+            for (size_t t : rungTasks[r]) {
+                allChunks = allChunks && tasks[t].success;
+                chunkFiles.push_back(tasks[t].outFile);
+            }
+            if (!allChunks && options.preempt && options.preempt->load()) {
+                continue;  // Unfinished because of preemption; the finished chunks are kept
+            }
+            jobs[r].success = allChunks && concatChunks(chunkFiles, audioFile.empty() ? source : audioFile,
+                                                        chunkDir + "/" + jobs[r].label + ".txt",
+                                                        jobs[r].outFile);
+            std::cout << (jobs[r].success ? "✓ " : "✗ ") << jobs[r].name() << " "
+                      << (jobs[r].success ? "completed" : "failed") << " (" << chunkFiles.size() << " chunks)" << std::endl;
+            if (!jobs[r].success) {
+                continue;  // Keep finished chunks for a resumed run
+            }
+            manifest.record("rung " + jobs[r].label, jobs[r].outFile);
+            offload(jobs[r].outFile);
+            for (const auto& file : chunkFiles) {
+                remove(file.c_str());
+            }
+        }
+
+        if (!chunks.empty()) {
+            metrics.observe("process_video_stage_seconds", metricLabel("stage", "concat"), concat.seconds());
+            for (const auto& chunk : chunks) {
+                remove(chunk.file.c_str());
+            }
+            rmdir(chunkDir.c_str());
+        }
+    }
+
+    // A preempted run stops at the boundary it reached and a partial run
+    // after its rungs; the next run of the job resumes from the manifest and
+    // does the rest, packaging included
+    bool preempted = options.preempt && options.preempt->load();
+    if (preempted || options.partial) {
+        int done = 0;
+        std::string doneList;
+        for (const auto& job : jobs) {
+            done += job.success ? 1 : 0;
+            doneList += job.success ? (doneList.empty() ? "\"" : ",\"") + job.label + "\"" : "";
+        }
+        for (const auto& job : resumedJobs) {
+            doneList += (doneList.empty() ? "\"" : ",\"") + job.label + "\"";
+        }
+        std::cout << (preempted ? "Preempted" : "Playable tier done") << ": " << done << " of " << jobs.size()
+                  << " rungs encoded in this run" << std::endl;
+        progress.emit(JsonObject("stage").add("stage", preempted ? "preempted" : "playable").add("folder", folderName)
+                          .addRaw("rungs", "[" + doneList + "]"));
+        return !preempted && done == static_cast<int>(jobs.size());
+    }
+
+    if (previews) {
+        // Chunked or resumed ladders leave no decode to tap
+        bool ok = previewsTapped && getFileSize(previews->poster()) > 0 && getFileSize(previews->sprite()) > 0;
+        if (!ok) {
+            std::cout << (previewsTapped ? "Preview tap failed, " : "No ladder decode to tap, ")
+                      << "cutting previews from keyframes" << std::endl;
+            Stopwatch previewTimer;
+            ok = generatePreviews(source, *previews);
+            metrics.observe("process_video_stage_seconds", metricLabel("stage", "previews"), previewTimer.seconds());
+        }
+        ok = ok && getFileSize(previews->poster()) > 0 && getFileSize(previews->sprite()) > 0 &&
+             writeThumbnailTrack(*previews);
+        if (ok) {
+            manifest.record("preview poster", previews->poster());
+            manifest.record("preview sprite", previews->sprite());
+            std::cout << "✓ Previews: poster, " << previews->count << "-tile sprite and thumbnail track in "
+                      << previews->dir << std::endl;
+            progress.emit(JsonObject("stage").add("stage", "previews").add("poster", previews->poster())
+                              .add("sprite", previews->sprite()).add("track", previews->track())
+                              .add("tiles", previews->count));
+        } else {
+            previewsOk = false;
+            metrics.count("process_video_failures", metricLabel("stage", "previews"));
+            std::cout << "✗ Previews failed" << std::endl;
+            progress.emit(JsonObject("error").add("stage", "previews").add("message", "Failed to cut previews"));
+        }
+    }
+
+    // Resumed rungs rejoin in ladder order, highest first
+    jobs.insert(jobs.end(), resumedJobs.begin(), resumedJobs.end());
+    std::sort(jobs.begin(), jobs.end(), [](const EncodeJob& a, const EncodeJob& b) {
+        return a.height != b.height ? a.height > b.height : a.label < b.label;
+    });
+
+    if (growing) {
+        growing->waitForComplete();
+        remove(growing->doneMarker().c_str());
+        if (materializeOriginal().empty()) {
+            return false;
+        }
+    }
+
+    // Quality stage: finished rungs are scored on sampled windows. A rung
+    // under the floor is re-encoded once with more bits, and with per-title
+    // a rung no better than the rung below it in its codec is dropped.
+    std::vector<std::string> qualityMetrics = options.qualityMetrics;
+    if (!options.qualityFloorMetric.empty() &&
+        std::find(qualityMetrics.begin(), qualityMetrics.end(), options.qualityFloorMetric) == qualityMetrics.end()) {
+        qualityMetrics.push_back(options.qualityFloorMetric);
+    }
+    auto vmaf = std::find(qualityMetrics.begin(), qualityMetrics.end(), "vmaf");
+    if (vmaf != qualityMetrics.end() && !hasFfmpegFilter("libvmaf")) {
+        std::cout << "Quality: ffmpeg lacks libvmaf, VMAF is not measured" << std::endl;
+        qualityMetrics.erase(vmaf);
+    }
+    if (!qualityMetrics.empty() && !jobs.empty()) {
+        Stopwatch scoring;
+        auto score = [&](const std::vector<EncodeJob*>& rungs) {
+            std::vector<const EncodeJob*> targets(rungs.begin(), rungs.end());
+            std::vector<RungQuality> measured;
+            if (targets.empty()) {
+                return true;
+            }
+            if (!measureRungQuality(source, info, targets, qualityMetrics, folderName, measured)) {
+                metrics.count("process_video_failures", metricLabel("stage", "quality"));
+                std::cout << "✗ Quality measurement failed, rungs kept as encoded" << std::endl;
+                return false;
+            }
+            for (size_t i = 0; i < targets.size(); i++) {
+                measured[i].retuned = qualityScores[targets[i]->label].retuned;
+                qualityScores[targets[i]->label] = measured[i];
+            }
+            return true;
+        };
+        std::vector<EncodeJob*> unscored;
+        for (auto& job : jobs) {
+            if (job.success && qualityScores.find(job.label) == qualityScores.end()) {
+                unscored.push_back(&job);
+            }
+        }
+        bool scored = score(unscored);
+
+        // The floor's metric decides, otherwise the first measured of VMAF, SSIM and PSNR
+        std::string decisive = options.qualityFloorMetric;
+        for (const char* metric : {"vmaf", "ssim", "psnr"}) {
+            bool measured = std::find(qualityMetrics.begin(), qualityMetrics.end(), metric) != qualityMetrics.end();
+            decisive = decisive.empty() && measured ? metric : decisive;
+        }
+        bool floorMeasured = std::find(qualityMetrics.begin(), qualityMetrics.end(), options.qualityFloorMetric) !=
+                             qualityMetrics.end();
+
+        // The re-encode goes aside and replaces the rung only if it succeeds.
+        // It gets half again the bits the rung took or was targeted at.
+        for (auto& job : jobs) {
+            auto found = qualityScores.find(job.label);
+            if (!scored || !floorMeasured || !job.success || found == qualityScores.end() || found->second.retuned) {
+                continue;
+            }
+            double value = found->second.score(decisive);
+            if (value < 0.0 || value >= options.qualityFloor) {
+                continue;
+            }
+            long long used = job.duration > 0.0 ? static_cast<long long>(getFileSize(job.outFile) * 8 / job.duration) : 0;
+            EncodeJob retune = job;
+            retune.bitrate = std::max(job.bitrate, used) * 3 / 2;
+            retune.outFile = folderName + "/.retune_" + job.label + ".mp4";
+            std::cout << "  " << job.name() << ": " << decisive << " " << value << " under the floor of "
+                      << options.qualityFloor << ", re-encoding at " << retune.bitrate / 1000 << " kbps" << std::endl;
+            if (retune.bitrate <= 0 || !encodeRung(source, "", retune, options.threadBudget, nullptr, sessions) ||
+                remove(job.outFile.c_str()) != 0 || rename(retune.outFile.c_str(), job.outFile.c_str()) != 0) {
+                remove(retune.outFile.c_str());
+                std::cout << "✗ " << job.name() << " re-encode failed, rung kept as encoded" << std::endl;
+                continue;
+            }
+            job.bitrate = retune.bitrate;
+            found->second.retuned = true;
+            metrics.count("process_video_quality_actions", metricLabel("action", "retuned"));
+            manifest.record("rung " + job.label, job.outFile);
+            {
+                std::lock_guard<std::mutex> lock(offloadMutex);
+                offloaded.erase(job.outFile.substr(folderName.size() + 1));
+            }
+            offload(job.outFile);
+            score({&job});
+        }
+
+        // jobs run highest first, so each codec's ladder is walked bottom up
+        std::vector<std::string> dropped;
+        if (scored && options.perTitle) {
+            std::map<std::string, double> keptBelow;
+            for (size_t i = jobs.size(); i-- > 0;) {
+                auto found = qualityScores.find(jobs[i].label);
+                double value = found == qualityScores.end() || !jobs[i].success ? -1.0 : found->second.score(decisive);
+                if (value < 0.0) {
+                    continue;
+                }
+                auto below = keptBelow.find(jobs[i].codec);
+                if (below == keptBelow.end() || value >= below->second + qualityMargin(decisive)) {
+                    keptBelow[jobs[i].codec] = value;
+                    continue;
+                }
+                std::cout << "  Per-title " << jobs[i].name() << ": " << decisive << " " << value
+                          << ", no better than the rung below (dropped)" << std::endl;
+                found->second.dropped = true;
+                remove(jobs[i].outFile.c_str());
+                metrics.count("process_video_quality_actions", metricLabel("action", "dropped"));
+                dropped.push_back(jobs[i].label);
+                jobs.erase(jobs.begin() + i);
+            }
+        }
+
+        for (const auto& entry : qualityScores) {
+            const RungQuality& q = entry.second;
+            JsonObject event("rung_quality");
+            event.add("rung", entry.first);
+            progress.emit(q.addScores(event).add("dropped", q.dropped));
+            if (!q.dropped) {
+                std::ostringstream line;
+                line << std::fixed << std::setprecision(4) << "✓ " << entry.first << " quality:";
+                if (q.ssim >= 0.0) {
+                    line << " SSIM " << q.ssim;
+                }
+                line << std::setprecision(2);
+                if (q.psnr >= 0.0) {
+                    line << " PSNR " << q.psnr << " dB";
+                }
+                if (q.vmaf >= 0.0) {
+                    line << " VMAF " << q.vmaf;
+                }
+                std::cout << line.str() << (q.retuned ? " (retuned)" : "") << std::endl;
+            }
+        }
+        if (scored && writeQualityScores(qualityFile, qualityScores)) {
+            manifest.record("quality", qualityFile);
+        }
+        metrics.observe("process_video_stage_seconds", metricLabel("stage", "quality"), scoring.seconds());
+        progress.emit(JsonObject("stage").add("stage", "quality").add("metric", decisive)
+                          .add("dropped", static_cast<int>(dropped.size())));
+    }
+
+    // The original is a stream copy whose keyframes follow the upload's own
+    // GOP rather than the segment grid, so only encoded rungs are variants
+    std::vector<PackagedRung> rungs;
+    for (const auto& job : jobs) {
+        if (packaging && job.success) {
+            rungs.push_back({job.label, job.outFile, job.codec});
+        }
+    }
+    if (!rungs.empty()) {
+        Stopwatch packageTimer;
+        packageLadder(rungs, folderName, options, audioFile, audioCodec, !info.audioCodec.empty());
+        metrics.observe("process_video_stage_seconds", metricLabel("stage", "package"), packageTimer.seconds());
+        progress.emit(JsonObject("stage").add("stage", "package"));
+    }
+
+    int completed = 0;
+    for (const auto& job : jobs) {
+        completed += job.success ? 1 : 0;
+        metrics.count("process_video_output_bytes", "", static_cast<double>(std::max(0LL, getFileSize(job.outFile))));
+    }
+    metrics.count("process_video_input_bytes", "", static_cast<double>(std::max(0LL, getFileSize(originalOut))));
+    if (completed == static_cast<int>(jobs.size())) {
+        // Kept after a failure so a resumed run reuses them
+        if (!audioFile.empty()) {
+            remove(audioFile.c_str());
+        }
+        remove(firstPassFile.c_str());
+    }
+
+    if (!options.cacheDir.empty() && completed == static_cast<int>(jobs.size()) && previewsOk) {
+        if (cacheEntry.empty()) {
+            cacheEntry = cacheEntryFor(hashFileContents(originalOut), options);
+        }
+        std::vector<std::pair<std::string, std::string>> cached;
+        for (const auto& job : jobs) {
+            cached.push_back({job.outFile, job.label + ".mp4"});
+        }
+        std::vector<std::string> packaged;
+        if (options.packageHls) {
+            listFiles(folderName + "/hls", "hls/", packaged);
+        }
+        if (options.packageDash) {
+            listFiles(folderName + "/dash", "dash/", packaged);
+        }
+        if (options.previews) {
+            listFiles(folderName + "/previews", "previews/", packaged);
+        }
+        for (const auto& relative : packaged) {
+            cached.push_back({folderName + "/" + relative, relative});
+        }
+        if (!cacheEntry.empty() && !cached.empty()) {
+            Stopwatch store;
+            storeInCache(cacheEntry, cached);
+            metrics.observe("process_video_stage_seconds", metricLabel("stage", "cache_store"), store.seconds());
+        }
+    }
+
+    Stopwatch offloadTimer;
+    wrapUp(completed == static_cast<int>(jobs.size()));
+    if (offloader.enabled()) {
+        metrics.observe("process_video_stage_seconds", metricLabel("stage", "offload"), offloadTimer.seconds());
+    }
+
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+    double total_time = duration.count() / 1000.0;
+
+    std::cout << "\nProcessing complete. Files saved in folder: " << folderName << std::endl;
+    std::cout << "Total processing time: " << std::fixed << std::setprecision(2) << total_time << " seconds" << std::endl;
+
+    progress.emit(JsonObject("job_done").add("folder", folderName).add("rungs", static_cast<int>(jobs.size()))
+                      .add("completed", completed).add("elapsed", total_time));
+    return completed == static_cast<int>(jobs.size());
+}
+
+// Parse a byte count with an optional K, M, G or T suffix (powers of 1024).
+// Returns -1 if the text is not a size.
+long long parseByteSize(const std::string& text) {
+    char* end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || value < 0.0) {
         return -1;
     }
-    
-    std::ifstream file(tempFile);
-    if (!file) {
-        std::cerr << "Error: Could not read ffprobe output file." << std::endl;
-        return -1;
+    std::string suffix(end);
+    const std::string units = "KMGT";
+    long long scale = 1;
+    if (!suffix.empty()) {
+        size_t unit = units.find(static_cast<char>(std::toupper(static_cast<unsigned char>(suffix[0]))));
+        if (unit == std::string::npos || suffix.size() > 2 || (suffix.size() == 2 && std::toupper(suffix[1]) != 'B')) {
+            return -1;
+        }
+        scale = 1LL << (10 * (unit + 1));
+    }
+    return static_cast<long long>(value * scale);
+}
+
+// A parsed JSON value: enough of the format for configuration files
+struct JsonValue {
+    enum Type { Null, Bool, Number, String, Array, Object } type = Null;
+    double number = 0.0;               // Number, or 1/0 for Bool
+    std::string text;                  // String
+    std::vector<JsonValue> items;      // Array elements, or Object values
+    std::vector<std::string> keys;     // Object keys, parallel to items
+
+    const JsonValue* get(const std::string& key) const {
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (keys[i] == key) {
+                return &items[i];
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Recursive-descent JSON parser; parse() fails with a byte offset on bad input
+class JsonParser {
+public:
+    explicit JsonParser(const std::string& text) : text_(text) {}
+
+    bool parse(JsonValue& value) {
+        if (!parseValue(value, 0)) {
+            return false;
+        }
+        skipSpace();
+        return pos_ == text_.size();
+    }
+    size_t offset() const { return pos_; }
+
+private:
+    void skipSpace() {
+        while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+            pos_++;
+        }
+    }
+    bool consume(char c) {
+        skipSpace();
+        if (pos_ < text_.size() && text_[pos_] == c) {
+            pos_++;
+            return true;
+        }
+        return false;
+    }
+    bool literal(const char* word) {
+        size_t length = std::string(word).size();
+        if (text_.compare(pos_, length, word) != 0) {
+            return false;
+        }
+        pos_ += length;
+        return true;
+    }
+    bool parseString(std::string& out) {
+        if (!consume('"')) {
+            return false;
+        }
+        while (pos_ < text_.size() && text_[pos_] != '"') {
+            char c = text_[pos_++];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos_ >= text_.size()) {
+                return false;
+            }
+            char escape = text_[pos_++];
+            switch (escape) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    // Configuration text is ASCII; other code points become '?'
+                    if (pos_ + 4 > text_.size()) {
+                        return false;
+                    }
+                    long code = std::strtol(text_.substr(pos_, 4).c_str(), nullptr, 16);
+                    out += code < 0x80 ? static_cast<char>(code) : '?';
+                    pos_ += 4;
+                    break;
+                }
+                default: out += escape;
+            }
+        }
+        return pos_++ < text_.size();
+    }
+    bool parseValue(JsonValue& value, int depth) {
+        skipSpace();
+        if (pos_ >= text_.size() || depth > 32) {
+            return false;
+        }
+        char c = text_[pos_];
+        if (c == '{') {
+            value.type = JsonValue::Object;
+            pos_++;
+            if (consume('}')) {
+                return true;
+            }
+            do {
+                std::string key;
+                JsonValue item;
+                if (!parseString(key) || !consume(':') || !parseValue(item, depth + 1)) {
+                    return false;
+                }
+                value.keys.push_back(key);
+                value.items.push_back(item);
+            } while (consume(','));
+            return consume('}');
+        }
+        if (c == '[') {
+            value.type = JsonValue::Array;
+            pos_++;
+            if (consume(']')) {
+                return true;
+            }
+            do {
+                JsonValue item;
+                if (!parseValue(item, depth + 1)) {
+                    return false;
+                }
+                value.items.push_back(item);
+            } while (consume(','));
+            return consume(']');
+        }
+        if (c == '"') {
+            value.type = JsonValue::String;
+            return parseString(value.text);
+        }
+        if (literal("true")) {
+            value.type = JsonValue::Bool;
+            value.number = 1.0;
+            return true;
+        }
+        if (literal("false")) {
+            value.type = JsonValue::Bool;
+            return true;
+        }
+        if (literal("null")) {
+            return true;
+        }
+        char* end = nullptr;
+        value.type = JsonValue::Number;
+        value.number = std::strtod(text_.c_str() + pos_, &end);
+        if (end == text_.c_str() + pos_) {
+            return false;
+        }
+        pos_ = end - text_.c_str();
+        return true;
+    }
+
+    const std::string& text_;
+    size_t pos_ = 0;
+};
+
+// Parse a --codecs list, codec[@min-height],... e.g. h264,av1@720
+bool parseCodecList(const std::string& text, std::vector<std::pair<std::string, int>>& codecs) {
+    codecs.clear();
+    std::stringstream list(text);
+    std::string entry;
+    while (std::getline(list, entry, ',')) {
+        size_t at = entry.find('@');
+        std::string name = entry.substr(0, at);
+        int minHeight = at == std::string::npos ? 0 : std::atoi(entry.c_str() + at + 1);
+        bool duplicate = false;
+        for (const auto& codec : codecs) {
+            duplicate = duplicate || codec.first == name;
+        }
+        if (!findVideoCodec(name) || duplicate || minHeight < 0) {
+            std::cerr << "Error: Codecs must be distinct entries of h264, hevc, vp9 or av1, optionally @min-height" << std::endl;
+            return false;
+        }
+        codecs.push_back({name, minHeight});
+    }
+    if (codecs.empty()) {
+        std::cerr << "Error: Expected at least one codec" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Read a ladder profile from a JSON file:
+//   {"name": "tv", "codecs": "h264,hevc@1080", "package": "dash", "segmentSeconds": 6,
+//    "rungs": [{"height": 1080, "width": 1920, "maxFps": 60, "bitrate": 6000}, ...]}
+// Only "rungs" is required; bitrates are H.264 kbps.
+std::shared_ptr<const LoadedProfile> loadProfile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error: Cannot read profile " << path << std::endl;
+        return nullptr;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string text = contents.str();
+    JsonValue root;
+    JsonParser parser(text);
+    if (!parser.parse(root) || root.type != JsonValue::Object) {
+        std::cerr << "Error: Profile " << path << " is not a JSON object (near byte " << parser.offset() << ")" << std::endl;
+        return nullptr;
+    }
+
+    auto fail = [&](const std::string& message) {
+        std::cerr << "Error: Profile " << path << ": " << message << std::endl;
+        return nullptr;
+    };
+    auto whole = [](const JsonValue* value, int& out) {
+        if (!value) {
+            return true;
+        }
+        if (value->type != JsonValue::Number || value->number < 0 || value->number != std::floor(value->number)) {
+            return false;
+        }
+        out = static_cast<int>(value->number);
+        return true;
+    };
+
+    auto loaded = std::make_shared<LoadedProfile>();
+    loaded->name = getFilenameStem(path);
+    for (size_t i = 0; i < root.keys.size(); i++) {
+        const std::string& key = root.keys[i];
+        const JsonValue& value = root.items[i];
+        if (key == "name" || key == "codecs" || key == "package") {
+            if (value.type != JsonValue::String) {
+                return fail("\"" + key + "\" must be a string");
+            }
+            (key == "name" ? loaded->name : key == "codecs" ? loaded->codecs : loaded->package) = value.text;
+        } else if (key == "segmentSeconds") {
+            if (!whole(&value, loaded->profile.segmentSeconds) || loaded->profile.segmentSeconds == 0) {
+                return fail("\"segmentSeconds\" must be a positive whole number");
+            }
+        } else if (key != "rungs") {
+            return fail("unknown field \"" + key + "\"");
+        }
+    }
+
+    const JsonValue* rungs = root.get("rungs");
+    if (!rungs || rungs->type != JsonValue::Array || rungs->items.empty()) {
+        return fail("\"rungs\" must be a non-empty array");
     }
-    
-    std::string heightStr;
-    std::getline(file, heightStr);
-    file.close();
-    
-    // Clean up temp file
-    remove(tempFile.c_str());
+    for (const auto& item : rungs->items) {
+        LadderRung rung{0, 0, 0, 0};
+        if (item.type != JsonValue::Object) {
+            return fail("each rung must be an object");
+        }
+        for (const auto& key : item.keys) {
+            if (key != "height" && key != "width" && key != "maxFps" && key != "bitrate") {
+                return fail("unknown rung field \"" + key + "\"");
+            }
+        }
+        if (!whole(item.get("height"), rung.height) || !whole(item.get("width"), rung.width) ||
+            !whole(item.get("maxFps"), rung.maxFps) || !whole(item.get("bitrate"), rung.bitrateKbps)) {
+            return fail("rung fields must be whole numbers");
+        }
+        if (rung.height < 2 || rung.height % 2 || rung.width % 2) {
+            return fail("rung heights are required and sizes must be even");
+        }
+        if (findLadderRung(LadderProfile{"", loaded->rungs.data(), loaded->rungs.size(), "", "", 0}, rung.height)) {
+            return fail("rung height " + std::to_string(rung.height) + " appears twice");
+        }
+        loaded->rungs.push_back(rung);
+    }
+    std::sort(loaded->rungs.begin(), loaded->rungs.end(),
+              [](const LadderRung& a, const LadderRung& b) { return a.height > b.height; });
 
-    // Trim whitespace which can cause stoi to fail
-    size_t first = heightStr.find_first_not_of(" \t\n\r");
-    if (std::string::npos == first) {
-        std::cerr << "Error: ffprobe returned empty output for video height." << std::endl;
-        return -1;
+    std::vector<std::pair<std::string, int>> codecs;
+    if (!loaded->codecs.empty() && !parseCodecList(loaded->codecs, codecs)) {
+        return fail("invalid \"codecs\"");
+    }
+    const std::string& package = loaded->package;
+    if (!package.empty() && package != "hls" && package != "dash" && package != "both" && package != "none") {
+        return fail("\"package\" must be hls, dash, both or none");
     }
-    size_t last = heightStr.find_last_not_of(" \t\n\r");
-    std::string trimmed_result = heightStr.substr(first, (last - first + 1));
+    loaded->profile.name = loaded->name.c_str();
+    loaded->profile.rungs = loaded->rungs.data();
+    loaded->profile.rungCount = loaded->rungs.size();
+    loaded->profile.codecs = loaded->codecs.c_str();
+    loaded->profile.package = loaded->package.c_str();
+    return loaded;
+}
 
-    try {
-        return std::stoi(trimmed_result);
-    } catch (const std::invalid_argument& e) {
-        std::cerr << "Error: Could not parse video height from ffprobe output: '" << trimmed_result << "'. " << e.what() << std::endl;
-        return -1;
-    } catch (const std::out_of_range& e) {
-        std::cerr << "Error: Video height value from ffprobe is out of range: '" << trimmed_result << "'. " << e.what() << std::endl;
-        return -1;
+// Select a --profile: a built-in preset by name, profiles/NAME.json, or a
+// JSON file path. Its codecs and packaging replace the current options;
+// options given after it override them in turn.
+bool selectProfile(const std::string& value, ProcessOptions& options) {
+    options.loadedProfile.reset();
+    options.profile = nullptr;
+    for (const auto& preset : ladderProfiles) {
+        if (value == preset.name) {
+            options.profile = &preset;
+        }
+    }
+    if (!options.profile) {
+        bool isPath = value.find('/') != std::string::npos || value.find('\\') != std::string::npos ||
+                      (value.size() > 5 && value.compare(value.size() - 5, 5, ".json") == 0);
+        options.loadedProfile = loadProfile(isPath ? value : "profiles/" + value + ".json");
+        if (!options.loadedProfile) {
+            options.profile = &ladderProfiles[0];
+            return false;
+        }
+        options.profile = &options.loadedProfile->profile;
     }
+
+    const LadderProfile& profile = *options.profile;
+    if (profile.codecs[0] && !parseCodecList(profile.codecs, options.codecs)) {
+        return false;
+    }
+    std::string package = profile.package;
+    if (!package.empty()) {
+        options.packageHls = package == "hls" || package == "both";
+        options.packageDash = package == "dash" || package == "both";
+    }
+    if (profile.segmentSeconds > 0) {
+        options.segmentSeconds = profile.segmentSeconds;
+    }
+    return true;
 }
 
-// Get subordinate qualities based on input resolution (YouTube style)
-std::vector<std::pair<std::string, int>> getSubordinateQualities(int inputHeight) {
-    std::vector<std::pair<std::string, int>> allQualities = {
-        {"2160", 2160}, // 4K
-        {"1440", 1440}, // 2K
-        {"1080", 1080}, // Full HD
-        {"720", 720},   // HD
-        {"480", 480},   // SD
-        {"360", 360},   // Low
-        {"240", 240},   // Very Low
-        {"144", 144}    // Lowest
-    };
-    
-    std::vector<std::pair<std::string, int>> subordinateQualities;
-    
-    // Only include qualities that are lower than input resolution
-    for (const auto& quality : allQualities) {
-        if (quality.second < inputHeight) {
-            subordinateQualities.push_back(quality);
+// Parse command line arguments into options and input paths. Returns false
+// after printing an error for an invalid option.
+bool parseOptions(const std::vector<std::string>& args, ProcessOptions& options, std::vector<std::string>& inputs) {
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg == "--single-decode") {
+            options.singleDecode = true;
+        } else if (arg == "--cascade") {
+            options.cascade = true;
+        } else if (arg == "--ssim-tolerance" && i + 1 < args.size()) {
+            options.ssimTolerance = std::atof(args[++i].c_str());
+            if (options.ssimTolerance < 0.0 || options.ssimTolerance >= 1.0) {
+                std::cerr << "Error: --ssim-tolerance expects a value in [0, 1)" << std::endl;
+                return false;
+            }
+        } else if (arg == "--consume-input") {
+            options.consumeInput = true;
+        } else if (arg == "--hwaccel" && i + 1 < args.size()) {
+            options.hwaccel = args[++i];
+            bool known = options.hwaccel == "none" || options.hwaccel == "auto";
+            for (const auto& backend : hwBackends) {
+                known = known || options.hwaccel == backend.name;
+            }
+            if (!known) {
+                std::cerr << "Error: Unknown --hwaccel backend: " << options.hwaccel << std::endl;
+                return false;
+            }
+        } else if (arg == "--hw-sessions" && i + 1 < args.size()) {
+            options.hwSessions = std::atoi(args[++i].c_str());
+        } else if (arg == "--package" && i + 1 < args.size()) {
+            std::string format = args[++i];
+            options.packageHls = format == "hls" || format == "both";
+            options.packageDash = format == "dash" || format == "both";
+            if (!options.packageHls && !options.packageDash) {
+                std::cerr << "Error: --package expects hls, dash or both" << std::endl;
+                return false;
+            }
+        } else if (arg == "--segment-seconds" && i + 1 < args.size()) {
+            options.segmentSeconds = std::atoi(args[++i].c_str());
+            if (options.segmentSeconds <= 0) {
+                std::cerr << "Error: --segment-seconds expects a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg == "--follow") {
+            options.follow = true;
+        } else if (arg == "--follow-idle" && i + 1 < args.size()) {
+            options.followIdleSeconds = std::atoi(args[++i].c_str());
+            if (options.followIdleSeconds <= 0) {
+                std::cerr << "Error: --follow-idle expects a positive number of seconds" << std::endl;
+                return false;
+            }
+        } else if (arg == "--name" && i + 1 < args.size()) {
+            options.name = args[++i];
+        } else if (arg == "--chunks" && i + 1 < args.size()) {
+            options.chunks = std::atoi(args[++i].c_str());
+            if (options.chunks <= 0) {
+                std::cerr << "Error: --chunks expects a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg == "--chunk-min-height" && i + 1 < args.size()) {
+            options.chunkMinHeight = std::atoi(args[++i].c_str());
+        } else if (arg == "--progress-fd" && i + 1 < args.size()) {
+            options.progressFd = std::atoi(args[++i].c_str());
+            if (options.progressFd < 0) {
+                std::cerr << "Error: --progress-fd expects a file descriptor" << std::endl;
+                return false;
+            }
+        } else if (arg == "--daemon" && i + 1 < args.size()) {
+            options.daemonSocket = args[++i];
+        } else if (arg == "--max-jobs" && i + 1 < args.size()) {
+            options.maxJobs = std::atoi(args[++i].c_str());
+            if (options.maxJobs <= 0) {
+                std::cerr << "Error: --max-jobs expects a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg == "--queue-size" && i + 1 < args.size()) {
+            options.queueSize = std::atoi(args[++i].c_str());
+            if (options.queueSize <= 0) {
+                std::cerr << "Error: --queue-size expects a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg == "--bench" && i + 1 < args.size()) {
+            options.benchOut = args[++i];
+        } else if (arg == "--bench-runs" && i + 1 < args.size()) {
+            options.benchRuns = std::atoi(args[++i].c_str());
+            if (options.benchRuns <= 0) {
+                std::cerr << "Error: --bench-runs expects a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg == "--metrics-out" && i + 1 < args.size()) {
+            options.metricsOut = args[++i];
+        } else if (arg == "--deadline" && i + 1 < args.size()) {
+            options.deadline = std::atof(args[++i].c_str());
+            if (options.deadline <= 0.0) {
+                std::cerr << "Error: --deadline expects a positive number of seconds" << std::endl;
+                return false;
+            }
+        } else if (arg == "--playable-height" && i + 1 < args.size()) {
+            options.playableHeight = std::atoi(args[++i].c_str());
+            if (options.playableHeight < 0) {
+                std::cerr << "Error: --playable-height expects a height, or 0 to turn tiers off" << std::endl;
+                return false;
+            }
+        } else if (arg == "--output-dir" && i + 1 < args.size()) {
+            options.outputDir = args[++i];
+        } else if (arg == "--offload" && i + 1 < args.size()) {
+            options.offloadCommand = args[++i];
+            if (options.offloadCommand.find("{file}") == std::string::npos) {
+                std::cerr << "Error: --offload expects a command containing {file}" << std::endl;
+                return false;
+            }
+        } else if (arg == "--offload-jobs" && i + 1 < args.size()) {
+            options.offloadJobs = std::atoi(args[++i].c_str());
+            if (options.offloadJobs <= 0) {
+                std::cerr << "Error: --offload-jobs expects a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg == "--disk-quota" && i + 1 < args.size()) {
+            options.diskQuota = parseByteSize(args[++i]);
+            if (options.diskQuota <= 0) {
+                std::cerr << "Error: --disk-quota expects a size such as 50G" << std::endl;
+                return false;
+            }
+        } else if (arg == "--audio" && i + 1 < args.size()) {
+            options.audio = args[++i];
+            if (options.audio != "copy" && options.audio != "aac" && options.audio != "opus") {
+                std::cerr << "Error: --audio expects copy, aac or opus" << std::endl;
+                return false;
+            }
+        } else if (arg == "--loudnorm") {
+            options.loudnorm = true;
+        } else if (arg == "--previews") {
+            options.previews = true;
+        } else if (arg == "--sprite-interval" && i + 1 < args.size()) {
+            options.spriteInterval = std::atof(args[++i].c_str());
+            if (options.spriteInterval <= 0.0) {
+                std::cerr << "Error: --sprite-interval expects a positive number of seconds" << std::endl;
+                return false;
+            }
+        } else if (arg == "--coordinate" && i + 1 < args.size()) {
+            options.coordinate = args[++i];
+        } else if (arg == "--worker" && i + 1 < args.size()) {
+            options.worker = args[++i];
+        } else if (arg == "--worker-slots" && i + 1 < args.size()) {
+            options.workerSlots = std::atoi(args[++i].c_str());
+            if (options.workerSlots <= 0) {
+                std::cerr << "Error: --worker-slots expects a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg == "--path-map" && i + 1 < args.size()) {
+            options.pathMap = args[++i];
+            if (options.pathMap.find('=') == std::string::npos) {
+                std::cerr << "Error: --path-map expects FROM=TO" << std::endl;
+                return false;
+            }
+        } else if (arg == "--codecs" && i + 1 < args.size()) {
+            if (!parseCodecList(args[++i], options.codecs)) {
+                return false;
+            }
+        } else if (arg == "--profile" && i + 1 < args.size()) {
+            if (!selectProfile(args[++i], options)) {
+                return false;
+            }
+        } else if (arg == "--codec-threads" && i + 1 < args.size()) {
+            // codec=threads,... e.g. h264=4,av1=12
+            std::stringstream list(args[++i]);
+            std::string entry;
+            while (std::getline(list, entry, ',')) {
+                size_t eq = entry.find('=');
+                int threads = eq == std::string::npos ? 0 : std::atoi(entry.c_str() + eq + 1);
+                if (!findVideoCodec(entry.substr(0, eq)) || threads <= 0) {
+                    std::cerr << "Error: --codec-threads expects codec=threads entries, e.g. h264=4,av1=12" << std::endl;
+                    return false;
+                }
+                options.codecThreads[entry.substr(0, eq)] = threads;
+            }
+        } else if (arg == "--fps-cap" && i + 1 < args.size()) {
+            // HEIGHT:FPS, e.g. 480:30, or off
+            std::string cap = args[++i];
+            size_t colon = cap.find(':');
+            options.fpsCapHeight = cap == "off" ? 0 : std::atoi(cap.c_str());
+            options.fpsCap = colon == std::string::npos ? 0 : std::atoi(cap.c_str() + colon + 1);
+            if (cap != "off" && (options.fpsCapHeight <= 0 || options.fpsCap <= 0)) {
+                std::cerr << "Error: --fps-cap expects HEIGHT:FPS, e.g. 480:30, or off" << std::endl;
+                return false;
+            }
+        } else if (arg == "--quality-metrics" && i + 1 < args.size()) {
+            // Comma-separated, e.g. ssim,psnr or vmaf
+            std::stringstream list(args[++i]);
+            std::string metric;
+            options.qualityMetrics.clear();
+            while (std::getline(list, metric, ',')) {
+                if (metric != "ssim" && metric != "psnr" && metric != "vmaf") {
+                    std::cerr << "Error: --quality-metrics expects ssim, psnr and/or vmaf" << std::endl;
+                    return false;
+                }
+                if (std::find(options.qualityMetrics.begin(), options.qualityMetrics.end(), metric) ==
+                    options.qualityMetrics.end()) {
+                    options.qualityMetrics.push_back(metric);
+                }
+            }
+        } else if (arg == "--quality-floor" && i + 1 < args.size()) {
+            // METRIC:VALUE, e.g. vmaf:85 or ssim:0.95
+            std::string floor = args[++i];
+            size_t colon = floor.find(':');
+            options.qualityFloorMetric = floor.substr(0, colon);
+            options.qualityFloor = colon == std::string::npos ? 0.0 : std::atof(floor.c_str() + colon + 1);
+            if ((options.qualityFloorMetric != "ssim" && options.qualityFloorMetric != "psnr" &&
+                 options.qualityFloorMetric != "vmaf") || options.qualityFloor <= 0.0) {
+                std::cerr << "Error: --quality-floor expects METRIC:VALUE, e.g. vmaf:85 or ssim:0.95" << std::endl;
+                return false;
+            }
+        } else if (arg == "--cpus" && i + 1 < args.size()) {
+            options.cpus = args[++i];
+        } else if (arg == "--nice" && i + 1 < args.size()) {
+            options.nice = std::atoi(args[++i].c_str());
+            if (options.nice < -20 || options.nice > 19) {
+                std::cerr << "Error: --nice expects a value from -20 to 19" << std::endl;
+                return false;
+            }
+        } else if (arg == "--ioprio" && i + 1 < args.size()) {
+            // idle, or best-effort with an optional level 0 (highest) to 7
+            options.ioprio = args[++i];
+            size_t colon = options.ioprio.find(':');
+            std::string name = options.ioprio.substr(0, colon);
+            int level = colon == std::string::npos ? 4 : std::atoi(options.ioprio.c_str() + colon + 1);
+            if (!(name == "idle" && colon == std::string::npos) && !(name == "best-effort" && level >= 0 && level <= 7)) {
+                std::cerr << "Error: --ioprio expects idle or best-effort[:0-7]" << std::endl;
+                return false;
+            }
+        } else if (arg == "--memory-max" && i + 1 < args.size()) {
+            options.memoryMax = parseByteSize(args[++i]);
+            if (options.memoryMax <= 0) {
+                std::cerr << "Error: --memory-max expects a size, e.g. 4G" << std::endl;
+                return false;
+            }
+        } else if (arg == "--psi-limit" && i + 1 < args.size()) {
+            std::string limit = args[++i];
+            options.psiLimit = limit == "off" ? 0.0 : std::atof(limit.c_str());
+            if (limit != "off" && (options.psiLimit <= 0.0 || options.psiLimit > 100.0)) {
+                std::cerr << "Error: --psi-limit expects a percentage in (0, 100] or off" << std::endl;
+                return false;
+            }
+        } else if (arg == "--batch" && i + 1 < args.size()) {
+            options.batch = args[++i];
+        } else if (arg == "--batch-jobs" && i + 1 < args.size()) {
+            options.batchJobs = std::atoi(args[++i].c_str());
+            if (options.batchJobs <= 0) {
+                std::cerr << "Error: --batch-jobs expects a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg == "--resume") {
+            options.resume = true;
+        } else if (arg == "--two-pass") {
+            options.twoPass = true;
+        } else if (arg == "--per-title") {
+            options.perTitle = true;
+        } else if (arg == "--cache" && i + 1 < args.size()) {
+            options.cacheDir = args[++i];
+        } else if (arg == "--parallel") {
+            options.parallel = true;
+        } else if (arg == "--threads" && i + 1 < args.size()) {
+            options.threadBudget = std::atoi(args[++i].c_str());
+            if (options.threadBudget <= 0) {
+                std::cerr << "Error: --threads expects a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--", 0) == 0 && arg != "-") {
+            std::cerr << "Error: Unknown option: " << arg << std::endl;
+            return false;
+        } else {
+            inputs.push_back(arg);
         }
     }
-    
-    return subordinateQualities;
+    return true;
 }
 
-// Helper function to extract filename without extension
-std::string getFilenameStem(const std::string& path) {
-    size_t lastSlash = path.find_last_of("/\\");
-    size_t start = (lastSlash == std::string::npos) ? 0 : lastSlash + 1;
-    size_t lastDot = path.find_last_of('.');
-    size_t end = (lastDot == std::string::npos || lastDot < start) ? path.length() : lastDot;
-    return path.substr(start, end - start);
+// Run one job whose input is either complete on disk or still being written
+bool runJob(const std::string& videoPath, const ProcessOptions& options) {
+    Stopwatch total;
+    bool ok;
+    if (options.follow) {
+        // The upload may not have created the file yet
+        GrowingInput growing(videoPath, options.followIdleSeconds);
+        ok = processVideo(videoPath, options, &growing);
+    } else {
+        ok = processVideo(videoPath, options, nullptr);
+    }
+    if (options.partial || (!ok && options.preempt && options.preempt->load())) {
+        return ok;  // The job continues in a later run
+    }
+    if (options.diskQuota > 0) {
+        enforceDiskQuota(options, getFilenameStem(videoPath));
+    }
+    metrics.observe("process_video_stage_seconds", metricLabel("stage", "total"), total.seconds());
+    metrics.count("process_video_jobs", metricLabel("result", ok ? "completed" : "failed"));
+    return ok;
 }
 
-// Helper function to copy file
-bool copyFile(const std::string& src, const std::string& dst) {
-    std::ifstream source(src, std::ios::binary);
-    std::ofstream dest(dst, std::ios::binary);
-    
-    if (!source || !dest) {
+// Container extensions a --batch directory is scanned for
+bool videoFileName(const std::string& name) {
+    static const char* extensions[] = {".mp4", ".m4v", ".mov", ".mkv", ".webm", ".avi", ".ts", ".mts", ".mxf", ".flv"};
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) {
         return false;
     }
-    
-    dest << source.rdbuf();
-    return source.good() && dest.good();
+    std::string extension = name.substr(dot);
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    for (const char* candidate : extensions) {
+        if (extension == candidate) {
+            return true;
+        }
+    }
+    return false;
 }
 
-// Helper function to check if directory exists
-bool directoryExists(const std::string& path) {
-    return access(path.c_str(), F_OK) == 0;
+// Expand --batch into input paths: a directory's video files, the matches
+// of a glob, or a list file with one path per line ('#' starts a comment)
+bool batchInputs(const std::string& spec, std::vector<std::string>& inputs) {
+    if (isDirectory(spec)) {
+        std::vector<std::string> names;
+        for (const auto& entry : listDirectory(spec)) {
+            if (!entry.second && videoFileName(entry.first)) {
+                names.push_back(entry.first);
+            }
+        }
+        std::sort(names.begin(), names.end());
+        for (const auto& name : names) {
+            inputs.push_back(spec + "/" + name);
+        }
+        return true;
+    }
+    if (spec.find_first_of("*?[") != std::string::npos) {
+#ifdef _WIN32
+        // Wildcards are only expanded in the last path component
+        size_t sep = spec.find_last_of("/\\");
+        std::string dir = sep == std::string::npos ? "" : spec.substr(0, sep + 1);
+        _finddata_t found;
+        intptr_t handle = _findfirst(spec.c_str(), &found);
+        if (handle != -1) {
+            do {
+                if (!(found.attrib & _A_SUBDIR)) {
+                    inputs.push_back(dir + found.name);
+                }
+            } while (_findnext(handle, &found) == 0);
+            _findclose(handle);
+        }
+        std::sort(inputs.begin(), inputs.end());
+#else
+        glob_t matches;
+        if (glob(spec.c_str(), 0, nullptr, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; i++) {
+                if (!isDirectory(matches.gl_pathv[i])) {
+                    inputs.push_back(matches.gl_pathv[i]);
+                }
+            }
+        }
+        globfree(&matches);
+#endif
+        return true;
+    }
+    std::ifstream list(spec);
+    if (!list) {
+        std::cerr << "Error: Cannot read batch list " << spec << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+        size_t first = line.find_first_not_of(" \t\r");
+        size_t last = line.find_last_not_of(" \t\r");
+        if (first != std::string::npos && line[first] != '#') {
+            inputs.push_back(line.substr(first, last - first + 1));
+        }
+    }
+    return true;
 }
 
-void processVideo(const std::string& videoPath) {
-    auto start_time = std::chrono::high_resolution_clock::now();
-    
-    std::string stem = getFilenameStem(videoPath);
-    std::string folderName = stem;
+// Process every input of a --batch run in one invocation. All inputs are
+// probed up front and started largest first, a few at a time, while their
+// rungs share one pool of encoder threads. Finished inputs are journaled in
+// the output root, so running the same batch again skips them; interrupted
+// inputs resume their missing rungs.
+int runBatch(const ProcessOptions& options, std::vector<std::string> inputs) {
+    Stopwatch total;
+    if (!batchInputs(options.batch, inputs)) {
+        return 1;
+    }
+    if (inputs.empty()) {
+        std::cerr << "Error: --batch " << options.batch << " names no inputs" << std::endl;
+        return 1;
+    }
 
-    // Create output folder
-    if (!directoryExists(folderName)) {
-        if (mkdir(folderName.c_str(), 0755) != 0) {
-            std::cerr << "Error: Failed to create directory '" << folderName << "'" << std::endl;
-            return;
+    // The journal is named after the batch and every output-affecting option
+    std::string root = options.outputDir.empty() ? "." : options.outputDir;
+    std::string journalPath = root + "/.batch-" + outputKey("batch:" + absolutePath(options.batch), options).substr(0, 16) + ".done";
+    std::set<std::string> finished;
+    {
+        std::ifstream journal(journalPath);
+        std::string line;
+        while (std::getline(journal, line)) {
+            finished.insert(line);
         }
     }
-    // Get input video height
-    int inputHeight = getVideoHeight(videoPath);
-    if (inputHeight == -1) {
-        std::cerr << "Could not determine input video height.\n";
-        return;
+
+    // Output folders are named by stem, so a repeated stem would overwrite
+    struct BatchInput {
+        std::string path;
+        MediaInfo info;
+        bool probed = false;
+        double cost = 0.0;
+    };
+    std::vector<BatchInput> pending;
+    std::set<std::string> stems;
+    int skipped = 0;
+    int failed = 0;
+    for (const auto& input : inputs) {
+        std::string path = absolutePath(input);
+        if (finished.count(path)) {
+            skipped++;
+            continue;
+        }
+        if (access(path.c_str(), F_OK) != 0) {
+            std::cerr << "✗ " << input << ": file does not exist" << std::endl;
+            failed++;
+            continue;
+        }
+        if (!stems.insert(getFilenameStem(path)).second) {
+            std::cerr << "✗ " << input << ": another input already writes the folder '" << getFilenameStem(path) << "'" << std::endl;
+            failed++;
+            continue;
+        }
+        pending.push_back({path, MediaInfo(), false, 0.0});
     }
-    
-    std::cout << "Input video resolution: " << inputHeight << "p" << std::endl;
-    
-    // Copy original video with height in filename
-    std::string originalOut = folderName + "/" + stem + " " + std::to_string(inputHeight) + ".mp4";
-    if (!copyFile(videoPath, originalOut)) {
-        std::cerr << "Error: Failed to copy original video to '" << originalOut << "'" << std::endl;
-        return;
+
+    // Probe everything up front, a few at a time
+    Stopwatch probing;
+    int threadBudget = resolveThreadBudget(options.threadBudget);
+    std::atomic<size_t> nextProbe{0};
+    std::vector<std::thread> probers;
+    for (int t = 0; t < std::min<int>(std::min(threadBudget, 8), static_cast<int>(pending.size())); t++) {
+        probers.emplace_back([&] {
+            for (size_t i = nextProbe++; i < pending.size(); i = nextProbe++) {
+                BatchInput& input = pending[i];
+                input.probed = probeMedia(input.path, input.info);
+                double pixels = static_cast<double>(input.info.displayWidth()) * input.info.displayHeight();
+                input.cost = pixels * (input.info.duration > 0 ? input.info.duration : 1.0);
+            }
+        });
+    }
+    for (auto& prober : probers) {
+        prober.join();
     }
-    std::cout << "Original copied as: " << originalOut << std::endl;
+    metrics.observe("process_video_stage_seconds", metricLabel("stage", "batch_probe"), probing.seconds());
+    for (auto it = pending.begin(); it != pending.end();) {
+        if (it->probed) {
+            ++it;
+            continue;
+        }
+        std::cerr << "✗ " << it->path << ": could not probe input" << std::endl;
+        metrics.count("process_video_failures", metricLabel("stage", "probe"));
+        failed++;
+        it = pending.erase(it);
+    }
+    std::stable_sort(pending.begin(), pending.end(),
+                     [](const BatchInput& a, const BatchInput& b) { return a.cost > b.cost; });
 
-    // Get subordinate qualities
-    std::vector<std::pair<std::string, int>> subordinateQualities = getSubordinateQualities(inputHeight);
-    
-    if (subordinateQualities.empty()) {
-        std::cout << "No subordinate qualities to process for " << inputHeight << "p video." << std::endl;
-        return;
+    int inFlight = options.batchJobs > 0 ? options.batchJobs : std::max(2, threadBudget / 4);
+    inFlight = std::min<int>(inFlight, static_cast<int>(pending.size()));
+    std::cout << "Batch: " << pending.size() << " inputs to process, " << skipped << " already done, "
+              << inFlight << " at a time sharing " << threadBudget << " encoder threads" << std::endl;
+    progressStream.emit(JsonObject("batch_start").add("inputs", static_cast<int>(pending.size()))
+                            .add("skipped", skipped).add("failed", failed).add("jobs", inFlight));
+
+    // Rung tasks of every input draw from the shared pool, so each input
+    // runs through the rung scheduler with the whole budget as its limit
+    sharedThreads.enable(threadBudget);
+    ProcessOptions jobOptions = options;
+    jobOptions.parallel = true;
+    jobOptions.resume = true;
+    jobOptions.threadBudget = threadBudget;
+
+    std::mutex journalMutex;
+    std::ofstream journal(journalPath, std::ios::app);
+    std::atomic<size_t> nextInput{0};
+    std::atomic<int> succeeded{0};
+    std::atomic<int> failures{failed};
+    std::vector<std::thread> runners;
+    for (int t = 0; t < inFlight; t++) {
+        runners.emplace_back([&] {
+            for (size_t i = nextInput++; i < pending.size(); i = nextInput++) {
+                ProcessOptions inputOptions = jobOptions;
+                inputOptions.probe = &pending[i].info;
+                bool ok = runJob(pending[i].path, inputOptions);
+                (ok ? succeeded : failures)++;
+                std::lock_guard<std::mutex> lock(journalMutex);
+                if (ok) {
+                    journal << pending[i].path << std::endl;
+                }
+                progressStream.emit(JsonObject("batch_input_done").add("input", pending[i].path).add("ok", ok)
+                                        .add("done", succeeded.load() + failures.load() - failed)
+                                        .add("total", static_cast<int>(pending.size())));
+            }
+        });
     }
-    
-    std::cout << "Processing subordinate qualities: ";
-    for (const auto& q : subordinateQualities) {
-        std::cout << q.first << "p ";
+    for (auto& runner : runners) {
+        runner.join();
+    }
+    sharedThreads.enable(0);
+
+    std::cout << "\n" << (failures.load() == 0 ? "✓" : "✗") << " Batch complete: " << succeeded.load() << " processed, "
+              << failures.load() << " failed, " << skipped << " skipped in " << std::fixed << std::setprecision(2)
+              << total.seconds() << " seconds" << std::endl;
+    progressStream.emit(JsonObject("batch_done").add("processed", succeeded.load()).add("failed", failures.load())
+                            .add("skipped", skipped).add("seconds", total.seconds()));
+    return failures.load() == 0 ? 0 : 1;
+}
+
+#ifndef _WIN32
+// Rough peak memory of a job: the decoder holds about 16 source frames and
+// each encoding rung about 48 frames of lookahead and references
+long long estimateJobMemory(const MediaInfo& info, const ProcessOptions& options) {
+    auto frameBytes = [](long long width, long long height) { return width * height * 3 / 2; };
+    int width = info.displayWidth();
+    int height = info.displayHeight();
+    long long sum = 0;
+    long long peak = 0;
+    for (const auto& q : getSubordinateQualities(info.height, *options.profile)) {
+        long long rung = frameBytes(scaledWidth(width, height, q.second), q.second) * 48;
+        sum += rung;
+        peak = std::max(peak, rung);
+    }
+    bool concurrent = options.parallel || options.singleDecode || options.cascade || options.chunks > 1;
+    return frameBytes(width, height) * 16 + (concurrent ? sum : peak) * options.chunks;
+}
+
+// Queued or running job in daemon mode
+struct DaemonJob {
+    std::string id;
+    int priority = 0;                // Higher runs first; FIFO within a priority
+    unsigned long long sequence = 0;
+    std::string videoPath;
+    ProcessOptions options;
+    long long memory = 0;            // Estimated peak bytes (0 = unknown)
+    std::string state = "queued";    // queued, running, completed, failed, cancelled
+    std::vector<std::string> events; // Progress events, replayed to pollers
+    ProgressReporter progress;
+    Stopwatch submitted;
+    int runs = 0;                    // Times the job has been started
+    int tier = 1;                    // Next run: 0 = rungs up to the playable height, 1 = the rest
+    bool playable = false;           // The playable tier is done
+    double deadlineAt = 1e300;       // Daemon clock seconds the job should be done by
+    std::atomic<bool> preempt{false}; // Asks the running job to stop at its next chunk boundary
+};
+
+// Long-running job server on a Unix socket. Jobs wait in a bounded priority
+// queue and are admitted while their thread reservation fits the core budget
+// and their estimated memory fits what the machine has free.
+//
+// A job whose ladder reaches above the playable height runs in two tiers:
+// first its rungs up to that height, then the rest, resumed from the job
+// manifest. The queue is ordered by priority, then tier, then deadline, so
+// within a priority every job becomes playable before any job's high rungs
+// encode. When the head cannot be admitted and it outranks a running job by
+// priority or tier, that job is preempted: it stops at its next rung or
+// chunk boundary and is queued again, keeping the work it finished.
+//
+// Requests are tab-separated lines answered with one JSON line:
+//   SUBMIT <priority> <args...>   STATUS <id>   EVENTS <id> <cursor>
+//   CANCEL <id>   STATS   METRICS   SHUTDOWN
+class JobDaemon {
+public:
+    explicit JobDaemon(const ProcessOptions& defaults)
+        : cores_(resolveThreadBudget(defaults.threadBudget)), maxJobs_(defaults.maxJobs), queueSize_(defaults.queueSize),
+          playableHeight_(defaults.playableHeight), memoryMax_(defaults.memoryMax) {}
+
+    int serve(const std::string& socketPath) {
+        sockaddr_un addr{};
+        if (socketPath.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Error: Socket path too long: " << socketPath << std::endl;
+            return 1;
+        }
+        addr.sun_family = AF_UNIX;
+        socketPath.copy(addr.sun_path, socketPath.size());
+
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socketPath.c_str());
+        if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+            std::cerr << "Error: Could not listen on " << socketPath << ": " << strerror(errno) << std::endl;
+            if (listener >= 0) {
+                close(listener);
+            }
+            return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+
+        std::cout << "Daemon listening on " << socketPath << " (" << maxJobs_ << " jobs, " << cores_
+                  << " threads, queue " << queueSize_ << ")" << std::endl;
+        std::thread scheduler(&JobDaemon::schedule, this);
+
+        // Requests are small and local, so connections are served in turn;
+        // the receive timeout keeps a stalled client from blocking the rest
+        while (!stopping()) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            timeval timeout{5, 0};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            serveConnection(client);
+            close(client);
+        }
+        close(listener);
+        unlink(socketPath.c_str());
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.notify_all();
+        changed_.wait(lock, [&] { return running_ == 0; });
+        lock.unlock();
+        scheduler.join();
+        std::cout << "Daemon stopped" << std::endl;
+        return 0;
+    }
+
+private:
+    bool stopping() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stopping_;
+    }
+
+    void serveConnection(int client) {
+        std::string pending;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+            pending.append(buffer, static_cast<size_t>(n));
+            size_t newline;
+            while ((newline = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                std::vector<std::string> fields;
+                std::stringstream ss(line);
+                std::string field;
+                while (std::getline(ss, field, '\t')) {
+                    fields.push_back(field);
+                }
+                std::string reply = handle(fields) + "\n";
+                if (send(client, reply.data(), reply.size(), 0) < 0) {
+                    return;
+                }
+            }
+        }
+    }
+
+    static std::string error(const std::string& message) {
+        return JsonObject().add("ok", false).add("error", message).str();
+    }
+
+    std::string handle(const std::vector<std::string>& fields) {
+        const std::string command = fields.empty() ? "" : fields[0];
+        if (command == "SUBMIT" && fields.size() >= 3) {
+            return submit(std::atoi(fields[1].c_str()), std::vector<std::string>(fields.begin() + 2, fields.end()));
+        }
+        if (command == "STATS") {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return JsonObject().add("ok", true).add("queued", static_cast<int>(queue_.size()))
+                               .add("running", running_).add("max_jobs", maxJobs_).add("threads", cores_)
+                               .add("threads_reserved", runningThreads_).add("queue_size", queueSize_)
+                               .add("memory_available", availableMemory()).str();
+        }
+        if (command == "METRICS") {
+            return JsonObject().add("ok", true).add("metrics", metrics.render()).str();
+        }
+        if (command == "SHUTDOWN") {
+            // Queued jobs are cancelled; running jobs finish first
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            for (auto& job : queue_) {
+                job->state = "cancelled";
+            }
+            queue_.clear();
+            updateGauges();
+            changed_.notify_all();
+            return JsonObject().add("ok", true).add("running", running_).str();
+        }
+        if (fields.size() < 2) {
+            return error("unknown command");
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = jobs_.find(fields[1]);
+        if (found == jobs_.end()) {
+            return error("unknown job " + fields[1]);
+        }
+        DaemonJob& job = *found->second;
+        if (command == "STATUS") {
+            JsonObject reply;
+            reply.add("ok", true).add("id", job.id).add("state", job.state).add("priority", job.priority)
+                 .add("tier", job.tier).add("playable", job.playable)
+                 .add("percent", job.progress.percent()).add("events", static_cast<int>(job.events.size()));
+            if (job.state == "queued") {
+                reply.add("position", queuePosition(job));
+            }
+            return reply.str();
+        }
+        if (command == "EVENTS" && fields.size() >= 3) {
+            size_t cursor = std::min(static_cast<size_t>(std::max(0LL, std::atoll(fields[2].c_str()))), job.events.size());
+            std::string events;
+            for (size_t i = cursor; i < job.events.size(); i++) {
+                events += (events.empty() ? "" : ",") + job.events[i];
+            }
+            JsonObject reply;
+            reply.add("ok", true).add("id", job.id).add("state", job.state).add("percent", job.progress.percent())
+                 .add("playable", job.playable)
+                 .add("next", static_cast<long long>(job.events.size())).addRaw("events", "[" + events + "]");
+            if (job.state == "queued") {
+                reply.add("position", queuePosition(job));
+            }
+            return reply.str();
+        }
+        if (command == "CANCEL") {
+            if (job.state != "queued") {
+                return error("job " + job.id + " is " + job.state);
+            }
+            job.state = "cancelled";
+            queue_.erase(std::find(queue_.begin(), queue_.end(), found->second));
+            updateGauges();
+            finish(job.id);
+            return JsonObject().add("ok", true).add("id", job.id).add("state", job.state).str();
+        }
+        return error("unknown command");
+    }
+
+    std::string submit(int priority, const std::vector<std::string>& args) {
+        auto job = std::make_shared<DaemonJob>();
+        std::vector<std::string> inputs;
+        if (!parseOptions(args, job->options, inputs) || inputs.size() != 1) {
+            return error("invalid job arguments");
+        }
+        job->videoPath = inputs[0];
+        if (job->videoPath == "-" || !job->options.daemonSocket.empty() || job->options.progressFd >= 0 ||
+            !job->options.benchOut.empty()) {
+            return error("stdin input, --daemon, --bench and --progress-fd are not available for daemon jobs");
+        }
+        if (!job->options.follow && access(job->videoPath.c_str(), F_OK) != 0) {
+            return error("file does not exist: " + job->videoPath);
+        }
+
+        // A followed input has no header yet, so its memory is unknown and
+        // it is admitted on threads alone
+        MediaInfo info;
+        if (!job->options.follow && probeMedia(job->videoPath, info)) {
+            job->memory = estimateJobMemory(info, job->options);
+        }
+        // The daemon's --memory-max is every job's default ceiling, and a
+        // ceiling bounds the job's memory for admission
+        if (job->options.memoryMax == 0) {
+            job->options.memoryMax = memoryMax_;
+        }
+        if (job->options.memoryMax > 0 && job->memory > 0) {
+            job->memory = std::min(job->memory, job->options.memoryMax);
+        }
+
+        // Tiers need the manifest to carry finished rungs into the second
+        // run, so a followed input runs in one
+        const auto qualities = getSubordinateQualities(info.height, *job->options.profile);
+        if (playableHeight_ > 0 && !qualities.empty() && qualities.front().second > playableHeight_ &&
+            qualities.back().second <= playableHeight_) {
+            job->tier = 0;
+            job->options.resume = true;
+        }
+        if (job->options.threadBudget == 0) {
+            job->options.threadBudget = std::max(1, cores_ / maxJobs_);
+        }
+        job->priority = priority;
+        job->options.progress = &job->progress;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return error("daemon is shutting down");
+        }
+        if (static_cast<int>(queue_.size()) >= queueSize_) {
+            metrics.count("process_video_daemon_submissions", metricLabel("result", "rejected"));
+            return error("queue full");
+        }
+        job->sequence = nextSequence_++;
+        job->id = std::to_string(job->sequence);
+        if (job->options.deadline > 0.0) {
+            job->deadlineAt = clock_.seconds() + job->options.deadline;
+        }
+        DaemonJob* raw = job.get();
+        job->progress.setSink([this, raw](const std::string& event) {
+            std::lock_guard<std::mutex> eventLock(mutex_);
+            raw->events.push_back(event);
+        });
+        jobs_[job->id] = job;
+        queue_.push_back(job);
+        metrics.count("process_video_daemon_submissions", metricLabel("result", "accepted"));
+        updateGauges();
+        changed_.notify_all();
+        return JsonObject().add("ok", true).add("id", job->id).add("position", queuePosition(*job))
+                           .add("threads", job->options.threadBudget).add("memory", job->memory)
+                           .add("tiers", job->tier == 0 ? 2 : 1).str();
+    }
+
+    // Queue order: higher priority, then the playable tier, then the
+    // earliest deadline, then the oldest submission
+    static bool outranks(const DaemonJob& a, const DaemonJob& b) {
+        if (a.priority != b.priority) {
+            return a.priority > b.priority;
+        }
+        if (a.tier != b.tier) {
+            return a.tier < b.tier;
+        }
+        if (a.deadlineAt != b.deadlineAt) {
+            return a.deadlineAt < b.deadlineAt;
+        }
+        return a.sequence < b.sequence;
+    }
+
+    // Jobs ahead of this one in the queue
+    int queuePosition(const DaemonJob& job) const {
+        int position = 0;
+        for (const auto& other : queue_) {
+            position += outranks(*other, job) ? 1 : 0;
+        }
+        return position;
+    }
+
+    // Ask the lowest-ranked running job that head beats by priority or tier
+    // to stop at its next boundary. One preemption is outstanding at a time.
+    void preemptFor(const DaemonJob& head) {
+        DaemonJob* victim = nullptr;
+        for (const auto& job : active_) {
+            if (job->preempt) {
+                return;
+            }
+            bool beaten = head.priority > job->priority || (head.priority == job->priority && head.tier < job->tier);
+            if (beaten && (!victim || outranks(*victim, *job))) {
+                victim = job.get();
+            }
+        }
+        if (victim) {
+            victim->preempt = true;
+            std::lock_guard<std::mutex> lock(logMutex);
+            std::cout << "Daemon: preempting job " << victim->id << " for job " << head.id << std::endl;
+        }
+    }
+
+    // Running jobs always leave room for one job, so an oversized job
+    // waits for the machine to drain instead of wedging the queue
+    bool admits(const DaemonJob& job) const {
+        if (running_ == 0) {
+            return true;
+        }
+        if (running_ >= maxJobs_ || runningThreads_ + job.options.threadBudget > cores_ || memoryPressure.high()) {
+            return false;
+        }
+        long long free = availableMemory();
+        return free < 0 || job.memory <= free;
+    }
+
+    // Start the head of the queue when it is admitted. The head is never
+    // skipped, so a large job is not starved by smaller ones behind it.
+    // Free memory changes on its own, so admission is rechecked every second.
+    void schedule() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            auto next = std::min_element(queue_.begin(), queue_.end(), [](const std::shared_ptr<DaemonJob>& a, const std::shared_ptr<DaemonJob>& b) {
+                return outranks(*a, *b);
+            });
+            if (next != queue_.end() && !admits(**next)) {
+                preemptFor(**next);
+            }
+            if (next == queue_.end() || !admits(**next)) {
+                changed_.wait_for(lock, std::chrono::seconds(1));
+                continue;
+            }
+            std::shared_ptr<DaemonJob> job = *next;
+            queue_.erase(next);
+            if (job->runs++ == 0) {
+                metrics.observe("process_video_queue_wait_seconds", "", job->submitted.seconds());
+            }
+            job->state = "running";
+            running_++;
+            runningThreads_ += job->options.threadBudget;
+            active_.push_back(job);
+            updateGauges();
+            std::thread(&JobDaemon::run, this, job).detach();
+        }
     }
-    std::cout << std::endl;
 
-    // Process each subordinate quality
-    for (const auto& q : subordinateQualities) {
-        std::string outFile = folderName + "/" + stem + " " + q.first + ".mp4";
-        std::string cmd = "ffmpeg -y -i \"" + videoPath + "\" -vf \"scale=-2:" + std::to_string(q.second) + "\" -c:a copy \"" + outFile + "\"";
-        std::cout << "Processing " << q.first << "p..." << std::endl;
-        
-        int result = system(cmd.c_str());
-        if (result == 0) {
-            std::cout << "✓ " << q.first << "p completed" << std::endl;
+    void run(std::shared_ptr<DaemonJob> job) {
+        bool playableTier = job->tier == 0;
+        {
+            std::lock_guard<std::mutex> lock(logMutex);
+            std::cout << "Daemon: job " << job->id << (playableTier ? " playable tier" : "") << " started ("
+                      << job->videoPath << ", " << job->options.threadBudget << " threads)" << std::endl;
+        }
+        ProcessOptions options = job->options;
+        options.preempt = &job->preempt;
+        if (playableTier) {
+            options.partial = true;
+            options.maxRungHeight = playableHeight_;
+        }
+        bool ok = runJob(job->videoPath, options);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_--;
+        runningThreads_ -= job->options.threadBudget;
+        active_.erase(std::find(active_.begin(), active_.end(), job));
+        bool preempted = job->preempt.exchange(false) && !ok;
+        if (preempted || (playableTier && ok)) {
+            // Back in the queue; the next run resumes from the manifest
+            if (preempted) {
+                metrics.count("process_video_preemptions");
+            }
+            job->playable = job->playable || (playableTier && ok);
+            job->tier = job->playable ? 1 : 0;
+            job->state = stopping_ ? "cancelled" : "queued";
+            if (!stopping_) {
+                queue_.push_back(job);
+            } else {
+                finish(job->id);
+            }
         } else {
-            std::cout << "✗ " << q.first << "p failed" << std::endl;
-            std::cerr << "✗ " << q.first << "p failed. Command was: " << cmd << std::endl;
+            job->state = ok ? "completed" : "failed";
+            finish(job->id);
         }
+        updateGauges();
+        changed_.notify_all();
     }
 
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-    double total_time = duration.count() / 1000.0;
+    // Called with mutex_ held whenever the queue or running set changes
+    void updateGauges() {
+        metrics.gauge("process_video_queue_depth", static_cast<double>(queue_.size()));
+        metrics.gauge("process_video_jobs_running", running_);
+    }
 
-    std::cout << "\nProcessing complete. Files saved in folder: " << folderName << std::endl;
-    std::cout << "Total processing time: " << std::fixed << std::setprecision(2) << total_time << " seconds" << std::endl;
+    // Keep the most recent finished jobs around for pollers
+    void finish(const std::string& id) {
+        finished_.push_back(id);
+        while (finished_.size() > 256) {
+            jobs_.erase(finished_.front());
+            finished_.pop_front();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::map<std::string, std::shared_ptr<DaemonJob>> jobs_;
+    std::vector<std::shared_ptr<DaemonJob>> queue_;
+    std::vector<std::shared_ptr<DaemonJob>> active_;
+    std::deque<std::string> finished_;
+    Stopwatch clock_;
+    int cores_;
+    int maxJobs_;
+    int queueSize_;
+    int playableHeight_;
+    long long memoryMax_;
+    int running_ = 0;
+    int runningThreads_ = 0;
+    unsigned long long nextSequence_ = 1;
+    bool stopping_ = false;
+};
+#endif
+
+// Raw value of a field in a flat JSON object built by JsonObject; string
+// values are returned without their quotes. Empty if the field is missing.
+std::string jsonField(const std::string& json, const std::string& key) {
+    std::string needle = "\"" + key + "\":";
+    size_t pos = json.find(needle);
+    if (pos == std::string::npos) {
+        return "";
+    }
+    pos += needle.size();
+    if (pos < json.size() && json[pos] == '"') {
+        size_t end = pos + 1;
+        while (end < json.size() && json[end] != '"') {
+            end += json[end] == '\\' ? 2 : 1;
+        }
+        return json.substr(pos + 1, end - pos - 1);
+    }
+    return json.substr(pos, json.find_first_of(",}", pos) - pos);
+}
+
+// CPU time of this process and its waited-for children (every ffmpeg run
+// through system() or popen()), and the peak RSS of each
+struct ResourceUsage {
+    double cpuSeconds = 0.0;
+    long long peakRssKb = -1;        // This process
+    long long childPeakRssKb = -1;   // Largest child so far, e.g. one ffmpeg
+};
+
+ResourceUsage resourceUsage() {
+    ResourceUsage usage;
+#ifdef _WIN32
+    // Child accounting is not available; only this process is measured
+    FILETIME created, exited, kernel, user;
+    if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+        auto seconds = [](const FILETIME& t) {
+            return ((static_cast<unsigned long long>(t.dwHighDateTime) << 32) | t.dwLowDateTime) / 1e7;
+        };
+        usage.cpuSeconds = seconds(kernel) + seconds(user);
+    }
+#else
+    rusage self{};
+    rusage children{};
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    auto seconds = [](const timeval& t) { return t.tv_sec + t.tv_usec / 1e6; };
+    usage.cpuSeconds = seconds(self.ru_utime) + seconds(self.ru_stime) + seconds(children.ru_utime) + seconds(children.ru_stime);
+#ifdef __APPLE__
+    usage.peakRssKb = self.ru_maxrss / 1024;   // Bytes on macOS
+    usage.childPeakRssKb = children.ru_maxrss / 1024;
+#else
+    usage.peakRssKb = self.ru_maxrss;
+    usage.childPeakRssKb = children.ru_maxrss;
+#endif
+#endif
+    return usage;
+}
+
+// Benchmark the pipeline: run each corpus input benchRuns times with the
+// selected options and write per-run stage timings, per-rung encode
+// timings and throughput, CPU utilization and peak RSS to options.benchOut
+// as JSON. Stage and rung timings come from the progress events. Outputs
+// are written to a scratch directory and deleted after every run.
+int runBenchmark(const std::vector<std::string>& corpus, ProcessOptions options) {
+    options.consumeInput = false;   // The corpus must survive every run
+    options.cacheDir.clear();       // Cache hits would time the cache, not the encoder
+    std::string outPath = absolutePath(options.benchOut);
+    std::string workDir = outPath + ".work";
+    std::vector<std::string> inputs;
+    for (const auto& input : corpus) {
+        if (access(input.c_str(), F_OK) != 0) {
+            std::cerr << "Error: Bench input does not exist: " << input << std::endl;
+            return 1;
+        }
+        inputs.push_back(absolutePath(input));
+    }
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)) || !ensureDirectory(workDir) || chdir(workDir.c_str()) != 0) {
+        std::cerr << "Error: Could not enter bench directory: " << workDir << std::endl;
+        return 1;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    int cores = resolveThreadBudget(0);
+    std::string runs;
+    std::string summary;
+    bool allOk = true;
+    for (size_t n = 0; n < inputs.size(); n++) {
+        std::vector<double> walls;
+        for (int run = 1; run <= options.benchRuns; run++) {
+            // Timestamp every progress event as it arrives
+            std::vector<std::pair<double, std::string>> events;
+            Clock::time_point start = Clock::now();
+            ProgressReporter recorder;
+            recorder.setSink([&](const std::string& event) {
+                events.push_back({std::chrono::duration<double>(Clock::now() - start).count(), event});
+            });
+            ProcessOptions runOptions = options;
+            runOptions.progress = &recorder;
+
+            ResourceUsage before = resourceUsage();
+            start = Clock::now();
+            bool ok = processVideo(inputs[n], runOptions, nullptr);
+            double wall = std::chrono::duration<double>(Clock::now() - start).count();
+            ResourceUsage after = resourceUsage();
+            removeTree(outputFolder(getFilenameStem(inputs[n]), options));
+            allOk = allOk && ok;
+            walls.push_back(wall);
+
+            // Stage boundaries and per-rung spans from the event stream
+            double probe = -1.0;
+            double copy = -1.0;
+            std::map<std::string, double> rungStart;
+            std::map<std::string, std::string> lastProgress;
+            std::string rungs;
+            for (const auto& entry : events) {
+                const std::string& event = entry.second;
+                std::string type = jsonField(event, "event");
+                std::string task = jsonField(event, "task");
+                if (type == "stage" && jsonField(event, "stage") == "probe") {
+                    probe = entry.first;
+                } else if (type == "stage" && jsonField(event, "stage") == "original") {
+                    copy = entry.first - std::max(0.0, probe);
+                } else if (type == "rung_start") {
+                    rungStart[task] = entry.first;
+                } else if (type == "progress") {
+                    lastProgress[task] = event;
+                } else if (type == "rung_done") {
+                    const std::string& last = lastProgress[task];
+                    double rungWall = entry.first - (rungStart.count(task) ? rungStart[task] : 0.0);
+                    long long frames = std::atoll(jsonField(last, "frame").c_str());
+                    JsonObject rung;
+                    rung.add("task", task).add("wall", rungWall).add("frames", frames)
+                        .add("fps", rungWall > 0.0 ? frames / rungWall : 0.0)
+                        .add("speed", std::atof(jsonField(last, "speed").c_str()))
+                        .add("bytes", std::atoll(jsonField(event, "bytes").c_str()))
+                        .add("ok", jsonField(event, "ok") == "true");
+                    rungs += (rungs.empty() ? "" : ",") + rung.str();
+                }
+            }
+
+            double cpu = after.cpuSeconds - before.cpuSeconds;
+            JsonObject result;
+            result.add("input", corpus[n]).add("run", run).add("ok", ok).add("wall", wall)
+                  .add("probe", probe).add("copy", copy).add("cpu", cpu)
+                  .add("cpu_utilization", wall > 0.0 ? cpu / (wall * cores) : 0.0)
+                  .add("peak_rss_kb", after.peakRssKb).add("child_peak_rss_kb", after.childPeakRssKb)
+                  .addRaw("rungs", "[" + rungs + "]");
+            runs += (runs.empty() ? "" : ",") + result.str();
+            std::cout << "Bench " << corpus[n] << " run " << run << "/" << options.benchRuns << ": "
+                      << std::fixed << std::setprecision(2) << wall << " s wall, " << cpu << " s CPU"
+                      << (ok ? "" : " (failed)") << std::endl;
+        }
+
+        std::sort(walls.begin(), walls.end());
+        JsonObject entry;
+        entry.add("input", corpus[n]).add("runs", options.benchRuns).add("wall_min", walls.front())
+             .add("wall_median", walls[walls.size() / 2]).add("wall_max", walls.back());
+        summary += (summary.empty() ? "" : ",") + entry.str();
+    }
+
+    if (chdir(cwd) != 0) {
+        std::cerr << "Warning: Could not return to " << cwd << std::endl;
+    }
+    removeTree(workDir);
+
+    std::string modes = options.cascade ? "cascade" : options.singleDecode ? "single-decode" : options.parallel ? "parallel" : "serial";
+    JsonObject report;
+    report.add("encoder", encoderVersion()).add("cores", cores).add("mode", modes).add("hwaccel", options.hwaccel)
+          .add("chunks", options.chunks).add("per_title", options.perTitle)
+          .add("profile", options.profile->name)
+          .add("timestamp", static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(
+              std::chrono::system_clock::now().time_since_epoch()).count()))
+          .addRaw("summary", "[" + summary + "]").addRaw("runs", "[" + runs + "]");
+    std::ofstream out(outPath);
+    out << report.str() << "\n";
+    if (!out) {
+        std::cerr << "Error: Could not write bench results to " << outPath << std::endl;
+        return 1;
+    }
+    std::cout << "Bench results written to " << outPath << std::endl;
+    return allOk ? 0 : 1;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: process_video <video_path>\n";
+    ProcessOptions options;
+    std::vector<std::string> inputs;
+
+    if (!parseOptions(std::vector<std::string>(argv + 1, argv + argc), options, inputs)) {
+        return 1;
+    }
+    if (options.progressFd >= 0 && !progressStream.open(options.progressFd)) {
+        std::cerr << "Error: Could not open progress fd " << options.progressFd << std::endl;
+        return 1;
+    }
+    // Affinity and priorities are process-wide and inherited by every thread
+    // and ffmpeg started after this, so daemon jobs cannot change them
+    if (!applyProcessLimits(options)) {
+        return 1;
+    }
+    memoryPressure.configure(options.psiLimit);
+
+    // Dump metrics however main returns
+    struct MetricsDump {
+        std::string path;
+        ~MetricsDump() {
+            if (!path.empty()) {
+                std::ofstream(path) << metrics.render();
+            }
+        }
+    } metricsDump{options.metricsOut};
+
+    if (!options.worker.empty() || !options.coordinate.empty()) {
+#ifdef _WIN32
+        std::cerr << "Error: distributed encoding is not available on Windows" << std::endl;
+        return 1;
+#else
+        if (!options.worker.empty()) {
+            return runWorker(options);
+        }
+        if (!workerPool.listen(options.coordinate)) {
+            return 1;
+        }
+#endif
+    }
+
+    if (!options.daemonSocket.empty()) {
+#ifdef _WIN32
+        std::cerr << "Error: --daemon requires Unix domain sockets and is not available on Windows" << std::endl;
+        return 1;
+#else
+        return JobDaemon(options).serve(options.daemonSocket);
+#endif
+    }
+
+    if (!options.benchOut.empty()) {
+        // The repo's sample clip is the default corpus
+        return runBenchmark(inputs.empty() ? std::vector<std::string>{"video.mp4"} : inputs, options);
+    }
+
+    if (!options.batch.empty()) {
+        return runBatch(options, inputs);
+    }
+
+    std::string videoPath = inputs.size() == 1 ? inputs[0] : "";
+    if (videoPath.empty()) {
+        std::cerr << "Usage: process_video [--single-decode | --cascade | --parallel] [options] <video_path>\n";
         std::cerr << "Example: process_video.exe video.mp4\n";
+        std::cerr << "  --single-decode   Decode the input once and encode all rungs in one ffmpeg pass\n";
+        std::cerr << "  --cascade         Like --single-decode, deriving each rung from the nearest higher rung\n";
+        std::cerr << "  --ssim-tolerance T  Max SSIM loss a cascaded rung may accumulate (default 0.01)\n";
+        std::cerr << "  --parallel        Run rungs concurrently, most expensive first\n";
+        std::cerr << "  --threads N       Cap total encoder threads (default: all cores)\n";
+        std::cerr << "  --consume-input   Allow moving the input into place as the original rung\n";
+        std::cerr << "  --hwaccel B       Encode backend: none, auto, nvenc, qsv, vaapi, videotoolbox\n";
+        std::cerr << "  --hw-sessions N   Concurrent hardware encoder sessions before falling back to libx264\n";
+        std::cerr << "  --package F       Package the ladder as CMAF segments: hls, dash or both\n";
+        std::cerr << "  --segment-seconds N  Segment duration and keyframe interval when packaging (default 4)\n";
+        std::cerr << "  --follow          Input is still being written; finish on <input>.done or when idle\n";
+        std::cerr << "  --follow-idle S   Seconds without growth before a followed input is complete (default 30)\n";
+        std::cerr << "  --name STEM       Output name when reading the input from stdin ('-')\n";
+        std::cerr << "  --chunks N        Split rungs into N keyframe-aligned chunks encoded concurrently\n";
+        std::cerr << "  --chunk-min-height H  Only chunk rungs at or above this height (default 720)\n";
+        std::cerr << "  --progress-fd N   Write newline-delimited JSON progress events to fd N\n";
+        std::cerr << "  --per-title       Choose rungs and bitrate caps from short CRF trial encodes\n";
+        std::cerr << "  --two-pass        Target bitrates and zones for every rung from one shared 144p first pass\n";
+        std::cerr << "  --cache DIR       Reuse outputs of identical inputs from a content-addressed cache\n";
+        std::cerr << "  --bench OUT.json  Time the pipeline over the given inputs (default video.mp4) and write JSON\n";
+        std::cerr << "  --bench-runs N    Bench: runs per input (default 3)\n";
+        std::cerr << "  --metrics-out F   Write OpenMetrics counters and histograms to F at exit\n";
+        std::cerr << "  --deadline S      Daemon: finish this job within S seconds of submission if possible\n";
+        std::cerr << "  --playable-height H  Daemon: encode rungs up to H for every job first (default 360, 0 = off)\n";
+        std::cerr << "  --output-dir DIR  Write output folders under DIR instead of the current directory\n";
+        std::cerr << "  --offload CMD     Upload each finished output with CMD ({file}, {key} are substituted)\n";
+        std::cerr << "  --offload-jobs N  Uploads running at once (default 2)\n";
+        std::cerr << "  --disk-quota SIZE Evict least recently used finished folders beyond SIZE (e.g. 50G)\n";
+        std::cerr << "  --audio MODE      Shared audio for every rung: copy (default), aac or opus\n";
+        std::cerr << "  --loudnorm        Loudness-normalize the shared audio to -16 LUFS\n";
+        std::cerr << "  --previews        Write a poster, seek-preview sprite and WebVTT track from the ladder decode\n";
+        std::cerr << "  --sprite-interval S  Seconds between sprite tiles (default 10)\n";
+        std::cerr << "  --fps-cap H:F     Rungs at or below H keep at most F fps by dropping frames (default 480:30, or off)\n";
+        std::cerr << "  --quality-metrics L  Score rungs on sampled windows: ssim, psnr and/or vmaf\n";
+        std::cerr << "  --quality-floor M:V  Re-encode a rung once with more bits if it scores under V, e.g. vmaf:85\n";
+        std::cerr << "  --cpus LIST       CPUs the runner and its encoders may use, e.g. 0-7\n";
+        std::cerr << "  --nice N          Niceness of the runner and every ffmpeg it starts\n";
+        std::cerr << "  --ioprio C        I/O priority of every ffmpeg: idle or best-effort[:0-7]\n";
+        std::cerr << "  --memory-max SIZE Memory ceiling per job's encoders via cgroup v2 (e.g. 4G)\n";
+        std::cerr << "  --psi-limit P     Hold new rungs while memory pressure exceeds P% (default 25, or off)\n";
+        std::cerr << "  --batch SPEC      Process a list file, directory or glob of inputs with one shared encoder pool\n";
+        std::cerr << "  --batch-jobs N    Batch: inputs in flight at once (default: a quarter of the thread budget)\n";
+        std::cerr << "  --resume          Skip rungs and chunks a previous run of this job finished\n";
+        std::cerr << "  --codecs LIST     Ladder codecs, e.g. h264,av1@720 for AV1 from 720p up (default h264)\n";
+        std::cerr << "  --profile P       Ladder profile: default, mobile, premium, profiles/P.json or a JSON file\n";
+        std::cerr << "  --codec-threads L Encoder threads per codec pool, e.g. h264=4,av1=12 (default: even split)\n";
+        std::cerr << "  --coordinate ADDR Listen on [HOST:]PORT for workers and encode every task on them\n";
+        std::cerr << "  --worker ADDR     Pull encode tasks from the coordinator at HOST:PORT until stopped\n";
+        std::cerr << "  --worker-slots N  Worker: tasks encoded at once (default 1)\n";
+        std::cerr << "  --path-map F=T    Worker: shared storage mounted at T here is at F on the coordinator\n";
+        std::cerr << "  --daemon SOCKET   Serve queued jobs on a Unix socket instead of processing one input\n";
+        std::cerr << "  --max-jobs N      Daemon: jobs encoding at once (default 2)\n";
+        std::cerr << "  --queue-size N    Daemon: queued jobs before submissions are rejected (default 64)\n";
         return 1;
     }
     
-    if (access(argv[1], F_OK) != 0) {
-        std::cerr << "Error: File does not exist: " << argv[1] << std::endl;
+    // "-" reads the input from stdin, spooling it to a growing file the
+    // encoders follow; the spool becomes the original rung afterwards
+    if (videoPath == "-") {
+        std::string stem = options.name.empty() ? "stdin" : options.name;
+        std::string spoolPath = stem + ".ingest";
+        std::ofstream spool(spoolPath, std::ios::binary | std::ios::trunc);
+        if (!spool) {
+            std::cerr << "Error: Could not create spool file: " << spoolPath << std::endl;
+            return 1;
+        }
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        GrowingInput growing(spoolPath, options.followIdleSeconds);
+        std::thread spooler([&] {
+            std::vector<char> buffer(1 << 20);
+            size_t n;
+            while ((n = fread(buffer.data(), 1, buffer.size(), stdin)) > 0) {
+                spool.write(buffer.data(), static_cast<std::streamsize>(n));
+                spool.flush();
+            }
+            spool.close();
+            growing.markComplete();
+        });
+
+        options.consumeInput = true;
+        bool ok = processVideo(spoolPath, options, &growing);
+        spooler.join();
+        remove(spoolPath.c_str());
+        return ok ? 0 : 1;
+    }
+
+    if (!options.follow && access(videoPath.c_str(), F_OK) != 0) {
+        std::cerr << "Error: File does not exist: " << videoPath << std::endl;
         return 1;
     }
     
-    processVideo(argv[1]);
-    return 0;
+    return runJob(videoPath, options) ? 0 : 1;
 }
\ No newline at end of file
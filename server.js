@@ -5,6 +5,9 @@ const { spawn } = require('child_process');
 const { v4: uuidv4 } = require('uuid');
 const fs = require('fs');
 const path = require('path');
+const readline = require('readline');
+const net = require('net');
+const os = require('os');
 
 const app = express();
 const PORT = process.env.PORT || 3000;
@@ -17,6 +20,39 @@ app.use(express.static('public'));
 // Create directories if they don't exist
 const uploadsDir = path.join(__dirname, 'uploads');
 const outputsDir = path.join(__dirname, 'outputs');
+// Content-addressed cache; re-uploads of the same bytes are linked from here
+const cacheDir = process.env.PROCESS_VIDEO_CACHE || path.join(__dirname, 'cache');
+
+// Output folders live under a scratch root. Finished outputs can be offloaded
+// to object storage with a command template, and local copies evicted under a
+// disk quota; downloads of evicted files redirect to PROCESS_VIDEO_OFFLOAD_URL.
+const outputRoot = process.env.PROCESS_VIDEO_OUTPUT || __dirname;
+const offloadCommand = process.env.PROCESS_VIDEO_OFFLOAD;
+const offloadUrl = process.env.PROCESS_VIDEO_OFFLOAD_URL;
+const diskQuota = process.env.PROCESS_VIDEO_DISK_QUOTA;
+
+// Behind nginx, downloads can be handed back with X-Accel-Redirect to an
+// internal location aliased to the output root, so nginx serves the bytes
+// and ranges with sendfile instead of streaming them through Node
+const accelRedirect = process.env.PROCESS_VIDEO_ACCEL_REDIRECT;
+
+// Encodes run niced and at low I/O priority by default so the API stays
+// responsive; cores, a per-job memory ceiling and the memory pressure at
+// which rungs back off can be set too
+function governanceArgs() {
+    const args = ['--nice', process.env.PROCESS_VIDEO_NICE || '10',
+                  '--ioprio', process.env.PROCESS_VIDEO_IOPRIO || 'best-effort:7'];
+    if (process.env.PROCESS_VIDEO_CPUS) {
+        args.push('--cpus', process.env.PROCESS_VIDEO_CPUS);
+    }
+    if (process.env.PROCESS_VIDEO_MEMORY_MAX) {
+        args.push('--memory-max', process.env.PROCESS_VIDEO_MEMORY_MAX);
+    }
+    if (process.env.PROCESS_VIDEO_PSI_LIMIT) {
+        args.push('--psi-limit', process.env.PROCESS_VIDEO_PSI_LIMIT);
+    }
+    return args;
+}
 
 if (!fs.existsSync(uploadsDir)) {
     fs.mkdirSync(uploadsDir, { recursive: true });
@@ -32,6 +68,10 @@ const storage = multer.diskStorage({
     },
     filename: (req, file, cb) => {
         const uniqueName = uuidv4() + path.extname(file.originalname);
+        if (req.query.autoProcess === 'true') {
+            // Start encoding while multer is still writing the file
+            req.earlyJob = startProgressiveJob(file, path.join(uploadsDir, uniqueName));
+        }
         cb(null, uniqueName);
     }
 });
@@ -54,6 +94,83 @@ const upload = multer({
 // In-memory job storage (use database in production)
 const jobs = new Map();
 
+// Jobs are queued on one long-running process_video daemon, which admits
+// them by available cores and memory. Windows has no daemon mode and
+// spawns one process per job instead.
+const daemonSocket = process.env.PROCESS_VIDEO_SOCKET || path.join(os.tmpdir(), 'process_video.sock');
+const useDaemon = process.platform !== 'win32' && process.env.PROCESS_VIDEO_DAEMON !== '0';
+let daemon = null;
+
+function startDaemon() {
+    const executablePath = path.join(__dirname, 'process_video.exe');
+    if (!useDaemon || !fs.existsSync(executablePath)) {
+        return;
+    }
+
+    const daemonArgs = ['--daemon', daemonSocket, '--max-jobs', process.env.PROCESS_VIDEO_MAX_JOBS || '2', ...governanceArgs()];
+    if (process.env.PROCESS_VIDEO_COORDINATE) {
+        daemonArgs.push('--coordinate', process.env.PROCESS_VIDEO_COORDINATE);
+    }
+    if (process.env.PROCESS_VIDEO_PLAYABLE_HEIGHT) {
+        daemonArgs.push('--playable-height', process.env.PROCESS_VIDEO_PLAYABLE_HEIGHT);
+    }
+    daemon = spawn(executablePath, daemonArgs, {
+        cwd: __dirname,
+        stdio: ['ignore', 'pipe', 'pipe']
+    });
+    daemon.stdout.on('data', (data) => console.log(`[daemon] ${data.toString().trim()}`));
+    daemon.stderr.on('data', (data) => console.error(`[daemon] ${data.toString().trim()}`));
+    daemon.on('exit', (code) => {
+        console.warn(`[daemon] exited with code ${code}, restarting`);
+        daemon = null;
+        setTimeout(startDaemon, 1000);
+    });
+}
+
+// Send one tab-separated request to the daemon and resolve its JSON reply
+function daemonRequest(fields) {
+    return new Promise((resolve, reject) => {
+        const socket = net.createConnection(daemonSocket);
+        let buffer = '';
+        socket.on('connect', () => socket.write(fields.join('\t') + '\n'));
+        socket.on('data', (data) => {
+            buffer += data.toString();
+            const newline = buffer.indexOf('\n');
+            if (newline >= 0) {
+                socket.end();
+                try {
+                    resolve(JSON.parse(buffer.slice(0, newline)));
+                } catch (error) {
+                    reject(error);
+                }
+            }
+        });
+        socket.on('error', reject);
+    });
+}
+
+// Create a job for an upload that is still arriving and start the C++
+// process in --follow mode; the upload route writes the .done marker
+function startProgressiveJob(file, filepath) {
+    const now = new Date().toISOString();
+    const job = {
+        id: uuidv4(),
+        filename: file.originalname,
+        filepath: filepath,
+        filesize: 0,
+        status: 'processing',
+        uploadedAt: now,
+        startedAt: now,
+        progress: 10,
+        message: 'Processing while uploading...',
+        follow: true
+    };
+
+    jobs.set(job.id, job);
+    processVideoAsync(job);
+    return job;
+}
+
 // Routes
 
 // Serve the main page
@@ -61,13 +178,46 @@ app.get('/', (req, res) => {
     res.sendFile(path.join(__dirname, 'public', 'index.html'));
 });
 
-// Health check
-app.get('/api/health', (req, res) => {
-    res.json({ 
-        status: 'healthy', 
+// Health check, with queue state and pipeline metrics from the daemon
+app.get('/api/health', async (req, res) => {
+    const health = {
+        status: 'healthy',
         timestamp: new Date().toISOString(),
         version: '1.0.0'
-    });
+    };
+
+    if (daemon) {
+        try {
+            const [stats, metrics] = await Promise.all([daemonRequest(['STATS']), daemonRequest(['METRICS'])]);
+            health.queue = {
+                queued: stats.queued,
+                running: stats.running,
+                maxJobs: stats.max_jobs,
+                threadsReserved: stats.threads_reserved,
+                threads: stats.threads,
+                memoryAvailable: stats.memory_available
+            };
+            health.metrics = parseOpenMetrics(metrics.metrics);
+        } catch (error) {
+            health.status = 'degraded';
+            health.error = `Daemon unreachable: ${error.message}`;
+        }
+    }
+
+    res.json(health);
+});
+
+// Raw OpenMetrics text for Prometheus-compatible scrapers
+app.get('/api/health/metrics', async (req, res) => {
+    if (!daemon) {
+        return res.status(503).json({ error: 'Metrics require the processing daemon' });
+    }
+    try {
+        const reply = await daemonRequest(['METRICS']);
+        res.type('application/openmetrics-text; version=1.0.0; charset=utf-8').send(reply.metrics);
+    } catch (error) {
+        res.status(503).json({ error: `Daemon unreachable: ${error.message}` });
+    }
 });
 
 // Upload video
@@ -77,6 +227,18 @@ app.post('/api/upload', upload.single('video'), (req, res) => {
             return res.status(400).json({ error: 'No video file uploaded' });
         }
 
+        if (req.earlyJob) {
+            // Tell the follow-mode process the input is complete
+            req.earlyJob.filesize = req.file.size;
+            fs.writeFileSync(req.file.path + '.done', '');
+            return res.json({
+                jobId: req.earlyJob.id,
+                message: 'Video uploaded, processing started during upload',
+                filename: req.file.originalname,
+                filesize: req.file.size
+            });
+        }
+
         const jobId = uuidv4();
         const job = {
             id: jobId,
@@ -117,6 +279,70 @@ app.post('/api/process/:jobId', (req, res) => {
         return res.status(400).json({ error: 'Job already processed or in progress' });
     }
 
+    // Optional streaming packaging: 'hls', 'dash' or 'both'
+    const { package: packaging } = req.body || {};
+    if (packaging && !['hls', 'dash', 'both'].includes(packaging)) {
+        return res.status(400).json({ error: 'package must be one of hls, dash, both' });
+    }
+    job.packaging = packaging;
+
+    // Optional queue priority; higher runs first
+    const priority = req.body && req.body.priority !== undefined ? Number(req.body.priority) : 0;
+    if (!Number.isInteger(priority)) {
+        return res.status(400).json({ error: 'priority must be an integer' });
+    }
+    job.priority = priority;
+
+    // Optional deadline in seconds; earlier deadlines run first within a priority
+    if (req.body && req.body.deadline !== undefined) {
+        const deadline = Number(req.body.deadline);
+        if (!(deadline > 0)) {
+            return res.status(400).json({ error: 'deadline must be a positive number of seconds' });
+        }
+        job.deadline = deadline;
+    }
+
+    // Optional per-title ladder from CRF trial encodes
+    job.perTitle = Boolean(req.body && req.body.perTitle);
+
+    // Optional ladder profile: a built-in preset or profiles/<name>.json
+    const profile = (req.body && req.body.profile) || process.env.PROCESS_VIDEO_PROFILE;
+    if (profile) {
+        if (typeof profile !== 'string' || !/^[\w-]+$/.test(profile)) {
+            return res.status(400).json({ error: 'profile must be a preset or profile file name, e.g. "mobile"' });
+        }
+        job.profile = profile;
+    }
+
+    // Optional extra ladder codecs, e.g. "h264,av1@720"
+    if (req.body && req.body.codecs !== undefined) {
+        if (typeof req.body.codecs !== 'string' || !/^(h264|hevc|vp9|av1)(@\d+)?(,(h264|hevc|vp9|av1)(@\d+)?)*$/.test(req.body.codecs)) {
+            return res.status(400).json({ error: 'codecs must list h264, hevc, vp9 or av1, e.g. "h264,av1@720"' });
+        }
+        job.codecs = req.body.codecs;
+    }
+
+    // Optional bitrate targets from one shared first pass
+    job.twoPass = Boolean(req.body && req.body.twoPass);
+
+    // Optional loudness normalization of the shared audio
+    job.loudnorm = Boolean(req.body && req.body.loudnorm);
+
+    // Optional sampled quality scores per rung, e.g. "ssim,psnr", and a
+    // floor under which a rung is re-encoded with more bits, e.g. "vmaf:85"
+    if (req.body && req.body.qualityMetrics !== undefined) {
+        if (typeof req.body.qualityMetrics !== 'string' || !/^(ssim|psnr|vmaf)(,(ssim|psnr|vmaf))*$/.test(req.body.qualityMetrics)) {
+            return res.status(400).json({ error: 'qualityMetrics must list ssim, psnr or vmaf, e.g. "ssim,psnr"' });
+        }
+        job.qualityMetrics = req.body.qualityMetrics;
+    }
+    if (req.body && req.body.qualityFloor !== undefined) {
+        if (typeof req.body.qualityFloor !== 'string' || !/^(ssim|psnr|vmaf):\d+(\.\d+)?$/.test(req.body.qualityFloor)) {
+            return res.status(400).json({ error: 'qualityFloor must be METRIC:VALUE, e.g. "vmaf:85"' });
+        }
+        job.qualityFloor = req.body.qualityFloor;
+    }
+
     // Update job status
     job.status = 'processing';
     job.startedAt = new Date().toISOString();
@@ -133,6 +359,40 @@ app.post('/api/process/:jobId', (req, res) => {
     });
 });
 
+// Retry a failed job; rungs the failed attempt finished are not encoded again
+app.post('/api/retry/:jobId', (req, res) => {
+    const { jobId } = req.params;
+    const job = jobs.get(jobId);
+
+    if (!job) {
+        return res.status(404).json({ error: 'Job not found' });
+    }
+
+    if (job.status !== 'failed') {
+        return res.status(400).json({ error: 'Only failed jobs can be retried' });
+    }
+
+    if (!fs.existsSync(job.filepath)) {
+        return res.status(410).json({ error: 'Uploaded file is no longer available' });
+    }
+
+    job.status = 'processing';
+    job.startedAt = new Date().toISOString();
+    job.progress = 10;
+    job.message = 'Retrying video processing...';
+    job.error = undefined;
+    job.retries = (job.retries || 0) + 1;
+
+    processVideoAsync(job);
+
+    res.json({
+        jobId: jobId,
+        message: 'Retry started',
+        status: 'processing',
+        retries: job.retries
+    });
+});
+
 // Get job status
 app.get('/api/status/:jobId', (req, res) => {
     const { jobId } = req.params;
@@ -152,8 +412,13 @@ app.get('/api/status/:jobId', (req, res) => {
         completedAt: job.completedAt,
         progress: job.progress,
         message: job.message,
+        rungs: job.rungs,
+        scores: job.scores,
         outputFolder: job.outputFolder,
         processedFiles: job.processedFiles,
+        streams: job.streams,
+        previews: job.previews,
+        playable: Boolean(job.playable),
         error: job.error
     });
 });
@@ -166,7 +431,8 @@ app.get('/api/jobs', (req, res) => {
         status: job.status,
         uploadedAt: job.uploadedAt,
         progress: job.progress,
-        message: job.message
+        message: job.message,
+        poster: job.previews && job.previews.poster
     }));
 
     res.json({ jobs: jobList });
@@ -185,35 +451,59 @@ app.get('/api/download/:jobId/:quality?', (req, res) => {
         return res.status(400).json({ error: 'Job not completed yet' });
     }
 
-    if (!job.outputFolder || !fs.existsSync(job.outputFolder)) {
+    if (!job.outputFolder) {
         return res.status(404).json({ error: 'Output files not found' });
     }
 
-    try {
-        const files = fs.readdirSync(job.outputFolder);
-        let targetFile = null;
-
-        if (quality) {
-            // Find specific quality file
-            targetFile = files.find(f => f.includes(` ${quality}.mp4`));
-            if (!targetFile) {
-                return res.status(404).json({ error: `Quality ${quality} not found` });
-            }
-        } else {
-            // Return first MP4 file
-            targetFile = files.find(f => f.endsWith('.mp4'));
-            if (!targetFile) {
-                return res.status(404).json({ error: 'No video files found' });
-            }
-        }
+    // Rungs are looked up in the index the pipeline wrote; the folder is
+    // never scanned per request. quality is a rung label, e.g. "720" or "720-av1".
+    const rungs = (job.index && job.index.rungs) || [];
+    const label = quality && quality.replace(/p(?=-|$)/, '');
+    const entry = quality ? rungs.find(r => r.label === label) : (rungs.find(r => r.original) || rungs[0]);
+    if (!entry) {
+        return res.status(404).json({ error: quality ? `Quality ${quality} not found` : 'No video files found' });
+    }
 
-        const filePath = path.join(job.outputFolder, targetFile);
-        res.download(filePath);
+    touchOutput(job);
+    if (accelRedirect) {
+        const location = [path.basename(job.outputFolder), entry.file].map(encodeURIComponent).join('/');
+        res.attachment(entry.file);
+        res.set({ 'Content-Type': entry.mime, 'X-Accel-Redirect': `${accelRedirect.replace(/\/$/, '')}/${location}` });
+        return res.end();
+    }
 
-    } catch (error) {
+    // send answers Range requests with 206 partial content, so players seek
+    // in place; faststart rungs need only the first range to start
+    res.download(path.join(job.outputFolder, entry.file), entry.file, { headers: { 'Content-Type': entry.mime } }, (error) => {
+        if (!error || res.headersSent) {
+            return;
+        }
+        if (error.code === 'ENOENT' && offloadUrl) {
+            // Evicted under the disk quota; the offloaded copy is still available
+            return res.redirect(offloadedUrl(job, entry.file));
+        }
         console.error('Download error:', error);
-        res.status(500).json({ error: 'Download failed' });
+        res.status(error.status || 404).json({ error: 'Output files not found' });
+    });
+});
+
+// Serve HLS/DASH playlists and segments from the job's output folder
+app.get('/api/stream/:jobId/*', (req, res) => {
+    const job = jobs.get(req.params.jobId);
+
+    if (!job || !job.outputFolder) {
+        return res.status(404).json({ error: 'Job not found' });
     }
+
+    // sendFile with a root rejects paths that escape the output folder
+    touchOutput(job);
+    res.sendFile(req.params[0], { root: job.outputFolder }, (error) => {
+        if (error && !res.headersSent && offloadUrl && error.status === 404 && !fs.existsSync(job.outputFolder)) {
+            res.redirect(offloadedUrl(job, req.params[0]));
+        } else if (error && !res.headersSent) {
+            res.status(error.status || 404).json({ error: 'Stream file not found' });
+        }
+    });
 });
 
 // Delete job
@@ -254,68 +544,96 @@ async function processVideoAsync(job) {
         job.progress = 20;
         job.message = 'Analyzing video...';
 
+        // --resume keeps rungs a failed or interrupted earlier attempt finished
+        const args = ['--cache', cacheDir, '--resume', '--previews', '--output-dir', outputRoot];
+        if (offloadCommand) {
+            args.push('--offload', offloadCommand);
+        }
+        if (diskQuota) {
+            args.push('--disk-quota', diskQuota);
+        }
+        // The daemon was started with these and applies them to every job
+        if (!daemon) {
+            args.push(...governanceArgs());
+        }
+        if (job.follow) {
+            args.push('--follow');
+        }
+        // The profile goes first so explicit options override its defaults
+        if (job.profile) {
+            args.push('--profile', job.profile);
+        }
+        if (job.packaging) {
+            args.push('--package', job.packaging);
+        }
+        if (job.loudnorm) {
+            args.push('--loudnorm');
+        }
+        if (job.perTitle) {
+            args.push('--per-title');
+        }
+        if (job.twoPass) {
+            args.push('--two-pass');
+        }
+        if (job.codecs) {
+            args.push('--codecs', job.codecs);
+        }
+        if (job.qualityMetrics) {
+            args.push('--quality-metrics', job.qualityMetrics);
+        }
+        if (job.qualityFloor) {
+            args.push('--quality-floor', job.qualityFloor);
+        }
+        if (job.deadline) {
+            args.push('--deadline', String(job.deadline));
+        }
+        args.push(job.filepath);
+
+        if (daemon) {
+            const reply = await daemonRequest(['SUBMIT', String(job.priority || 0), ...args]);
+            if (!reply.ok) {
+                throw new Error(reply.error);
+            }
+            job.daemonId = reply.id;
+            job.rungs = {};
+            job.message = `Queued (position ${reply.position + 1})`;
+            pollDaemonJob(job);
+            return;
+        }
+
+        // Structured progress events arrive as NDJSON on fd 3
+        args.splice(args.length - 1, 0, '--progress-fd', '3');
+
         // Run the C++ process
-        const process = spawn(executablePath, [job.filepath], {
+        const process = spawn(executablePath, args, {
             cwd: __dirname,
-            stdio: ['pipe', 'pipe', 'pipe']
+            stdio: ['pipe', 'pipe', 'pipe', 'pipe']
         });
+        job.child = process;
+        job.rungs = {};
 
-        let stdout = '';
         let stderr = '';
 
-        process.stdout.on('data', (data) => {
-            const output = data.toString();
-            stdout += output;
-            console.log(`[${job.id}] ${output.trim()}`);
-
-            // Parse progress from output
-            if (output.includes('Processing')) {
-                job.progress = Math.min(job.progress + 15, 85);
-                const match = output.match(/Processing (\d+)p/);
-                if (match) {
-                    job.message = `Processing ${match[1]}p quality...`;
-                }
-            }
-            
-            if (output.includes('completed')) {
-                job.progress = Math.min(job.progress + 5, 90);
+        readline.createInterface({ input: process.stdio[3] }).on('line', (line) => {
+            try {
+                handleProgressEvent(job, JSON.parse(line));
+            } catch (error) {
+                console.warn(`[${job.id}] Bad progress event: ${line}`);
             }
         });
 
+        process.stdout.on('data', (data) => {
+            console.log(`[${job.id}] ${data.toString().trim()}`);
+        });
+
         process.stderr.on('data', (data) => {
             stderr += data.toString();
             console.error(`[${job.id}] ${data.toString().trim()}`);
         });
 
         process.on('close', (code) => {
-            if (code === 0) {
-                // Success
-                job.status = 'completed';
-                job.completedAt = new Date().toISOString();
-                job.progress = 100;
-                job.message = 'Video processing completed successfully';
-
-                // Find output folder
-                const stem = path.basename(job.filepath, path.extname(job.filepath));
-                const outputFolder = path.join(__dirname, stem);
-                
-                if (fs.existsSync(outputFolder)) {
-                    job.outputFolder = outputFolder;
-                    job.processedFiles = fs.readdirSync(outputFolder)
-                        .filter(f => f.endsWith('.mp4'))
-                        .map(f => ({
-                            filename: f,
-                            quality: extractQuality(f)
-                        }));
-                }
-
-                console.log(`[${job.id}] Processing completed successfully`);
-            } else {
-                // Error
-                job.status = 'failed';
-                job.progress = 0;
-                job.error = stderr || 'Processing failed with unknown error';
-                job.message = 'Video processing failed';
+            finishJob(job, code === 0, stderr || 'Processing failed with unknown error');
+            if (code !== 0) {
                 console.error(`[${job.id}] Processing failed with code ${code}`);
             }
         });
@@ -337,14 +655,183 @@ async function processVideoAsync(job) {
     }
 }
 
-// Helper function to extract quality from filename
+// Mark the job's outputs as used now, so quota eviction takes older folders first
+function touchOutput(job) {
+    const now = new Date();
+    fs.utimes(path.join(job.outputFolder, '.accessed'), now, now, () => {});
+}
+
+// Parse the output index a finished job wrote, or null if it is missing
+function readOutputIndex(outputFolder) {
+    try {
+        const index = JSON.parse(fs.readFileSync(path.join(outputFolder, 'index.json'), 'utf8'));
+        return Array.isArray(index.rungs) ? index : null;
+    } catch (error) {
+        return null;
+    }
+}
+
+// Object storage URL of an offloaded output; keys are "<stem>/<relative path>"
+function offloadedUrl(job, relative) {
+    const key = [path.basename(job.outputFolder), ...relative.split('/')].map(encodeURIComponent).join('/');
+    return `${offloadUrl.replace(/\/$/, '')}/${key}`;
+}
+
+// Record the outcome of a job and collect its output files
+function finishJob(job, ok, errorText) {
+    if (ok) {
+        job.status = 'completed';
+        job.completedAt = new Date().toISOString();
+        job.progress = 100;
+        job.message = 'Video processing completed successfully';
+
+        // Find output folder
+        const stem = path.basename(job.filepath, path.extname(job.filepath));
+        const outputFolder = path.join(outputRoot, stem);
+
+        // index.json lists every rung with its size, MIME type and duration,
+        // plus the streaming manifests and previews
+        const index = readOutputIndex(outputFolder);
+        if (index) {
+            job.outputFolder = outputFolder;
+            job.index = index;
+            job.processedFiles = index.rungs.map(rung => ({
+                filename: rung.file,
+                quality: extractQuality(rung.file),
+                codec: rung.original ? rung.codec : extractCodec(rung.file),
+                size: rung.size,
+                duration: rung.duration,
+                mime: rung.mime,
+                scores: rung.quality
+            }));
+
+            job.streams = {};
+            for (const [kind, file] of Object.entries(index.streams || {})) {
+                job.streams[kind] = `/api/stream/${job.id}/${file}`;
+            }
+
+            // Poster, seek-preview sprite and its WebVTT track
+            if (index.previews) {
+                job.previews = {
+                    poster: `/api/stream/${job.id}/${index.previews.poster}`,
+                    sprite: `/api/stream/${job.id}/${index.previews.sprite}`,
+                    thumbnails: `/api/stream/${job.id}/${index.previews.thumbnails}`
+                };
+            }
+        }
+
+        console.log(`[${job.id}] Processing completed successfully`);
+    } else {
+        job.status = 'failed';
+        job.progress = 0;
+        job.error = errorText;
+        job.message = 'Video processing failed';
+    }
+}
+
+// Poll a daemon job once a second, replaying its progress events
+function pollDaemonJob(job) {
+    let cursor = 0;
+    const timer = setInterval(async () => {
+        try {
+            const reply = await daemonRequest(['EVENTS', job.daemonId, String(cursor)]);
+            if (!reply.ok) {
+                throw new Error(reply.error);
+            }
+            cursor = reply.next;
+            reply.events.forEach(event => handleProgressEvent(job, event));
+            if (reply.state === 'queued') {
+                job.message = `Queued (position ${reply.position + 1})`;
+            } else if (reply.state !== 'running') {
+                clearInterval(timer);
+                finishJob(job, reply.state === 'completed', `Daemon job ${reply.state}`);
+            }
+        } catch (error) {
+            clearInterval(timer);
+            finishJob(job, false, error.message);
+            console.error(`[${job.id}] Daemon poll failed:`, error.message);
+        }
+    }, 1000);
+}
+
+// Apply one progress event from the C++ process to the job record
+function handleProgressEvent(job, event) {
+    switch (event.event) {
+        case 'stage':
+            if (event.stage === 'probe') {
+                job.message = `Analyzed ${event.width}x${event.height} ${event.video_codec}`;
+            } else if (event.stage === 'package') {
+                job.message = 'Packaging streams...';
+            } else if (event.stage === 'playable') {
+                job.playable = true;
+                job.message = 'Playable renditions ready, encoding higher qualities...';
+            }
+            break;
+        case 'rung_start':
+            job.rungs[event.task] = { status: 'processing', percent: 0 };
+            job.message = `Processing ${event.rung}p quality...`;
+            break;
+        case 'progress':
+            job.rungs[event.task] = {
+                status: 'processing',
+                percent: Math.round(event.percent),
+                fps: event.fps,
+                speed: event.speed,
+                eta: event.eta,
+                bytes: event.bytes
+            };
+            // Encoding spans 20-95%; the rest covers analysis and packaging
+            job.progress = Math.max(job.progress, Math.round(20 + event.job_percent * 0.75));
+            break;
+        case 'rung_done':
+            job.rungs[event.task] = { status: event.ok ? 'completed' : 'failed', percent: 100, bytes: event.bytes };
+            break;
+        case 'rung_quality':
+            job.scores = job.scores || {};
+            job.scores[event.rung] = { ssim: event.ssim, psnr: event.psnr, vmaf: event.vmaf, retuned: event.retuned, dropped: event.dropped };
+            break;
+        case 'error':
+            job.message = `Failed during ${event.stage}: ${event.message}`;
+            break;
+    }
+}
+
+// Flatten OpenMetrics text into { 'name{labels}': value }, leaving out
+// histogram buckets to keep the health response small
+function parseOpenMetrics(text) {
+    const samples = {};
+    for (const line of text.split('\n')) {
+        if (!line || line.startsWith('#') || line.includes('_bucket{')) {
+            continue;
+        }
+        const space = line.lastIndexOf(' ');
+        samples[line.slice(0, space)] = Number(line.slice(space + 1));
+    }
+    return samples;
+}
+
+// Helper function to extract quality from filename, e.g. "720p" or "720p-av1"
 function extractQuality(filename) {
-    const match = filename.match(/(\d+)\.mp4$/);
-    return match ? match[1] + 'p' : 'unknown';
+    const match = filename.match(/ (\d+)(-[a-z0-9]+)?\.mp4$/);
+    return match ? match[1] + 'p' + (match[2] || '') : 'unknown';
+}
+
+// Helper function to extract the codec suffix of a rung filename; encoded rungs without one are H.264
+function extractCodec(filename) {
+    const match = filename.match(/ \d+-([a-z0-9]+)\.mp4$/);
+    return match ? match[1] : 'h264';
 }
 
 // Error handling middleware
 app.use((error, req, res, next) => {
+    if (req.earlyJob && req.earlyJob.child) {
+        // The upload was aborted; stop the process following it
+        req.earlyJob.child.kill();
+    } else if (req.earlyJob && req.earlyJob.daemonId) {
+        // A queued daemon job can still be dropped; a running one times out on --follow-idle
+        daemonRequest(['CANCEL', req.earlyJob.daemonId]).catch(() => {});
+    }
+
     if (error instanceof multer.MulterError) {
         if (error.code === 'LIMIT_FILE_SIZE') {
             return res.status(400).json({ error: 'File too large (max 500MB)' });
@@ -356,6 +843,8 @@ app.use((error, req, res, next) => {
 });
 
 // Start server
+startDaemon();
+
 app.listen(PORT, () => {
     console.log(`🚀 Video Processing API running on port ${PORT}`);
     console.log(`📖 Open http://localhost:${PORT} to access the web interface`);